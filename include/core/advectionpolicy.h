@@ -0,0 +1,85 @@
+/**
+ * @file advectionpolicy.h
+ * @version 0.1
+ *
+ * @section LICENSE
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __FDL_ADVECTIONPOLICY_H
+#define __FDL_ADVECTIONPOLICY_H
+
+#include "core/grid.hpp"
+
+namespace fdl {
+
+/**
+ * Policies that the advection kernels of FluidSolver are instantiated with. An
+ * integrator moves a batch of points back along the velocity field by dt and needs
+ * SCRATCH * n floats of room to do so; an interpolator samples the density field at
+ * a point. FluidSolver picks the pair once per step, so the loops themselves hold
+ * no dispatch.
+ */
+
+/**
+ * Forward Euler: one velocity sample per point, first order.
+ */
+struct EulerIntegrator {
+	enum { SCRATCH = 3 };
+	static void trace(const Grid& grid, float dt, float* px, float* py, float* pz, float* scratch, int n, bool last);
+};
+
+
+/**
+ * Midpoint rule (second order Runge-Kutta): the velocity half a step back.
+ */
+struct MidpointIntegrator {
+	enum { SCRATCH = 6 };
+	static void trace(const Grid& grid, float dt, float* px, float* py, float* pz, float* scratch, int n, bool last);
+};
+
+
+/**
+ * Classic fourth order Runge-Kutta: four velocity samples per point.
+ */
+struct RungeKutta4Integrator {
+	enum { SCRATCH = 9 };
+	static void trace(const Grid& grid, float dt, float* px, float* py, float* pz, float* scratch, int n, bool last);
+};
+
+
+/**
+ * Trilinear interpolation of the density field.
+ */
+struct LinearInterpolator {
+	static Sample sample(const Grid& grid, int cell, float alpha, float beta, float gamma);
+	static Sample sample(const Grid& grid, float x, float y, float z);
+};
+
+
+/**
+ * Catmull-Rom interpolation of the density field. Each channel is clamped after
+ * every axis pass to the range of the two middle values it lies between, so the
+ * spline cannot overshoot.
+ */
+struct CatmullRomInterpolator {
+	static Sample sample(const Grid& grid, int cell, float alpha, float beta, float gamma);
+	static Sample sample(const Grid& grid, float x, float y, float z);
+};
+
+}	// namespace fdl
+
+#endif // __FDL_ADVECTIONPOLICY_H
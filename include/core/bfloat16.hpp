@@ -0,0 +1,62 @@
+/**
+ * @file bfloat16.hpp
+ * @version 0.1
+ *
+ * @section LICENSE
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __FDL_BFLOAT16_H
+#define __FDL_BFLOAT16_H
+
+#include <cstring>
+
+namespace fdl {
+
+/**
+ * bfloat16 storage: the upper half of an IEEE float, i.e. the same exponent range 
+ * with 8 bits of mantissa. Used to halve the memory traffic of operands that do not
+ * need full precision.
+ */
+typedef unsigned short bfloat16;
+
+/**
+ * Rounds a float to the nearest bfloat16 (ties to even).
+ *
+ */
+inline bfloat16 toBFloat16(float f)
+{
+	unsigned int u;
+	std::memcpy(&u, &f, sizeof(u));
+	u += 0x7fff + ((u >> 16) & 1);
+	return (bfloat16) (u >> 16);
+}
+
+/**
+ * Widens a bfloat16 to float, which is exact.
+ *
+ */
+inline float fromBFloat16(bfloat16 h)
+{
+	unsigned int u = (unsigned int) h << 16;
+	float f;
+	std::memcpy(&f, &u, sizeof(f));
+	return f;
+}
+
+}	// namespace fdl
+
+#endif	// __FDL_BFLOAT16_H
@@ -0,0 +1,73 @@
+/**
+ * @file blockjacobi.h
+ * @version 0.1
+ *
+ * @section LICENSE
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __FDL_BLOCKJACOBI_H
+#define __FDL_BLOCKJACOBI_H
+
+#include <vector>
+
+#include "core/common.h"
+#include "core/threadpool.h"
+
+namespace fdl {
+
+/**
+ * Block-Jacobi (non-overlapping additive Schwarz) preconditioner for the 7-point
+ * pressure matrix assembled by the FluidSolver. The grid is split into z-slabs and
+ * each slab is solved with the MIC(0) factorization of its own block of the matrix,
+ * i.e. the couplings between slabs are dropped. The slabs do not depend on each
+ * other, so they are factored and solved in parallel without the per-diagonal
+ * synchronisation of the global wavefront MIC(0), at the price of a few more
+ * iterations the more slabs there are. The preconditioner is symmetric, so it can
+ * be used for conjugate gradients.
+ *
+ * See: B. Smith, P. Bjorstad, W. Gropp. Domain Decomposition. Cambridge University Press, 1996.
+ */
+class BlockJacobi {
+public:
+	BlockJacobi();
+
+	void build(const Vector& diag, const Vector& plusX, const Vector& plusY, const Vector& plusZ,
+		int nx, int ny, int nz, int blocks, ThreadPool* pool);
+	void rescale(float factor);
+	void solve(const Vector& b, Vector& x, ThreadPool* pool);
+
+	int getNumberOfBlocks() const { return (int) m_slabStart.size() - 1; }
+
+private:
+	void factorSlabs(int slabBegin, int slabEnd);
+	void solveSlabs(const float* b, float* x, int slabBegin, int slabEnd);
+
+	int m_nx, m_ny, m_nz;
+	int m_slice;
+
+	/* First z of each slab, and nz at the end */
+	std::vector<int> m_slabStart;
+
+	/* The matrix and the MIC(0) pivots of the blocks */
+	Vector m_diag, m_plusX, m_plusY, m_plusZ;
+	Vector m_precond;
+	Vector m_q;
+};
+
+}	// namespace fdl
+
+#endif	// __FDL_BLOCKJACOBI_H
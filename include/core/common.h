@@ -34,7 +34,12 @@ namespace fdl {
 typedef boost::numeric::ublas::vector<float> Vector;
 
 typedef enum medium_T { FLUID, SOLID, SMOKE, AIR } medium_T;
-typedef enum interp_T { LINEAR, RK2, CATMULLROM } interp_T;
+typedef enum interp_T { LINEAR, CATMULLROM } interp_T;
+typedef enum integration_T { EULER, RK2, RK4 } integration_T;
+typedef enum precond_T { MIC0, MULTIGRID, FAST_POISSON, BLOCK_JACOBI, INCOMPLETE_POISSON } precond_T;
+typedef enum stencil_T { COEFFICIENT_ARRAYS, FACE_FLAGS } stencil_T;
+typedef enum advection_T { SEMI_LAGRANGIAN, MACCORMACK } advection_T;
+typedef enum solver_T { CG, PCG, FUSED_PCG, DEFLATED_PCG, MIXED_PCG, CHEBYSHEV_JACOBI, RB_SOR, SSOR_PCG, COMPACT_PCG, DCT_POISSON, AUTO } solver_T;
 // typedef enum fileFormat_T { POV_RAY, BLENDER, YAFARAY, PPM, PBRT, PNG } fileFormat_T;
 
 const int DIMENSIONS = 3;
@@ -0,0 +1,89 @@
+/**
+ * @file compactpoisson.h
+ * @version 0.1
+ *
+ * @section LICENSE
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __FDL_COMPACTPOISSON_H
+#define __FDL_COMPACTPOISSON_H
+
+#include <vector>
+
+#include "core/common.h"
+#include "core/convergencemonitor.h"
+#include "core/threadpool.h"
+
+namespace fdl {
+
+/**
+ * MIC(0) preconditioned CG on the fluid cells only. The fluid cells are numbered in
+ * grid order, so the -x/+x neighbors of an unknown are the previous/next unknown and
+ * only the y and z neighbors need an index; the links to fluid neighbors are kept as
+ * 6 face flags. Memory and work per iteration scale with the number of fluid cells
+ * instead of the bounding box, and no kernel looks at solid cells.
+ *
+ * The system is solved with unit couplings, A/s x = b/s, so that neither the index
+ * nor the factorization depends on dt; they are rebuilt by build when the solid cells
+ * change.
+ */
+class CompactPoisson {
+public:
+	CompactPoisson();
+
+	void build(const Vector& fluidMask, int nx, int ny, int nz, float tau=0.97f, float rho=0.25f);
+	float solve(const Vector& b, Vector& x, float scale, ConvergenceMonitor& monitor, ThreadPool* pool);
+
+	int getNumberOfUnknowns() const { return (int) m_cells.size(); }
+
+private:
+	enum {
+		LINK_MINUS_X = 1, LINK_PLUS_X = 2,
+		LINK_MINUS_Y = 4, LINK_PLUS_Y = 8,
+		LINK_MINUS_Z = 16, LINK_PLUS_Z = 32
+	};
+
+	void factor(float tau, float rho);
+	void precondition(const float* r, float* z);
+	void multiplyBlocks(const float* x, float* y, int blockBegin, int blockEnd) const;
+	void dotBlocks(const float* a, const float* b, double* sums, int blockBegin, int blockEnd) const;
+	void lowerSweepRows(const float* b, int d, int yBegin, int yEnd);
+	void upperSweepRows(float* x, int d, int yBegin, int yEnd);
+	double dot(const std::vector<float>& a, const std::vector<float>& b);
+	void removeMean(float* x);
+
+	int m_nx, m_ny, m_nz;
+	ThreadPool* m_pool;
+
+	/* Grid cell of each unknown and first unknown of each x-row (y + z*ny) */
+	std::vector<int> m_cells;
+	std::vector<int> m_rowStart;
+
+	/* Fluid links of each unknown and the unknowns of the y and z neighbors */
+	std::vector<unsigned char> m_links;
+	std::vector<int> m_minusY, m_plusY, m_minusZ, m_plusZ;
+
+	/* MIC(0) pivots of the unit matrix */
+	std::vector<float> m_precond;
+
+	/* CG vectors */
+	std::vector<float> m_x, m_r, m_z, m_p, m_w, m_q;
+};
+
+}	// namespace fdl
+
+#endif	// __FDL_COMPACTPOISSON_H
@@ -0,0 +1,77 @@
+/**
+ * @file convergencemonitor.h
+ * @version 0.1
+ *
+ * @section LICENSE
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __FDL_CONVERGENCEMONITOR_H
+#define __FDL_CONVERGENCEMONITOR_H
+
+#include <vector>
+
+namespace fdl {
+
+/**
+ * Decides when an iterative solve stops and keeps its residual history. A solve
+ * stops when the residual reaches the tolerance, when the maximum number of
+ * iterations is reached, or when the best residual has not dropped by the
+ * stagnation factor over the last window of checks. The last two are logged as
+ * warnings since the pressure is then less accurate than asked for. Solvers whose
+ * residual is not expected to decrease steadily (e.g. Chebyshev iterations) turn the
+ * stagnation test off for their solve with ignoreStagnation.
+ *
+ * Residuals are given as the "norm squared" the solvers compute (r^T r or
+ * r^T M^-1 r); the history holds their square roots.
+ */
+class ConvergenceMonitor {
+public:
+	ConvergenceMonitor();
+
+	void begin(const char* name, float tolerance, unsigned maxIter);
+	bool proceed(double rho, unsigned iteration);
+	void end();
+
+	void setStagnation(unsigned window, float factor) { m_window = window; m_factor = factor; }
+	void ignoreStagnation() { m_checkStagnation = false; }
+
+	float getTolerance() const { return m_tolerance; }
+	unsigned getMaxIterations() const { return m_maxIter; }
+	const std::vector<float>& getHistory() const { return m_history; }
+	unsigned getIterations() const { return m_iterations; }
+	bool hasConverged() const { return m_converged; }
+	bool hasStagnated() const { return m_stagnated; }
+
+private:
+	const char* m_name;
+	float m_tolerance;
+	unsigned m_maxIter;
+
+	/* Stagnation test: the best residual must drop by m_factor every m_window checks */
+	unsigned m_window;
+	float m_factor;
+	bool m_checkStagnation;
+
+	std::vector<float> m_history;
+	unsigned m_iterations;
+	bool m_converged;
+	bool m_stagnated;
+};
+
+}	// namespace fdl
+
+#endif	// __FDL_CONVERGENCEMONITOR_H
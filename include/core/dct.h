@@ -0,0 +1,69 @@
+/**
+ * @file dct.h
+ * @version 0.1
+ *
+ * @section LICENSE
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __FDL_DCT_H
+#define __FDL_DCT_H
+
+#include <complex>
+#include <vector>
+
+namespace fdl {
+
+/**
+ * One dimensional discrete cosine transform of a fixed length. forward is the
+ * (unnormalized) DCT-II, \f$X_k = \sum_i x_i \cos(\pi k (2i+1) / 2n)\f$, and inverse is
+ * the matching scaled DCT-III so that inverse(forward(x)) = x. Power of two lengths
+ * go through a complex FFT of the same length (Makhoul's reordering), other lengths
+ * through a precomputed cosine table.
+ *
+ * See: J. Makhoul. A fast cosine transform in one and two dimensions. IEEE Trans.
+ * Acoust. Speech Signal Process. 28(1), pages 27-34, 1980.
+ */
+class DCT {
+public:
+	DCT();
+
+	void init(int n);
+	int size() const { return m_n; }
+
+	void forward(double* data, std::complex<double>* work) const;
+	void inverse(double* data, std::complex<double>* work) const;
+
+private:
+	void fft(std::complex<double>* a, bool inverse) const;
+
+	int m_n;
+	bool m_radix2;
+
+	/* exp(-i pi k / 2n) */
+	std::vector<std::complex<double> > m_twiddle;
+
+	/* FFT roots of unity and bit reversal permutation */
+	std::vector<std::complex<double> > m_roots;
+	std::vector<int> m_bitReverse;
+
+	/* cos(pi k (2i+1) / 2n), for lengths that are not a power of two */
+	std::vector<double> m_cos;
+};
+
+}	// namespace fdl
+
+#endif	// __FDL_DCT_H
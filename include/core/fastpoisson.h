@@ -0,0 +1,63 @@
+/**
+ * @file fastpoisson.h
+ * @version 0.1
+ *
+ * @section LICENSE
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __FDL_FASTPOISSON_H
+#define __FDL_FASTPOISSON_H
+
+#include <vector>
+
+#include "core/common.h"
+#include "core/dct.h"
+#include "core/threadpool.h"
+
+namespace fdl {
+
+/**
+ * Direct solver for the pressure matrix of a box without solid cells. With walls all
+ * around, that matrix is the cell-centered Neumann Laplacian, which the DCT-II along
+ * each axis diagonalizes: the eigenvalue of mode (i,j,k) is 
+ * \f$s (\lambda_i + \lambda_j + \lambda_k)\f$ with \f$\lambda_i = 2 - 2\cos(\pi i / n)\f$.
+ * A solve is three forward transforms, a division and three inverse transforms, 
+ * O(N log N) with no iterations. The constant mode is the null space and is set to 0.
+ */
+class FastPoisson {
+public:
+	FastPoisson();
+
+	void build(int nx, int ny, int nz, float scale);
+	void solve(const Vector& b, Vector& x, ThreadPool* pool);
+
+private:
+	void transformRows(float* data, bool inverse, int rowBegin, int rowEnd);
+	void transformSlices(float* data, bool inverse, int zBegin, int zEnd);
+	void transformColumns(float* data, bool inverse, int yBegin, int yEnd);
+	void divideSlices(float* data, int zBegin, int zEnd);
+
+	int m_nx, m_ny, m_nz;
+	int m_slice;
+	float m_scale;
+	DCT m_dctX, m_dctY, m_dctZ;
+	std::vector<double> m_eigenX, m_eigenY, m_eigenZ;
+};
+
+}	// namespace fdl
+
+#endif	// __FDL_FASTPOISSON_H
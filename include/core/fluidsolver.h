@@ -25,12 +25,21 @@
 
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <iostream>
+#include <string>
 #include <vector>
 
+#include "core/bfloat16.hpp"
+#include "core/blockjacobi.h"
 #include "core/common.h"
+#include "core/compactpoisson.h"
+#include "core/convergencemonitor.h"
 #include "core/vector.hpp"
 #include "core/grid.hpp"
+#include "core/fastpoisson.h"
+#include "core/multigrid.h"
+#include "core/threadpool.h"
 
 namespace fdl {
 
@@ -44,11 +53,26 @@ public:
 	void addDensity(float dt);
 	void applyForces(float dt);
 	void advect(float dt);
+	void advectScalar(const Vector& field, Vector& result);
 	void diffuse(float dt, float rate=0.25f);
 	void diffuseHeat(float dt, float rate);
 	void applyViscosity(float dt);
 	void setCGTolerance(float tol); 
 	void setCGMaxIter(unsigned N);
+	void setRelativeTolerance(float tol) { m_relativeTolerance = tol; }
+	const ConvergenceMonitor& getConvergenceMonitor() const { return m_monitor; }
+	void setPreconditioner(precond_T type);
+	void setSolver(solver_T type) { m_solver = type; }
+	bool setSolver(const std::string& name);
+	void setStencil(stencil_T type) { m_stencil = type; }
+	void setAdvection(advection_T type) { m_advection = type; }
+	void setInterpolation(interp_T type) { m_interpolation = type; }
+	void setIntegration(integration_T type) { m_integration = type; }
+	static std::string getSolverNames();
+	void setNumberOfThreads(int threads);
+	void setDeflationSize(unsigned n);
+	void setActivityThreshold(float threshold);
+	float batchPcgSolve(const std::vector<Vector>& b, std::vector<Vector>& x, float dt);
 	
 	void setSourceSize(fdl::Vector3f& );
 	void setSourcePos(fdl::Vector3f& );
@@ -66,40 +90,215 @@ public:
 	float getResidual() {return std::sqrt(m_tmp_residual); }
     
 protected:
+	typedef float (FluidSolver::*SolveMethod)(const Vector& b, Vector& x);
+	typedef void (FluidSolver::*PrecondMethod)(const Vector& b, Vector& x);
+
+	/* An entry of the linear solver registry */
+	struct SolverEntry {
+		const char* name;
+		solver_T type;
+		SolveMethod solve;
+	};
+	static const SolverEntry s_solvers[];
+
 	float computeMaxTimeStep() const;
+	void scanTiles();
+	void scanTileSlices(float* speeds, int tzBegin, int tzEnd);
+	void dilateTiles(float dt);
+	const unsigned char* activeTileRow(int y, int z) const;
+	template<class Interpolator> void addBuoyancy();
+	template<class Integrator> void advectWith(float dt);
+	template<class Integrator, class Interpolator> void advectWith(float dt);
+	template<class Integrator> void traceCellSlices(float dt, int zBegin, int zEnd);
+	template<class Interpolator> void advectDensitySlices(int zBegin, int zEnd);
+	void advectScalarSlices(const float* field, float* result, int zBegin, int zEnd) const;
+	template<class Integrator> void advectVelocitySlices(float dt, int zBegin, int zEnd);
+	template<class Integrator, class Interpolator> void correctDensitySlices(float dt, int zBegin, int zEnd);
+	template<class Integrator> void correctVelocitySlices(float dt, int c, int zBegin, int zEnd);
 	void axpy_prod(const Vector& x, Vector& y) const;
+	void laplacianRows(const float* x, float* y, int rowBegin, int rowEnd) const;
+	float laplacianAt(const float* x, int pos, int i, int j, int k) const;
+	void laplacianFlagRows(const float* x, float* y, int rowBegin, int rowEnd) const;
+	float laplacianFlagAt(const float* x, int pos) const;
+	void removeNullSpace(Vector& x);
+	void sumSlices(const float* x, double* sums, int zBegin, int zEnd) const;
+	void shiftSlices(float* x, float shift, int zBegin, int zEnd) const;
 	void solvePreconditioner(const Vector& b, Vector& x);
+	void triangularSolve(const Vector& b, Vector& x, const float* pivots);
+	void lowPrecisionSolve(const Vector& b, Vector& x);
+	void lowerSweepRows(const float* b, const float* precond, int d, int yBegin, int yEnd);
+	void upperSweepRows(float* x, const float* precond, int d, int yBegin, int yEnd);
+	void lowerSweepRowsLow(const float* b, int d, int yBegin, int yEnd);
+	void upperSweepRowsLow(float* x, int d, int yBegin, int yEnd);
+	void lowerSweepRowsFlags(const float* b, const float* precond, int d, int yBegin, int yEnd);
+	void upperSweepRowsFlags(float* x, const float* precond, int d, int yBegin, int yEnd);
+	void updateLowPrecision();
 	void constructMatrix(float dx, float dt, float rho=0.25f);//, bool variable_density=false);
 	//void constructMatrix(float dx, float dt, float rho=0.25f, bool variable_density=false);
+	void assembleMatrixRows(int x0, int x1, int y0, int y1, int z0, int z1);
+	void updateMaskSlices(int x0, int x1, int y0, int y1, int* changes, int zBegin, int zEnd);
+	void assembleSlices(int x0, int x1, int y0, int y1, int zBegin, int zEnd);
 	void constructPreconditioner(float rho=0.25f, float tau=0.97f);
+	void factorPreconditionerRows(int x0, int x1, int y0, int y1, int z0, int z1, float rho=0.25f, float tau=0.97f);
+	void incompletePoissonLowerRows(const float* r, float* u, int rowBegin, int rowEnd) const;
+	void incompletePoissonUpperRows(const float* u, float* z, int rowBegin, int rowEnd) const;
+	void factorDiagonalRows(int x0, int x1, int d, float rho, float tau, int yBegin, int yEnd);
+	void factorRowGroup(int x0, int x1, int d, float rho, float tau, int y, int count);
+	void updatePressureSystem(float dx, float dt, float rho);
 	float cgSolve(const Vector& b, Vector& x);
 	float pcgSolve(const Vector& b, Vector& x);
+	float preconditionedCG(const Vector& b, Vector& x, PrecondMethod precond, const char* name);
+	float chebyshevJacobiSolve(const Vector& b, Vector& x);
+	float sorSolve(const Vector& b, Vector& x);
+	float ssorPcgSolve(const Vector& b, Vector& x);
+	void applySSOR(const Vector& b, Vector& x);
+	void relaxSlices(const float* b, float* x, int color, float omega, int zBegin, int zEnd);
+	void jacobiSlices(const float* r, float* z, int zBegin, int zEnd) const;
+	void relax(const Vector& b, Vector& x, int color, float omega);
+	float sorFactor() const;
+	float fusedPcgSolve(const Vector& b, Vector& x);
+	float fastPoissonSolve(const Vector& b, Vector& x);
+	float compactPcgSolve(const Vector& b, Vector& x);
+	float solverTolerance(const Vector& b);
+	float solvePressure(const Vector& b, Vector& x);
+	void batchLaplacianRows(const float* x, float* y, int k, int rowBegin, int rowEnd) const;
+	void batchPrecondition(int k);
+	void batchLowerSweepRows(int k, int d, int yBegin, int yEnd);
+	void batchUpperSweepRows(int k, int d, int yBegin, int yEnd);
+	void batchDots(const float* a, const float* b, int k, std::vector<double>& dots);
+	void batchDotSlices(const float* a, const float* b, int k, double* sums, int zBegin, int zEnd) const;
+	void batchUpdateSlices(const float* alpha, int k, int zBegin, int zEnd);
+	void batchDirectionSlices(const float* beta, int k, int zBegin, int zEnd);
+	float mixedPcgSolve(const Vector& b, Vector& x);
+	void residualRows(const double* x, const float* b, float* r, int rowBegin, int rowEnd) const;
+	double innerProduct(const Vector& a, const Vector& b);
+	void dotSlices(const float* a, const float* b, double* sums, int zBegin, int zEnd) const;
+	void fusedUpdateSlices(float alpha, float beta, float* x, int zBegin, int zEnd);
+	void laplacianDotRows(const float* u, float* w, const float* r, double* dots, int rowBegin, int rowEnd) const;
+	float deflatedPcgSolve(const Vector& b, Vector& x);
+	void recycleSolution(const Vector& x);
+	void factorDeflationSystem();
+	void deflationDots(const std::deque<Vector>& basis, const Vector& v, std::vector<double>& dots);
+	void deflationDotSlices(const std::deque<Vector>* basis, const float* v, double* sums, int zBegin, int zEnd) const;
+	void deflationUpdate(const std::deque<Vector>& basis, const std::vector<double>& coefficients, float sign, Vector& v);
+	void deflationUpdateSlices(const std::deque<Vector>* basis, const float* c, float* v, int zBegin, int zEnd) const;
+	void solveDeflationSystem(std::vector<double>& y) const;
+	void rescaleDeflationBasis(float ratio);
+	void clearDeflationBasis();
 	
 private:
 	/* Vorticity confinement vectors */
 	std::vector<fdl::Vector3> m_curl;
 	std::vector<fdl::Vector3> m_vorticityConfinementForce;
 	Vector m_curlMagnitude;
+
+	/* Departure points of the fluid cell centers for the current step, as the cell the
+	   point falls in (-1 outside of the grid) and the position within it; see locateCell */
+	std::vector<int> m_departureCell;
+	std::vector<float> m_departureAlpha, m_departureBeta, m_departureGamma;
+
+	/* Activity of blocks of TILE_SIZE^3 cells. A tile is occupied when its velocity, or
+	   the change of density, smoke or temperature from cell to cell, is above
+	   m_activityThreshold, and active when it lies within the distance the flow and the
+	   samplers reach from an occupied tile in a step. advect, applyForces and diffuse
+	   leave the cells of inactive tiles as they are. A negative threshold (the default)
+	   keeps every tile active. */
+	enum { TILE_SIZE = 8 };
+	int m_tilesX, m_tilesY, m_tilesZ;
+	std::vector<unsigned char> m_occupiedTiles, m_activeTiles;
+	float m_activityThreshold;
+	float m_maxSpeed;
+
+	/* Advection scheme, and the corrected fields of MACCORMACK before they replace
+	   the semi-lagrangian ones */
+	advection_T m_advection;
+	SampleArray m_densityCorrection;
+	Vector m_velocityCorrection;
+
+	/* Density interpolation and back-trace integration of advect */
+	interp_T m_interpolation;
+	integration_T m_integration;
 	
 	/* Grid discretized domain */
 	fdl::Grid* grid;
 
+	/* Worker threads for the parallel kernels */
+	ThreadPool* m_pool;
+
 	/* Vectors for the Hodge decomposition */
 	Vector m_divergence;
 	Vector m_pressure;
 
 	/* Temporary vectors for the PCG iteration */
-	Vector m_tempP, m_tempW, m_tempZ, m_tempR, m_tempQ;
+	Vector m_tempP, m_tempW, m_tempZ, m_tempR, m_tempQ, m_tempS;
+
+	/* Interleaved vectors of batchPcgSolve, entry j of cell pos at pos*k+j */
+	std::vector<float> m_batchX, m_batchR, m_batchZ, m_batchP, m_batchW, m_batchQ;
+	solver_T m_solver;
+
+	/* Deflation basis for DEFLATED_PCG: past solutions W, AW and the Cholesky factor 
+	   of W^T A W */
+	std::deque<Vector> m_deflationW, m_deflationAW;
+	std::vector<double> m_deflationE;
+	unsigned m_deflationSize;
 
 	/* Pressure matrix */
 	Vector m_ADiag, m_APlusX, m_APlusY, m_APlusZ;
+
+	/* Matrix-free form of the same matrix: 1 for fluid cells, 0 for solids, and the 
+	   uniform coupling dt/(rho*dx^2) */
+	Vector m_fluidMask;
+	float m_matrixScale;
+	int m_fluidCells;
+
+	/* The same matrix again as the open faces of each fluid cell, one bit per face
+	   (FACE_MINUS_X .. FACE_PLUS_Z): 1 byte per cell instead of the 16 of the
+	   coefficient arrays. The FACE_FLAGS stencil solves with it. */
+	enum { FACE_MINUS_X = 1, FACE_PLUS_X = 2, FACE_MINUS_Y = 4, FACE_PLUS_Y = 8, FACE_MINUS_Z = 16, FACE_PLUS_Z = 32 };
+	std::vector<unsigned char> m_faceFlags;
+	stencil_T m_stencil;
 	
 	/* Modified incomplete cholesky preconditioner */
 	Vector m_precond;
+
+	/* Inverse diagonal of the incomplete Poisson preconditioner, 0 where the diagonal is */
+	Vector m_invDiag;
+
+	/* Pivots of the SSOR preconditioner, sqrt(omega/diag), recomputed when the matrix
+	   has changed */
+	Vector m_ssorPivots;
+	bool m_ssorDirty;
+
+	/* Set when the MIC(0) pivots in m_precond are out of date while another 
+	   preconditioner is selected, which batchPcgSolve factors them for */
+	bool m_batchFactorDirty;
+
+	/* bfloat16 copies for MIXED_PCG: the pivots and their products with the couplings
+	   (0 on solid cells, so the sweeps need not look at the grid) */
+	std::vector<bfloat16> m_precondLow, m_couplingLowX, m_couplingLowY, m_couplingLowZ;
+	bool m_lowPrecisionDirty;
+
+	/* Multigrid preconditioner */
+	precond_T m_preconditioner;
+	Multigrid m_multigrid;
+
+	/* DCT solver of the obstacle-free matrix, the default when there are no solids */
+	FastPoisson m_fastPoisson;
+
+	/* MIC(0) of z-slabs, one per thread */
+	BlockJacobi m_blockJacobi;
+
+	/* PCG over the fluid cells only, rebuilt when the solids change */
+	CompactPoisson m_compactPoisson;
+	bool m_compactDirty;
 	
 	/* Linear algebra stopping conditions */
 	float tol_cg; 
 	unsigned maxiter_cg;
+
+	/* Fraction of the divergence left by the solve, 0 to always solve to tol_cg */
+	float m_relativeTolerance;
+	ConvergenceMonitor m_monitor;
 	
 	/* Gravity vector */
 	fdl::Vector3f m_gravity;
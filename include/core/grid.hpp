@@ -23,6 +23,7 @@
 #ifndef __FDL_GRID_H
 #define __FDL_GRID_H
 
+#include <algorithm>
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
@@ -30,6 +31,7 @@
 #include <math.h>
 
 #include "core/common.h"
+#include "core/simd.hpp"
 #include "core/vector.hpp"
 #include "logger/logger.h"
 
@@ -129,27 +131,237 @@ struct Sample {
 	}
 };
 
+
+/**
+ * Reference to the medium of a cell stored in a SampleArray. Media are kept as one
+ * byte per cell, so they are converted on the way in and out.
+ */
+struct MediumRef {
+	unsigned char& value;
+
+	inline MediumRef(unsigned char& _value) : value(_value) {}
+
+	inline operator medium_T() const { return (medium_T) value; }
+
+	inline MediumRef& operator=(medium_T m)
+	{
+		value = (unsigned char) m;
+		return *this;
+	}
+
+	inline MediumRef& operator=(const MediumRef& m)
+	{
+		value = m.value;
+		return *this;
+	}
+};
+
+
+/**
+ * Reference to a cell stored in a SampleArray. It reads and writes the channels of
+ * the cell through the same member names as Sample and converts to and from Sample,
+ * so code written for a std::vector<Sample> works unchanged.
+ */
+struct SampleRef {
+	float& density;
+	float& smoke;
+	float& temperature;
+	float& volume;
+	MediumRef medium;
+
+	inline SampleRef(float& _r, float& _s, float& _t, float& _v, unsigned char& _m)
+		: density(_r), smoke(_s), temperature(_t), volume(_v), medium(_m) {}
+
+	inline operator Sample() const
+	{
+		Sample sample(density, smoke, temperature, volume);
+		sample.medium = medium;
+		return sample;
+	}
+
+	inline SampleRef& operator=(const Sample& v)
+	{
+		density = v.density;
+		smoke = v.smoke;
+		temperature = v.temperature;
+		volume = v.volume;
+		medium = v.medium;
+		return *this;
+	}
+
+	inline SampleRef& operator=(const SampleRef& v)
+	{
+		return operator=((Sample) v);
+	}
+};
+
+
+/**
+ * Structure of arrays storage for the cells of a TGrid<Sample>. Every channel is a
+ * contiguous array of its own and the media are one byte per cell, so a kernel only
+ * streams the channels it uses: the solid test reads one byte per cell instead of a
+ * whole Sample. Cells are accessed through SampleRef, or by value when constant.
+ */
+class SampleArray {
+public:
+	SampleArray() {}
+
+	void resize(size_t n)
+	{
+		m_density.resize(n, 0.05f);
+		m_smoke.resize(n, 0.0f);
+		m_temperature.resize(n, 0.0f);
+		m_volume.resize(n, 1.0f);
+		m_medium.resize(n, (unsigned char) FLUID);
+	}
+
+	size_t size() const { return m_density.size(); }
+
+	void swap(SampleArray& a)
+	{
+		m_density.swap(a.m_density);
+		m_smoke.swap(a.m_smoke);
+		m_temperature.swap(a.m_temperature);
+		m_volume.swap(a.m_volume);
+		m_medium.swap(a.m_medium);
+	}
+
+	/**
+	 * Sets every cell to a sample, the medium included.
+	 *
+	 * @param value the Sample value
+	 */
+	void fill(const Sample& value)
+	{
+		std::fill(m_density.begin(), m_density.end(), value.density);
+		std::fill(m_smoke.begin(), m_smoke.end(), value.smoke);
+		std::fill(m_temperature.begin(), m_temperature.end(), value.temperature);
+		std::fill(m_volume.begin(), m_volume.end(), value.volume);
+		std::fill(m_medium.begin(), m_medium.end(), (unsigned char) value.medium);
+	}
+
+	inline SampleRef operator[](size_t i)
+	{
+		return SampleRef(m_density[i], m_smoke[i], m_temperature[i], m_volume[i], m_medium[i]);
+	}
+
+	inline Sample operator[](size_t i) const
+	{
+		Sample sample(m_density[i], m_smoke[i], m_temperature[i], m_volume[i]);
+		sample.medium = (medium_T) m_medium[i];
+		return sample;
+	}
+
+	inline medium_T medium(size_t i) const { return (medium_T) m_medium[i]; }
+
+	float* densityData() { return &m_density[0]; }
+	float* smokeData() { return &m_smoke[0]; }
+	float* temperatureData() { return &m_temperature[0]; }
+	float* volumeData() { return &m_volume[0]; }
+	unsigned char* mediumData() { return &m_medium[0]; }
+	const float* densityData() const { return &m_density[0]; }
+	const float* smokeData() const { return &m_smoke[0]; }
+	const float* temperatureData() const { return &m_temperature[0]; }
+	const float* volumeData() const { return &m_volume[0]; }
+	const unsigned char* mediumData() const { return &m_medium[0]; }
+
+private:
+	std::vector<float> m_density;
+	std::vector<float> m_smoke;
+	std::vector<float> m_temperature;
+	std::vector<float> m_volume;
+	std::vector<unsigned char> m_medium;
+};
+
+
+/**
+ * Storage of the cell centered values of a TGrid. Scalar grids use a plain vector
+ * while grids of Sample store each channel in an array of its own.
+ */
+template<class T>
+struct CellStorage {
+	typedef std::vector<T> type;
+	static medium_T medium(const type& cells, int index) { return cells[index].medium; }
+	static void clear(type& cells) { std::fill(cells.begin(), cells.end(), 0); }
+};
+
+template<>
+struct CellStorage<Sample> {
+	typedef SampleArray type;
+	static medium_T medium(const type& cells, int index) { return cells.medium(index); }
+	static void clear(type& cells) { cells.fill(0); }
+};
+
+/**
+ * Storage policy of TGrid. It gives the types of the face centered fields
+ * (velocities and forces) and of the cell centered values, and the few operations
+ * whose form depends on them. Cells and faces are addressed by their coordinates
+ * along with their linear index.
+ *
+ * DenseStorage allocates every value up front in flat arrays, which is what the
+ * FluidSolver kernels work on.
+ */
 template<class T>
+struct DenseStorage {
+	typedef Vector field_type;
+	typedef typename CellStorage<T>::type cell_type;
+
+	static void announce(int x, int y, int z)
+	{
+		int numPoints = x * y * z;
+		int velocityPoints = (x+1) * (y+1) * (z+1);
+		std::cout << "FluidSolver: Allocating " << (sizeof(float)*(numPoints*15 + velocityPoints*DIMENSIONS*3)
+			+ numPoints*2*sizeof(double))/1024 << " KB for a " << x << "x" << y << "x" << z << " MAC grid.." << std::endl;
+	}
+	static void allocateField(field_type& field, int x, int y, int z) { field.resize(x * y * z); }
+	static void allocateCells(cell_type& cells, int x, int y, int z) { cells.resize(x * y * z); }
+	static void clearField(field_type& field) { std::fill(field.begin(), field.end(), 0); }
+	static void clearCells(cell_type& cells) { CellStorage<T>::clear(cells); }
+	static medium_T medium(const cell_type& cells, int index) { return CellStorage<T>::medium(cells, index); }
+
+	static inline T cell(const cell_type& cells, int, int, int, int index) { return cells[index]; }
+
+	/**
+	 * Gathers the eight faces from (i, j, k) to (i+1, j+1, k+1) of a field whose
+	 * rows hold rowSize values and slices sliceSize.
+	 */
+	static inline void corners(const field_type& field, int, int, int, int index, int rowSize, int sliceSize, float* out, int stride)
+	{
+		const float* a = &field[0] + index;
+		out[0] = a[0];
+		out[stride] = a[1];
+		out[2*stride] = a[rowSize];
+		out[3*stride] = a[rowSize + 1];
+		out[4*stride] = a[sliceSize];
+		out[5*stride] = a[sliceSize + 1];
+		out[6*stride] = a[sliceSize + rowSize];
+		out[7*stride] = a[sliceSize + rowSize + 1];
+	}
+};
+
+
+template<class T, class Storage = DenseStorage<T> >
 class TGrid {
 public:
+	typedef typename Storage::field_type field_type;
+	typedef typename Storage::cell_type cell_type;
+
 	TGrid(int _x, int _y, int _z, float _dx) : m_gridX(_x), m_gridY(_y), m_gridZ(_z), m_dx(_dx)
 	{
-		int velocityPoints = (m_gridX+1) * (m_gridY+1) * (m_gridZ+1);
 		m_numPoints = m_gridX * m_gridY * m_gridZ;
 		m_slice = m_gridX * m_gridY;
 		m_velSlice = (m_gridX+1) * (m_gridY+1);
 
-		std::cout << "FluidSolver: Allocating " << (sizeof(float)*(m_numPoints*15 + velocityPoints*DIMENSIONS*3)
-			+ m_numPoints*2*sizeof(double))/1024 << " KB for a " << m_gridX << "x" << m_gridY << "x" << m_gridZ << " MAC grid.." << std::endl;
+		Storage::announce(m_gridX, m_gridY, m_gridZ);
 		m_invDx = 1.0f / m_dx;
 
-		/* Allocate dense vectors for all quantities, which are stored on the MAC grid. */
-		m_d0.resize(m_numPoints);
-		m_d1.resize(m_numPoints);
+		/* Allocate all quantities, which are stored on the MAC grid. */
+		Storage::allocateCells(m_d0, m_gridX, m_gridY, m_gridZ);
+		Storage::allocateCells(m_d1, m_gridX, m_gridY, m_gridZ);
 		for (int i=0; i<DIMENSIONS; ++i) {
-			m_forces[i].resize(velocityPoints);
-			m_u0[i].resize(velocityPoints);
-			m_u1[i].resize(velocityPoints);
+			Storage::allocateField(m_forces[i], m_gridX+1, m_gridY+1, m_gridZ+1);
+			Storage::allocateField(m_u0[i], m_gridX+1, m_gridY+1, m_gridZ+1);
+			Storage::allocateField(m_u1[i], m_gridX+1, m_gridY+1, m_gridZ+1);
 		}
 		// m_solid = new bool[m_numPoints];
 		// memset(m_solid, 0, sizeof(bool)*m_numPoints);
@@ -176,9 +388,9 @@ public:
 	 *
 	 * @return a copy of the grid
 	 */
-	TGrid<T>* copy()
+	TGrid* copy()
 	{
-		TGrid<T>* _g = new TGrid<T>(m_gridX, m_gridY, m_gridZ, m_dx);
+		TGrid* _g = new TGrid(m_gridX, m_gridY, m_gridZ, m_dx);
 		
 		for(int i=0; i<DIMENSIONS; i++){
 			_g->m_u0[i] = this->getVelocity(i);
@@ -217,9 +429,9 @@ public:
 	 */
 	void clearForces()
 	{
-		std::fill(m_forces[0].begin(), m_forces[0].end(), 0);
-		std::fill(m_forces[1].begin(), m_forces[1].end(), 0);
-		std::fill(m_forces[2].begin(), m_forces[2].end(), 0);
+		Storage::clearField(m_forces[0]);
+		Storage::clearField(m_forces[1]);
+		Storage::clearField(m_forces[2]);
 	}
 
 	/**
@@ -228,13 +440,13 @@ public:
 	 */
 	void clearVelocities()
 	{
-		std::fill(m_u0[0].begin(), m_u0[0].end(), 0);
-		std::fill(m_u0[1].begin(), m_u0[1].end(), 0);
-		std::fill(m_u0[2].begin(), m_u0[2].end(), 0);
+		Storage::clearField(m_u0[0]);
+		Storage::clearField(m_u0[1]);
+		Storage::clearField(m_u0[2]);
 
-		std::fill(m_u1[0].begin(), m_u1[0].end(), 0);
-		std::fill(m_u1[1].begin(), m_u1[1].end(), 0);
-		std::fill(m_u1[2].begin(), m_u1[2].end(), 0);
+		Storage::clearField(m_u1[0]);
+		Storage::clearField(m_u1[1]);
+		Storage::clearField(m_u1[2]);
 	}
 
 	/**
@@ -243,11 +455,10 @@ public:
 	 */
 	void clearDensities()
 	{
-		std::fill(m_d0.begin(), m_d0.end(), 0);
-		std::fill(m_d1.begin(), m_d1.end(), 0);
+		Storage::clearCells(m_d0);
+		Storage::clearCells(m_d1);
 	}
 
-
 	/**
 	 * Updates a value of the force field at a position given a dimension.
 	 *
@@ -358,20 +569,152 @@ public:
 		float alpha = x-i;
 		float beta = y-j;
 		float gamma = z-k;
-		float A1 = m_u0[c][pos];
-		float B1 = m_u0[c][pos + 1];
-		float C1 = m_u0[c][pos + m_gridX + 1];
-		float D1 = m_u0[c][pos + m_gridX + 2];
-		float A2 = m_u0[c][pos + m_velSlice];
-		float B2 = m_u0[c][pos + m_velSlice + 1];
-		float C2 = m_u0[c][pos + m_velSlice + m_gridX + 1];
-		float D2 = m_u0[c][pos + m_velSlice + m_gridX + 2];
+		float corner[8];
+		Storage::corners(m_u0[c], i, j, k, pos, m_gridX + 1, m_velSlice, corner, 1);
+		float A1 = corner[0];
+		float B1 = corner[1];
+		float C1 = corner[2];
+		float D1 = corner[3];
+		float A2 = corner[4];
+		float B2 = corner[5];
+		float C2 = corner[6];
+		float D2 = corner[7];
 
 		return (1-gamma) * ((1-alpha) * (1-beta) * A1 + alpha * (1-beta) * B1 + (1-alpha) * beta * C1 + alpha*beta*D1)
 			 	+ gamma * ((1-alpha) * (1-beta) * A2 + alpha * (1-beta) * B2 + (1-alpha) * beta * C2 + alpha*beta*D2);
 	}
 
 
+	/**
+	 * Samples the velocity field at n points, the batched form of getVelocity. The
+	 * points are given as separate coordinate arrays.
+	 *
+	 * @param px the x coordinates to sample at
+	 * @param py the y coordinates to sample at
+	 * @param pz the z coordinates to sample at
+	 * @param ux the x components of the sampled velocities
+	 * @param uy the y components of the sampled velocities
+	 * @param uz the z components of the sampled velocities
+	 * @param n the number of points
+	 * @param last sample the "old" velocity field (m_u1) instead
+	 *
+	 */
+	void getVelocities(const float* px, const float* py, const float* pz, float* ux, float* uy, float* uz, int n, bool last=false) const
+	{
+		getVelocityComponents(px, py, pz, 0, ux, n, last);
+		getVelocityComponents(px, py, pz, 1, uy, n, last);
+		getVelocityComponents(px, py, pz, 2, uz, n, last);
+	}
+
+
+	/**
+	 * Samples one component of the velocity field at n points using linear interpolation,
+	 * with the same result as getVelocity. The cell and the eight corners of each point
+	 * are gathered lane by lane; the weights and the blend are computed for
+	 * simd::WIDTH points at a time. Points outside of the grid get a zero velocity.
+	 *
+	 * @param px the x coordinates to sample at
+	 * @param py the y coordinates to sample at
+	 * @param pz the z coordinates to sample at
+	 * @param c the array index for the dimension of the velocity vector
+	 * @param u the sampled velocity components
+	 * @param n the number of points
+	 * @param last sample the "old" velocity field (m_u1) instead
+	 *
+	 */
+	void getVelocityComponents(const float* px, const float* py, const float* pz, int c, float* u, int n, bool last=false) const
+	{
+		const int W = simd::WIDTH;
+		const float offsetX = (c == 0)? 0.0f: 0.5f;
+		const float offsetY = (c == 1)? 0.0f: 0.5f;
+		const float offsetZ = (c == 2)? 0.0f: 0.5f;
+		const field_type& u0 = last? m_u1[c]: m_u0[c];
+		float frac[3][W], corner[8][W], result[W];
+
+		for (int first=0; first<n; first+=W) {
+			int count = std::min(W, n-first);
+			for (int l=0; l<W; ++l) {
+				/* Pad a partial batch with its last point */
+				int q = first + std::min(l, count-1);
+				float x = px[q] / m_dx - offsetX;
+				float y = py[q] / m_dx - offsetY;
+				float z = pz[q] / m_dx - offsetZ;
+				int i = (int) x;
+				int j = (int) y;
+				int k = (int) z;
+				if (i < 0 || j < 0 || k < 0 || i >= m_gridX || j >= m_gridY || k >= m_gridZ) {
+					frac[0][l] = frac[1][l] = frac[2][l] = 0.0f;
+					for (int m=0; m<8; ++m)
+						corner[m][l] = 0.0f;
+					continue;
+				}
+				frac[0][l] = x-i;
+				frac[1][l] = y-j;
+				frac[2][l] = z-k;
+				Storage::corners(u0, i, j, k, i + j * (m_gridX+1) + k*m_velSlice, m_gridX + 1, m_velSlice, &corner[0][l], W);
+			}
+
+			simd::vfloat one = simd::set1(1.0f);
+			simd::vfloat alpha = simd::load(frac[0]);
+			simd::vfloat beta = simd::load(frac[1]);
+			simd::vfloat gamma = simd::load(frac[2]);
+			simd::vfloat w00 = simd::mul(simd::sub(one, alpha), simd::sub(one, beta));
+			simd::vfloat w10 = simd::mul(alpha, simd::sub(one, beta));
+			simd::vfloat w01 = simd::mul(simd::sub(one, alpha), beta);
+			simd::vfloat w11 = simd::mul(alpha, beta);
+			simd::vfloat front = simd::add(simd::add(simd::add(simd::mul(w00, simd::load(corner[0])),
+				simd::mul(w10, simd::load(corner[1]))), simd::mul(w01, simd::load(corner[2]))),
+				simd::mul(w11, simd::load(corner[3])));
+			simd::vfloat back = simd::add(simd::add(simd::add(simd::mul(w00, simd::load(corner[4])),
+				simd::mul(w10, simd::load(corner[5]))), simd::mul(w01, simd::load(corner[6]))),
+				simd::mul(w11, simd::load(corner[7])));
+			simd::store(result, simd::add(simd::mul(simd::sub(one, gamma), front), simd::mul(gamma, back)));
+			for (int l=0; l<count; ++l)
+				u[first + l] = result[l];
+		}
+	}
+
+
+	/**
+	 * Finds the smallest and the greatest of the eight values that getVelocityComponents
+	 * interpolates at each of n points, which bound the linear interpolant. Points
+	 * outside of the grid get an empty range at zero.
+	 *
+	 * @param px the x coordinates of the points
+	 * @param py the y coordinates of the points
+	 * @param pz the z coordinates of the points
+	 * @param c the array index for the dimension of the velocity vector
+	 * @param lo the smallest values
+	 * @param hi the greatest values
+	 * @param n the number of points
+	 * @param last use the "old" velocity field (m_u1) instead
+	 *
+	 */
+	void getVelocityComponentRanges(const float* px, const float* py, const float* pz, int c, float* lo, float* hi, int n, bool last=false) const
+	{
+		const float offsetX = (c == 0)? 0.0f: 0.5f;
+		const float offsetY = (c == 1)? 0.0f: 0.5f;
+		const float offsetZ = (c == 2)? 0.0f: 0.5f;
+		const field_type& u0 = last? m_u1[c]: m_u0[c];
+		float a[8];
+
+		for (int q=0; q<n; ++q) {
+			int i = (int) (px[q] / m_dx - offsetX);
+			int j = (int) (py[q] / m_dx - offsetY);
+			int k = (int) (pz[q] / m_dx - offsetZ);
+			if (i < 0 || j < 0 || k < 0 || i >= m_gridX || j >= m_gridY || k >= m_gridZ) {
+				lo[q] = hi[q] = 0.0f;
+				continue;
+			}
+			Storage::corners(u0, i, j, k, i + j * (m_gridX+1) + k*m_velSlice, m_gridX + 1, m_velSlice, a, 1);
+			lo[q] = std::min(std::min(std::min(a[0], a[1]), std::min(a[2], a[3])),
+				std::min(std::min(a[4], a[5]), std::min(a[6], a[7])));
+			hi[q] = std::max(std::max(std::max(a[0], a[1]), std::max(a[2], a[3])),
+				std::max(std::max(a[4], a[5]), std::max(a[6], a[7])));
+		}
+	}
+
+
 	/**
 	 * Samples the force field at a point using linear interpolation.
 	 *
@@ -399,14 +742,16 @@ public:
 		float alpha = x-i;
 		float beta = y-j;
 		float gamma = z-k;
-		float A1 = m_forces[c][pos];
-		float B1 = m_forces[c][pos + 1];
-		float C1 = m_forces[c][pos + m_gridX + 1];
-		float D1 = m_forces[c][pos + m_gridX + 2];
-		float A2 = m_forces[c][pos + m_velSlice];
-		float B2 = m_forces[c][pos + m_velSlice + 1];
-		float C2 = m_forces[c][pos + m_velSlice + m_gridX + 1];
-		float D2 = m_forces[c][pos + m_velSlice + m_gridX + 2];
+		float corner[8];
+		Storage::corners(m_forces[c], i, j, k, pos, m_gridX + 1, m_velSlice, corner, 1);
+		float A1 = corner[0];
+		float B1 = corner[1];
+		float C1 = corner[2];
+		float D1 = corner[3];
+		float A2 = corner[4];
+		float B2 = corner[5];
+		float C2 = corner[6];
+		float D2 = corner[7];
 
 		return (1-gamma) * ((1-alpha) * (1-beta) * A1 + alpha * (1-beta) * B1 + (1-alpha) * beta * C1 + alpha*beta*D1)
 			 	+ gamma * ((1-alpha) * (1-beta) * A2 + alpha * (1-beta) * B2 + (1-alpha) * beta * C2 + alpha*beta*D2);
@@ -434,8 +779,11 @@ public:
 	float* getDensityArray() const
 	{
 		float* _density = (float*)malloc(sizeof(float) * m_numPoints);
-		for (int i=0; i<m_numPoints; ++i) {
-			_density[i] = (float) m_d0[i].density;
+		for (int z=0, pos=0; z<m_gridZ; ++z) {
+			for (int y=0; y<m_gridY; ++y) {
+				for (int x=0; x<m_gridX; ++x, ++pos)
+					_density[pos] = Storage::cell(m_d0, x, y, z, pos).density;
+			}
 		}
 		return _density;
 	}
@@ -481,34 +829,45 @@ public:
 	 */
 	T getDensityTrilinear(float x, float y, float z) const
 	{
-		x = (x / m_dx) - 0.5f;
-		y = (y / m_dx) - 0.5f;
-		z = (z / m_dx) - 0.5f;
-
-		int i = (int) x;
-		int j = (int) y;
-		int k = (int) z;
-		int pos = i + (j * m_gridX) + (k * m_slice);
-
-		if (i < 0 || j < 0 || k < 0 || i > m_gridX-1 || j > m_gridY-1 || k > m_gridZ-1){
+		float alpha, beta, gamma;
+		int cell = locateCell(x, y, z, alpha, beta, gamma);
+		if (cell < 0) {
 			return 0;
 		}
+		return getDensityTrilinear(cell, alpha, beta, gamma);
+	}
 
-		float alpha = x-i;
-		float beta = y-j;
-		float gamma = z-k;
 
-		T A1 = m_d0[pos];
-		T B1 = (i+1<m_gridX) ? m_d0[pos+1] : 0;
-		T C1 = (j+1<m_gridY) ? m_d0[pos+m_gridX] : 0;
-		T D1 = (i+1<m_gridX && j+1<m_gridY) ? m_d0[pos+m_gridX+1] : 0;
+	/**
+	 * Samples the density field with linear interpolation at a point given by the cell
+	 * it falls in and its position within that cell, as found by locateCell.
+	 * Neighbors past the last cell read zero.
+	 *
+	 * @param cell the index of the cell
+	 * @param alpha the x position within the cell
+	 * @param beta the y position within the cell
+	 * @param gamma the z position within the cell
+	 *
+	 * @return the computed Sample value
+	 *
+	 */
+	T getDensityTrilinear(int cell, float alpha, float beta, float gamma) const
+	{
+		int i = cell % m_gridX;
+		int j = (cell / m_gridX) % m_gridY;
+		int k = cell / m_slice;
+
+		T A1 = Storage::cell(m_d0, i, j, k, cell);
+		T B1 = (i+1<m_gridX) ? Storage::cell(m_d0, i+1, j, k, cell+1) : 0;
+		T C1 = (j+1<m_gridY) ? Storage::cell(m_d0, i, j+1, k, cell+m_gridX) : 0;
+		T D1 = (i+1<m_gridX && j+1<m_gridY) ? Storage::cell(m_d0, i+1, j+1, k, cell+m_gridX+1) : 0;
 
-		T A2, B2, C2, D2;
+		T A2 = 0, B2 = 0, C2 = 0, D2 = 0;
 		if (k + 1 < m_gridZ) {
-			A2 = m_d0[pos+m_slice];
-			B2 = (i+1<m_gridX) ? m_d0[pos+1+m_slice] : 0;
-			C2 = (j+1<m_gridY) ? m_d0[pos+m_gridX+m_slice] : 0;
-			D2 = (i+1<m_gridX && j+1<m_gridY) ? m_d0[pos+m_gridX+m_slice+1] : 0;
+			A2 = Storage::cell(m_d0, i, j, k+1, cell+m_slice);
+			B2 = (i+1<m_gridX) ? Storage::cell(m_d0, i+1, j, k+1, cell+1+m_slice) : 0;
+			C2 = (j+1<m_gridY) ? Storage::cell(m_d0, i, j+1, k+1, cell+m_gridX+m_slice) : 0;
+			D2 = (i+1<m_gridX && j+1<m_gridY) ? Storage::cell(m_d0, i+1, j+1, k+1, cell+m_gridX+m_slice+1) : 0;
 		}
 
 		return  (A1 * ((1-alpha) * (1-beta))
@@ -523,9 +882,8 @@ public:
 
 
 	/**
-	 * Samples the density field (stored at cell centers) at a point using a Catmull-Rom 
-	 * spline interpolation. We start with the z dimension and then use catmullRomX and 
-	 * catmullRomY for x and y dimensions respectively.
+	 * Samples the density field (stored at cell centers) at a point using a Catmull-Rom
+	 * spline interpolation.
 	 *
 	 * @param x the x coordinate to sample at
 	 * @param y the y coordinate to sample at
@@ -533,10 +891,124 @@ public:
 	 * 
 	 * @return the computed Sample value
 	 *
-	 * @see TGrid::catmullRomY
-	 * @see TGrid::catmullRomX
 	 */
 	T getDensityCatmullRom(float x, float y, float z) const
+	{
+		float alpha, beta, gamma;
+		int cell = locateCell(x, y, z, alpha, beta, gamma);
+		if (cell < 0) {
+			return 0;
+		}
+		return getDensityCatmullRom(cell, alpha, beta, gamma);
+	}
+
+
+	/**
+	 * Samples the density field with a Catmull-Rom spline at a point given by the cell
+	 * it falls in and its position within that cell, as found by locateCell. This lets
+	 * a located point be sampled again without repeating the search.
+	 *
+	 * The spline is separable: the 4x4x4 neighborhood is loaded once, then reduced
+	 * along x, y and z in turn with weights computed once per axis. The density, smoke
+	 * and temperature of a cell sit next to each other, so each pass blends all the
+	 * channels of several rows at once, simd::WIDTH values at a time. After each pass
+	 * a value is clamped to the range of the two values it lies between, which keeps
+	 * the spline from overshooting. Neighbors past the borders of the grid read zero.
+	 *
+	 * @param cell the index of the cell
+	 * @param alpha the x position within the cell
+	 * @param beta the y position within the cell
+	 * @param gamma the z position within the cell
+	 *
+	 * @return the computed Sample value
+	 *
+	 */
+	T getDensityCatmullRom(int cell, float alpha, float beta, float gamma) const
+	{
+		const int W = simd::WIDTH;
+		int x = cell % m_gridX;
+		int y = (cell / m_gridX) % m_gridY;
+		int z = cell / m_slice;
+
+		/* A point in the lower half of the first slice (gamma < 0) takes that slice as
+		   its upper neighbor as well, as when truncating the coordinate plus one */
+		int up = (gamma < 0.0f)? z: z+1;
+		const int nx[4] = { x-1, x, x+1, x+2 };
+		const int ny[4] = { y-1, y, y+1, y+2 };
+		const int nz[4] = { z-1, z, up, up+1 };
+
+		float wx[4], wy[4], wz[4];
+		catmullRomWeights(alpha, wx);
+		catmullRomWeights(beta, wy);
+		catmullRomWeights(gamma, wz);
+
+		/* stencil[i][j][4*k + c] holds channel c of the neighbor (nx[i], ny[j], nz[k]),
+		   the fourth channel being padding. Points away from the borders skip the
+		   bounds checks */
+		float stencil[4][4][16];
+		if (x >= 1 && x+2 < m_gridX && y >= 1 && y+2 < m_gridY && z >= 1 && up+1 < m_gridZ) {
+			for (int k=0; k<4; ++k) {
+				for (int j=0; j<4; ++j) {
+					int row = ny[j]*m_gridX + nz[k]*m_slice;
+					for (int i=0; i<4; ++i)
+						loadStencilCell(&stencil[i][j][4*k], nx[i], ny[j], nz[k], nx[i] + row);
+				}
+			}
+		} else {
+			for (int k=0; k<4; ++k) {
+				bool insideZ = nz[k] >= 0 && nz[k] < m_gridZ;
+				for (int j=0; j<4; ++j) {
+					bool insideYZ = insideZ && ny[j] >= 0 && ny[j] < m_gridY;
+					int row = ny[j]*m_gridX + nz[k]*m_slice;
+					for (int i=0; i<4; ++i) {
+						float* c = &stencil[i][j][4*k];
+						if (insideYZ && nx[i] >= 0 && nx[i] < m_gridX)
+							loadStencilCell(c, nx[i], ny[j], nz[k], nx[i] + row);
+						else
+							c[0] = c[1] = c[2] = c[3] = 0.0f;
+					}
+				}
+			}
+		}
+
+		/* Reduce along x, then along y */
+		float rows[4][16], column[16];
+		for (int j=0; j<4; ++j) {
+			for (int m=0; m<16; m+=W) {
+				simd::store(&rows[j][m], catmullRom(wx, simd::load(&stencil[0][j][m]), simd::load(&stencil[1][j][m]),
+					simd::load(&stencil[2][j][m]), simd::load(&stencil[3][j][m])));
+			}
+		}
+		for (int m=0; m<16; m+=W) {
+			simd::store(&column[m], catmullRom(wy, simd::load(&rows[0][m]), simd::load(&rows[1][m]),
+				simd::load(&rows[2][m]), simd::load(&rows[3][m])));
+		}
+
+		/* and along z, one channel at a time */
+		float d[3];
+		for (int c=0; c<3; ++c) {
+			float v = wz[0] * column[c] + wz[1] * column[4 + c] + wz[2] * column[8 + c] + wz[3] * column[12 + c];
+			d[c] = std::max(std::min(v, std::max(column[4 + c], column[8 + c])), std::min(column[4 + c], column[8 + c]));
+		}
+		return T(d[0], d[1], d[2]);
+	}
+
+
+	/**
+	 * Finds the cell of the density grid whose center is the lower corner of the
+	 * interpolation stencil of a point, and the position of the point relative to it.
+	 *
+	 * @param x the x coordinate of the point
+	 * @param y the y coordinate of the point
+	 * @param z the z coordinate of the point
+	 * @param alpha the x position within the cell
+	 * @param beta the y position within the cell
+	 * @param gamma the z position within the cell
+	 *
+	 * @return the index of the cell, or -1 for points outside of the grid
+	 *
+	 */
+	int locateCell(float x, float y, float z, float& alpha, float& beta, float& gamma) const
 	{
 		x = (x / m_dx) - 0.5f;
 		y = (y / m_dx) - 0.5f;
@@ -547,32 +1019,13 @@ public:
 		int k = (int) z;
 
 		if (i < 0 || j < 0 || k < 0 || i > m_gridX-1 || j > m_gridY-1 || k > m_gridZ-1){
-			return 0;
-		}
-
-		float alpha = x-i;
-		float beta = y-j;
-		float gamma = z-k;
-
-		// bounds checking is here...
-		T A = (z-1>= 0)? catmullRomY(x, y, z-1, alpha, beta): 0;
-		T B = catmullRomY(x, y, z, alpha, beta);
-		T C = (z+1<m_gridZ)? catmullRomY(x, y, z+1, alpha, beta): 0;
-		T D = (z+2<m_gridZ)? catmullRomY(x, y, z+2, alpha, beta): 0;
-
-		float gamma2 = gamma*gamma;
-		float gamma3 = gamma2*gamma;
-		T d =	A * (-0.5f*gamma + gamma2 - 0.5f*gamma3) + B * (1.0f - gamma2*(5.0f/2.0f) + gamma3*(3.0f/2.0f)) +
-					C * (0.5f*gamma + 2*gamma2 - gamma3*(3.0f/2.0f)) + D * (-0.5f*gamma2 + 0.5f*gamma3);
-
-		/* Switch to trilinear interpolation in the case of an overshoot */
-		if (d.density < std::min(B.density, C.density) || d.temperature < std::min(B.temperature, C.temperature) 
-			|| d.density > std::max(B.density, C.density) || d.temperature > std::max(B.temperature, C.temperature)
-			|| d.smoke < std::min(B.smoke, C.smoke) || d.smoke > std::max(B.smoke, C.smoke)) {
-			return B*(1.0f - gamma) + C*gamma;
+			return -1;
 		}
 
-		return d;
+		alpha = x-i;
+		beta = y-j;
+		gamma = z-k;
+		return i + j * m_gridX + k * m_slice;
 	}
 
 
@@ -614,16 +1067,16 @@ public:
 	// const Vector& getForce(int i) const { return m_forces[i]; }
 	// const std::vector<double>& getDensity() const { return m_d0; }
 	
-	Vector& getVelocity(int dimension) { return m_u0[dimension]; }
-	Vector& getLastVelocity(int dimension) { return m_u1[dimension]; }
-	Vector& getForce(int dimension) { return m_forces[dimension]; }
-	const bool isSolid(int index) const { return m_d0[index].medium==SOLID; }
-	const bool isFluid(int index) const { return m_d0[index].medium==FLUID; }
-	const bool isSmoke(int index) const { return m_d0[index].medium==SMOKE; }
-	const bool isAir(int index) const { return m_d0[index].medium==AIR; }
-	const T& getDensity(int index) const { return m_d0[index]; }
-	std::vector<T>& getDensity() { return m_d0; }
-	std::vector<T>& getLastDensity() { return m_d1; }
+	field_type& getVelocity(int dimension) { return m_u0[dimension]; }
+	field_type& getLastVelocity(int dimension) { return m_u1[dimension]; }
+	field_type& getForce(int dimension) { return m_forces[dimension]; }
+	const bool isSolid(int index) const { return Storage::medium(m_d0, index)==SOLID; }
+	const bool isFluid(int index) const { return Storage::medium(m_d0, index)==FLUID; }
+	const bool isSmoke(int index) const { return Storage::medium(m_d0, index)==SMOKE; }
+	const bool isAir(int index) const { return Storage::medium(m_d0, index)==AIR; }
+	T getDensity(int index) const { return m_d0[index]; }
+	cell_type& getDensity() { return m_d0; }
+	cell_type& getLastDensity() { return m_d1; }
 	
 	void setVelocityX(int index, float value) { m_u0[0][index] = value; }
 	void setVelocityY(int index, float value) { m_u0[1][index] = value; }
@@ -633,15 +1086,15 @@ public:
 	
 private:
 	/* Cell centers - density, temperature, etc. */
-	std::vector<T> m_d0;
-	std::vector<T> m_d1;
+	cell_type m_d0;
+	cell_type m_d1;
 
 	/* Velocities */
-	Vector m_u0[DIMENSIONS];
-	Vector m_u1[DIMENSIONS];
+	field_type m_u0[DIMENSIONS];
+	field_type m_u1[DIMENSIONS];
 	
 	/* Aggregated forces */
-	Vector m_forces[DIMENSIONS];
+	field_type m_forces[DIMENSIONS];
 
 	/* Grid resolution */
 	int m_gridX;
@@ -654,79 +1107,62 @@ private:
 	float m_invDx;
 
 	/**
-	 * Returns a density sample using catmullRomX.
+	 * Copies the density, smoke and temperature of a cell into the stencil of
+	 * getDensityCatmullRom, followed by a zero.
 	 *
-	 * @param x the x coordinate to sample at
-	 * @param y the y coordinate to sample at
-	 * @param z the z coordinate to sample at
-	 * @param alpha the interpolation first weight
-	 * @param beta the interpolation second weight
-	 * 
-	 * @return the computed Sample value
-	 *
-	 * @see Grid::catmullRomX
-	 * @see Grid::getDensityCatmullRom
+	 * @param c the first of the four values to set
+	 * @param x the x coordinate of the cell
+	 * @param y the y coordinate of the cell
+	 * @param z the z coordinate of the cell
+	 * @param index the index of the cell
 	 *
 	 */
-	inline T catmullRomY(int x, int y, int z, float alpha, float beta) const
-	{		
-		T A = (y-1>=0)? catmullRomX(x, y-1, z, alpha): 0;
-		T B = catmullRomX(x, y, z, alpha);
-		T C = (y+1<m_gridY)? catmullRomX(x, y+1, z, alpha): 0;
-		T D = (y+2<m_gridY)? catmullRomX(x, y+2, z, alpha): 0;
-
-		float beta2 = beta*beta;
-		float beta3 = beta2*beta;
-		T d =	A * (-0.5f*beta + beta2 - 0.5f*beta3) + B * (1.0f - beta2*(5.0f/2.0f) + beta3*(3.0f/2.0f)) + 
-					C * (0.5f*beta + 2*beta2 - beta3*(3.0f/2.0f)) + D * (-0.5f*beta2 + 0.5f*beta3);
-
-		/* Switch to trilinear interpolation in the case of an overshoot */
-		if (d.density < std::min(B.density, C.density) || d.temperature < std::min(B.temperature, C.temperature)
-			|| d.density > std::max(B.density, C.density) || d.temperature > std::max(B.temperature, C.temperature)
-			|| d.smoke < std::min(B.smoke, C.smoke) || d.smoke > std::max(B.smoke, C.smoke)) {
-			return B*(1.0f - beta) + C*beta;
-		}
+	inline void loadStencilCell(float* c, int x, int y, int z, int index) const
+	{
+		T v = Storage::cell(m_d0, x, y, z, index);
+		c[0] = v.density;
+		c[1] = v.smoke;
+		c[2] = v.temperature;
+		c[3] = 0.0f;
+	}
 
-		return d;
+	/**
+	 * Computes the weights of the four points of a Catmull-Rom spline.
+	 *
+	 * @param t the position between the second and the third point
+	 * @param w the weights
+	 *
+	 */
+	static inline void catmullRomWeights(float t, float w[4])
+	{
+		float t2 = t*t;
+		float t3 = t2*t;
+		w[0] = -0.5f*t + t2 - 0.5f*t3;
+		w[1] = 1.0f - t2*(5.0f/2.0f) + t3*(3.0f/2.0f);
+		w[2] = 0.5f*t + 2*t2 - t3*(3.0f/2.0f);
+		w[3] = -0.5f*t2 + 0.5f*t3;
 	}
 
 	/**
-	 * Returns a density sample using m_d0 and the alpha interpolation weight.
+	 * Blends four vectors of points with Catmull-Rom weights and clamps each lane to
+	 * the range of the second and third points.
 	 *
-	 * @param x the x coordinate to sample at
-	 * @param y the y coordinate to sample at
-	 * @param z the z coordinate to sample at
-	 * @param alpha the interpolation weight
-	 * 
-	 * @return the computed Sample value
+	 * @param w the weights, from catmullRomWeights
+	 * @param a the first points
+	 * @param b the second points
+	 * @param c the third points
+	 * @param d the fourth points
 	 *
-	 * @see Grid::catmullRomY
-	 * @see Grid::getDensityCatmullRom
+	 * @return the blended values
 	 *
 	 */
-	inline T catmullRomX(int x, int y, int z, float alpha) const
-	{
-		int pos = x + y*m_gridX + z*m_slice;
-		T A = (x-1 >= 0)? m_d0[pos-1]: 0;
-		T B = m_d0[pos];
-		T C = (x+1<m_gridX)? m_d0[pos+1]: 0;
-	    T D = (x+2<m_gridX)? m_d0[pos+2]: 0;
-
-		float alpha2 = alpha*alpha;
-		float alpha3 = alpha2*alpha;
-		T d =	A * (-0.5f*alpha + alpha2 - 0.5f*alpha3) + B * (1.0f - alpha2*(5.0f/2.0f) + alpha3*(3.0f/2.0f)) + 
-					C * (0.5f*alpha + 2*alpha2 - alpha3*(3.0f/2.0f)) + D * (-0.5f*alpha2 + 0.5f*alpha3);
-
-		/* Switch to trilinear interpolation in the case of an overshoot */
-		if (d.density < std::min(B.density, C.density) || d.temperature < std::min(B.temperature, C.temperature)
-			|| d.density > std::max(B.density, C.density) || d.temperature > std::max(B.temperature, C.temperature)
-			|| d.smoke < std::min(B.smoke, C.smoke) || d.smoke > std::max(B.smoke, C.smoke)) {
-			return B*(1.0f - alpha) + C*alpha;
-		}
+	static inline simd::vfloat catmullRom(const float w[4], simd::vfloat a, simd::vfloat b, simd::vfloat c, simd::vfloat d)
+	{
+		simd::vfloat v = simd::add(simd::add(simd::mul(simd::set1(w[0]), a), simd::mul(simd::set1(w[1]), b)),
+			simd::add(simd::mul(simd::set1(w[2]), c), simd::mul(simd::set1(w[3]), d)));
+		return simd::max(simd::min(v, simd::max(b, c)), simd::min(b, c));
+	}
 
-		return d;
-	}	
-	
 };	// class Grid
 
 typedef TGrid<Sample> Grid;
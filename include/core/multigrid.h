@@ -0,0 +1,77 @@
+/**
+ * @file multigrid.h
+ * @version 0.1
+ *
+ * @section LICENSE
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __FDL_MULTIGRID_H
+#define __FDL_MULTIGRID_H
+
+#include <vector>
+
+#include "core/common.h"
+
+namespace fdl {
+
+/**
+ * Geometric multigrid V-cycle for the 7-point pressure matrix assembled by the
+ * FluidSolver. The hierarchy is built by 2x2x2 coarsening of the cell-centered grid,
+ * the coarse couplings being the (halved) sum of the fine face couplings so that
+ * solid cells carry over as closed faces. Transfers are cell-centered trilinear and
+ * the smoother is red-black Gauss-Seidel, ordered so that one V-cycle is a symmetric
+ * operator and can be used as a preconditioner for conjugate gradients.
+ *
+ * See: <a href="http://physbam.stanford.edu/~aleka/papers/mgpcg.pdf">A. McAdams, E. Sifakis, J. Teran. A Parallel Multigrid Poisson Solver for Fluids Simulation on Large Grids. SCA, 2010.</a>
+ */
+class Multigrid {
+public:
+	Multigrid();
+	~Multigrid();
+
+	void build(const Vector& diag, const Vector& plusX, const Vector& plusY, const Vector& plusZ,
+		int nx, int ny, int nz);
+	void rescale(float factor);
+	void vcycle(const Vector& b, Vector& x);
+
+	void setSmoothingSteps(int steps) { m_smoothingSteps = steps; }
+	int getNumberOfLevels() const { return (int) m_levels.size(); }
+
+private:
+	struct Level {
+		int nx, ny, nz;
+		int slice;
+		int numPoints;
+		Vector diag, plusX, plusY, plusZ;
+		Vector x, b, r;
+	};
+
+	void coarsen(const Level& fine, Level& coarse);
+	void cycle(int level);
+	void smooth(Level& l, int color);
+	void residual(Level& l);
+	void restrictResidual(const Level& fine, Level& coarse);
+	void prolongate(const Level& coarse, Level& fine);
+
+	std::vector<Level> m_levels;
+	int m_smoothingSteps;
+	int m_coarseSweeps;
+};
+
+}	// namespace fdl
+
+#endif	// __FDL_MULTIGRID_H
@@ -0,0 +1,116 @@
+/**
+ * @file simd.hpp
+ * @version 0.1
+ *
+ * @section LICENSE
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __FDL_SIMD_H
+#define __FDL_SIMD_H
+
+#if defined(__AVX512F__) || defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace fdl {
+
+/**
+ * Thin wrappers over the widest float vector the compiler targets (AVX-512, AVX or
+ * SSE2, falling back to plain floats), so that kernels are written once. Build with
+ * FDL_NATIVE_ARCH to get more than SSE2 on x86-64. All loads and stores are unaligned.
+ */
+namespace simd {
+
+#if defined(__AVX512F__)
+
+typedef __m512 vfloat;
+const int WIDTH = 16;
+inline vfloat load(const float* p) { return _mm512_loadu_ps(p); }
+inline void store(float* p, vfloat v) { _mm512_storeu_ps(p, v); }
+inline vfloat set1(float f) { return _mm512_set1_ps(f); }
+inline vfloat zero() { return _mm512_setzero_ps(); }
+inline vfloat add(vfloat a, vfloat b) { return _mm512_add_ps(a, b); }
+inline vfloat sub(vfloat a, vfloat b) { return _mm512_sub_ps(a, b); }
+inline vfloat mul(vfloat a, vfloat b) { return _mm512_mul_ps(a, b); }
+inline vfloat min(vfloat a, vfloat b) { return _mm512_min_ps(a, b); }
+inline vfloat max(vfloat a, vfloat b) { return _mm512_max_ps(a, b); }
+inline float sum(vfloat v) { return _mm512_reduce_add_ps(v); }
+
+#elif defined(__AVX__)
+
+typedef __m256 vfloat;
+const int WIDTH = 8;
+inline vfloat load(const float* p) { return _mm256_loadu_ps(p); }
+inline void store(float* p, vfloat v) { _mm256_storeu_ps(p, v); }
+inline vfloat set1(float f) { return _mm256_set1_ps(f); }
+inline vfloat zero() { return _mm256_setzero_ps(); }
+inline vfloat add(vfloat a, vfloat b) { return _mm256_add_ps(a, b); }
+inline vfloat sub(vfloat a, vfloat b) { return _mm256_sub_ps(a, b); }
+inline vfloat mul(vfloat a, vfloat b) { return _mm256_mul_ps(a, b); }
+inline vfloat min(vfloat a, vfloat b) { return _mm256_min_ps(a, b); }
+inline vfloat max(vfloat a, vfloat b) { return _mm256_max_ps(a, b); }
+inline float sum(vfloat v)
+{
+	__m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+	s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+	s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+	return _mm_cvtss_f32(s);
+}
+
+#elif defined(__SSE2__)
+
+typedef __m128 vfloat;
+const int WIDTH = 4;
+inline vfloat load(const float* p) { return _mm_loadu_ps(p); }
+inline void store(float* p, vfloat v) { _mm_storeu_ps(p, v); }
+inline vfloat set1(float f) { return _mm_set1_ps(f); }
+inline vfloat zero() { return _mm_setzero_ps(); }
+inline vfloat add(vfloat a, vfloat b) { return _mm_add_ps(a, b); }
+inline vfloat sub(vfloat a, vfloat b) { return _mm_sub_ps(a, b); }
+inline vfloat mul(vfloat a, vfloat b) { return _mm_mul_ps(a, b); }
+inline vfloat min(vfloat a, vfloat b) { return _mm_min_ps(a, b); }
+inline vfloat max(vfloat a, vfloat b) { return _mm_max_ps(a, b); }
+inline float sum(vfloat v)
+{
+	__m128 s = _mm_add_ps(v, _mm_movehl_ps(v, v));
+	s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+	return _mm_cvtss_f32(s);
+}
+
+#else
+
+typedef float vfloat;
+const int WIDTH = 1;
+inline vfloat load(const float* p) { return *p; }
+inline void store(float* p, vfloat v) { *p = v; }
+inline vfloat set1(float f) { return f; }
+inline vfloat zero() { return 0.0f; }
+inline vfloat add(vfloat a, vfloat b) { return a + b; }
+inline vfloat sub(vfloat a, vfloat b) { return a - b; }
+inline vfloat mul(vfloat a, vfloat b) { return a * b; }
+inline vfloat min(vfloat a, vfloat b) { return a < b? a: b; }
+inline vfloat max(vfloat a, vfloat b) { return a > b? a: b; }
+inline float sum(vfloat v) { return v; }
+
+#endif
+
+}	// namespace simd
+}	// namespace fdl
+
+#endif	// __FDL_SIMD_H
@@ -0,0 +1,66 @@
+/**
+ * @file threadpool.h
+ * @version 0.1
+ *
+ * @section LICENSE
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __FDL_THREADPOOL_H
+#define __FDL_THREADPOOL_H
+
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+
+namespace fdl {
+
+/**
+ * A persistent pool of worker threads for data parallel loops. The threads are
+ * started once and sleep between calls, so parallelFor can be used for loops that
+ * run many times per step (e.g. each level of a wavefront).
+ */
+class ThreadPool {
+public:
+	typedef boost::function<void (int, int)> Task;
+
+	ThreadPool(int threads=0);
+	~ThreadPool();
+
+	void parallelFor(int begin, int end, const Task& task, int grain=1);
+	int getNumberOfThreads() const { return m_numThreads; }
+
+private:
+	void worker(int id);
+
+	int m_numThreads;
+	boost::thread_group m_threads;
+	boost::mutex m_mutex;
+	boost::condition_variable m_start;
+	boost::condition_variable m_done;
+
+	/* The loop currently being run */
+	const Task* m_task;
+	int m_begin;
+	int m_end;
+	int m_chunks;
+	int m_pending;
+	unsigned m_generation;
+	bool m_quit;
+};
+
+}	// namespace fdl
+
+#endif	// __FDL_THREADPOOL_H
@@ -61,6 +61,12 @@ namespace fdl {
 		std::string GetGridInputfile() {return pt.get<std::string>("scene.settings.grid-inputfile");}
 		double GetCGTol() {return pt.get<double>("scene.settings.solver.<xmlattr>.tolerance");}
 		int GetCGMaxIter() {return pt.get<int>("scene.settings.solver.<xmlattr>.maxIterations");}
+		std::string GetSolverType(const std::string& fallback) {return pt.get<std::string>("scene.settings.solver.<xmlattr>.type", fallback);}
+		std::string GetPreconditioner(const std::string& fallback) {return pt.get<std::string>("scene.settings.solver.<xmlattr>.preconditioner", fallback);}
+		std::string GetStencil(const std::string& fallback) {return pt.get<std::string>("scene.settings.solver.<xmlattr>.stencil", fallback);}
+		std::string GetAdvection(const std::string& fallback) {return pt.get<std::string>("scene.settings.advection.<xmlattr>.type", fallback);}
+		std::string GetInterpolation(const std::string& fallback) {return pt.get<std::string>("scene.settings.advection.<xmlattr>.interpolation", fallback);}
+		std::string GetIntegration(const std::string& fallback) {return pt.get<std::string>("scene.settings.advection.<xmlattr>.integration", fallback);}
 		int GetMaxStep() {return pt.get<int>("scene.settings.max-step");}
 		fdl::Vector3f GetSourceSize();
 		fdl::Vector3f GetSourcePos();
@@ -82,6 +88,12 @@ namespace fdl {
 		void PutGridInputfile(std::string grid_inputfile) {pt.put("scene.settings.grid-inputfile", grid_inputfile);}
 		void PutCGTol(double cg_tol) {pt.put("scene.settings.solver.<xmlattr>.tolerance", cg_tol);}
 		void PutCGMaxIter(int cg_max_iter) {pt.put("scene.settings.solver.<xmlattr>.maxIterations", cg_max_iter);}
+		void PutSolverType(std::string type) {pt.put("scene.settings.solver.<xmlattr>.type", type);}
+		void PutPreconditioner(std::string preconditioner) {pt.put("scene.settings.solver.<xmlattr>.preconditioner", preconditioner);}
+		void PutStencil(std::string stencil) {pt.put("scene.settings.solver.<xmlattr>.stencil", stencil);}
+		void PutAdvection(std::string advection) {pt.put("scene.settings.advection.<xmlattr>.type", advection);}
+		void PutInterpolation(std::string interpolation) {pt.put("scene.settings.advection.<xmlattr>.interpolation", interpolation);}
+		void PutIntegration(std::string integration) {pt.put("scene.settings.advection.<xmlattr>.integration", integration);}
 		void PutMaxStep(int max_step) {pt.put("scene.settings.max-step", max_step);}
 		void PutSourceSize(fdl::Vector3f);
 		void PutSourcePos(fdl::Vector3f);
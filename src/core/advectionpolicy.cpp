@@ -0,0 +1,148 @@
+#include "core/advectionpolicy.h"
+
+namespace fdl {
+
+/**
+ * Moves n points back along the velocity field by dt. A negative dt moves them
+ * forward.
+ *
+ * @param grid the grid whose velocity field is followed
+ * @param dt delta time value to step back
+ * @param px the x coordinates, replaced by the traced ones
+ * @param py the y coordinates, replaced by the traced ones
+ * @param pz the z coordinates, replaced by the traced ones
+ * @param scratch room for SCRATCH * n values
+ * @param n the number of points
+ * @param last follow the "old" velocity field instead
+ */
+void EulerIntegrator::trace(const Grid& grid, float dt, float* px, float* py, float* pz, float* scratch, int n, bool last)
+{
+	float* ux = scratch;
+	float* uy = ux + n;
+	float* uz = uy + n;
+
+	grid.getVelocities(px, py, pz, ux, uy, uz, n, last);
+	for (int i=0; i<n; ++i) {
+		px[i] += ux[i] * -dt;
+		py[i] += uy[i] * -dt;
+		pz[i] += uz[i] * -dt;
+	}
+}
+
+
+/**
+ * Moves n points back along the velocity field by dt with the midpoint rule.
+ *
+ * @see EulerIntegrator::trace
+ */
+void MidpointIntegrator::trace(const Grid& grid, float dt, float* px, float* py, float* pz, float* scratch, int n, bool last)
+{
+	float* mx = scratch;
+	float* my = mx + n;
+	float* mz = my + n;
+	float* ux = mz + n;
+	float* uy = ux + n;
+	float* uz = uy + n;
+
+	grid.getVelocities(px, py, pz, ux, uy, uz, n, last);
+	for (int i=0; i<n; ++i) {
+		mx[i] = px[i] + ux[i] * (-dt * 0.5f);
+		my[i] = py[i] + uy[i] * (-dt * 0.5f);
+		mz[i] = pz[i] + uz[i] * (-dt * 0.5f);
+	}
+
+	grid.getVelocities(mx, my, mz, ux, uy, uz, n, last);
+	for (int i=0; i<n; ++i) {
+		px[i] += ux[i] * -dt;
+		py[i] += uy[i] * -dt;
+		pz[i] += uz[i] * -dt;
+	}
+}
+
+
+/**
+ * Moves n points back along the velocity field by dt with four stages.
+ *
+ * @see EulerIntegrator::trace
+ */
+void RungeKutta4Integrator::trace(const Grid& grid, float dt, float* px, float* py, float* pz, float* scratch, int n, bool last)
+{
+	float* qx = scratch;
+	float* qy = qx + n;
+	float* qz = qy + n;
+	float* ux = qz + n;
+	float* uy = ux + n;
+	float* uz = uy + n;
+	float* sx = uz + n;
+	float* sy = sx + n;
+	float* sz = sy + n;
+
+	/* Stage k samples at p - h_k dt u_(k-1) and adds w_k u_k to the sum */
+	const float step[3] = { 0.5f, 0.5f, 1.0f };
+	const float weight[4] = { 1.0f, 2.0f, 2.0f, 1.0f };
+
+	grid.getVelocities(px, py, pz, ux, uy, uz, n, last);
+	for (int i=0; i<n; ++i) {
+		sx[i] = ux[i];
+		sy[i] = uy[i];
+		sz[i] = uz[i];
+	}
+	for (int k=0; k<3; ++k) {
+		for (int i=0; i<n; ++i) {
+			qx[i] = px[i] + ux[i] * (-dt * step[k]);
+			qy[i] = py[i] + uy[i] * (-dt * step[k]);
+			qz[i] = pz[i] + uz[i] * (-dt * step[k]);
+		}
+		grid.getVelocities(qx, qy, qz, ux, uy, uz, n, last);
+		for (int i=0; i<n; ++i) {
+			sx[i] += weight[k+1] * ux[i];
+			sy[i] += weight[k+1] * uy[i];
+			sz[i] += weight[k+1] * uz[i];
+		}
+	}
+
+	for (int i=0; i<n; ++i) {
+		px[i] += sx[i] * (-dt / 6.0f);
+		py[i] += sy[i] * (-dt / 6.0f);
+		pz[i] += sz[i] * (-dt / 6.0f);
+	}
+}
+
+
+
+/**
+ * Samples the density at a point given by its cell and the position within it.
+ *
+ * @param grid the grid to sample
+ * @param cell the index of the cell, as found by Grid::locateCell
+ * @param alpha the x position within the cell
+ * @param beta the y position within the cell
+ * @param gamma the z position within the cell
+ */
+Sample LinearInterpolator::sample(const Grid& grid, int cell, float alpha, float beta, float gamma)
+{
+	return grid.getDensityTrilinear(cell, alpha, beta, gamma);
+}
+
+
+Sample LinearInterpolator::sample(const Grid& grid, float x, float y, float z)
+{
+	return grid.getDensityTrilinear(x, y, z);
+}
+
+
+/**
+ * @see LinearInterpolator::sample
+ */
+Sample CatmullRomInterpolator::sample(const Grid& grid, int cell, float alpha, float beta, float gamma)
+{
+	return grid.getDensityCatmullRom(cell, alpha, beta, gamma);
+}
+
+
+Sample CatmullRomInterpolator::sample(const Grid& grid, float x, float y, float z)
+{
+	return grid.getDensityCatmullRom(x, y, z);
+}
+
+}	// namespace fdl
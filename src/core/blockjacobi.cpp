@@ -0,0 +1,218 @@
+#include <algorithm>
+#include <cmath>
+
+#include <boost/bind.hpp>
+
+#include "core/blockjacobi.h"
+#include "logger/logger.h"
+
+namespace fdl {
+
+/* MIC(0) parameters, as in FluidSolver::constructPreconditioner */
+static const float TAU = 0.97f;
+static const float SAFETY = 0.25f;
+
+/**
+ * Constructor.
+ *
+ */
+BlockJacobi::BlockJacobi() : m_nx(0), m_ny(0), m_nz(0), m_slice(0)
+{
+}
+
+
+/**
+ * Splits the grid into slabs and factors their blocks.
+ *
+ * @param diag the diagonal of the matrix
+ * @param plusX the coupling of each cell to its +x neighbor
+ * @param plusY the coupling of each cell to its +y neighbor
+ * @param plusZ the coupling of each cell to its +z neighbor
+ * @param nx grid size in x
+ * @param ny grid size in y
+ * @param nz grid size in z
+ * @param blocks the number of slabs, at most nz
+ * @param pool the threads that factor the slabs
+ *
+ */
+void BlockJacobi::build(const Vector& diag, const Vector& plusX, const Vector& plusY, const Vector& plusZ,
+	int nx, int ny, int nz, int blocks, ThreadPool* pool)
+{
+	m_nx = nx;
+	m_ny = ny;
+	m_nz = nz;
+	m_slice = nx * ny;
+	m_diag = diag;
+	m_plusX = plusX;
+	m_plusY = plusY;
+	m_plusZ = plusZ;
+	m_precond.resize(diag.size());
+	m_q.resize(diag.size());
+
+	blocks = std::max(1, std::min(blocks, nz));
+	m_slabStart.resize(blocks + 1);
+	for (int i=0; i<=blocks; ++i)
+		m_slabStart[i] = (int) ((long) nz * i / blocks);
+
+	pool->parallelFor(0, blocks, boost::bind(&BlockJacobi::factorSlabs, this, _1, _2));
+
+	INFO() << "    Block-Jacobi preconditioner with " << blocks << " slabs";
+}
+
+
+/**
+ * Scales the matrix by factor, e.g. when dt changes, which scales the pivots by
+ * 1/sqrt(factor).
+ *
+ * @param factor the scaling factor
+ *
+ */
+void BlockJacobi::rescale(float factor)
+{
+	m_diag *= factor;
+	m_plusX *= factor;
+	m_plusY *= factor;
+	m_plusZ *= factor;
+	m_precond *= 1.0f / std::sqrt(factor);
+}
+
+
+/**
+ * Applies the preconditioner, x = M^-1 b, one slab per task.
+ *
+ * @param b the vector to precondition
+ * @param x the result
+ * @param pool the threads that solve the slabs
+ *
+ */
+void BlockJacobi::solve(const Vector& b, Vector& x, ThreadPool* pool)
+{
+	pool->parallelFor(0, getNumberOfBlocks(), boost::bind(&BlockJacobi::solveSlabs, this, &b[0], &x[0], _1, _2));
+}
+
+
+/**
+ * Computes the MIC(0) pivots of the slabs in [slabBegin, slabEnd), leaving out the
+ * couplings to the other slabs, also in the modified correction. Cells with a zero
+ * diagonal get a zero pivot.
+ *
+ * @param slabBegin first slab
+ * @param slabEnd one past the last slab
+ *
+ */
+void BlockJacobi::factorSlabs(int slabBegin, int slabEnd)
+{
+	const float* diag = &m_diag[0];
+	const float* plusX = &m_plusX[0];
+	const float* plusY = &m_plusY[0];
+	const float* plusZ = &m_plusZ[0];
+	float* precond = &m_precond[0];
+
+	for (int slab=slabBegin; slab<slabEnd; ++slab) {
+		int z0 = m_slabStart[slab];
+		int z1 = m_slabStart[slab+1];
+		for (int z=z0; z<z1; ++z) {
+			// The +z couplings of the top layer lead out of the slab
+			bool top = (z+1 == z1);
+			for (int y=0; y<m_ny; ++y) {
+				int pos = y * m_nx + z * m_slice;
+				for (int x=0; x<m_nx; ++x, ++pos) {
+					if (diag[pos] == 0.0f) {
+						precond[pos] = 0.0f;
+						continue;
+					}
+
+					float e = diag[pos];
+					if (x > 0) {
+						float p = plusX[pos-1] * precond[pos-1];
+						float coupling = top? 0.0f: plusZ[pos-1];
+						e -= p * p + TAU * plusX[pos-1] * (plusY[pos-1] + coupling) * precond[pos-1] * precond[pos-1];
+					}
+					if (y > 0) {
+						int n = pos - m_nx;
+						float p = plusY[n] * precond[n];
+						float coupling = top? 0.0f: plusZ[n];
+						e -= p * p + TAU * plusY[n] * (plusX[n] + coupling) * precond[n] * precond[n];
+					}
+					if (z > z0) {
+						int n = pos - m_slice;
+						float p = plusZ[n] * precond[n];
+						e -= p * p + TAU * plusZ[n] * (plusX[n] + plusY[n]) * precond[n] * precond[n];
+					}
+					if (e < SAFETY * diag[pos])
+						e = diag[pos];
+
+					precond[pos] = 1.0f / std::sqrt(e);
+				}
+			}
+		}
+	}
+}
+
+
+/**
+ * Forward and backward substitution for the slabs in [slabBegin, slabEnd).
+ *
+ * @param b the right hand side
+ * @param x the result
+ * @param slabBegin first slab
+ * @param slabEnd one past the last slab
+ *
+ */
+void BlockJacobi::solveSlabs(const float* b, float* x, int slabBegin, int slabEnd)
+{
+	const float* plusX = &m_plusX[0];
+	const float* plusY = &m_plusY[0];
+	const float* plusZ = &m_plusZ[0];
+	const float* precond = &m_precond[0];
+	float* q = &m_q[0];
+
+	for (int slab=slabBegin; slab<slabEnd; ++slab) {
+		int z0 = m_slabStart[slab];
+		int z1 = m_slabStart[slab+1];
+
+		for (int z=z0; z<z1; ++z) {
+			for (int y=0; y<m_ny; ++y) {
+				int pos = y * m_nx + z * m_slice;
+				for (int i=0; i<m_nx; ++i, ++pos) {
+					if (precond[pos] == 0.0f) {
+						q[pos] = 0.0f;
+						continue;
+					}
+
+					float temp = b[pos];
+					if (i > 0)
+						temp -= plusX[pos-1] * precond[pos-1] * q[pos-1];
+					if (y > 0)
+						temp -= plusY[pos-m_nx] * precond[pos-m_nx] * q[pos-m_nx];
+					if (z > z0)
+						temp -= plusZ[pos-m_slice] * precond[pos-m_slice] * q[pos-m_slice];
+					q[pos] = temp * precond[pos];
+				}
+			}
+		}
+
+		for (int z=z1-1; z>=z0; --z) {
+			for (int y=m_ny-1; y>=0; --y) {
+				int pos = (m_nx-1) + y * m_nx + z * m_slice;
+				for (int i=m_nx-1; i>=0; --i, --pos) {
+					if (precond[pos] == 0.0f) {
+						x[pos] = 0.0f;
+						continue;
+					}
+
+					float temp = q[pos];
+					if (i+1 < m_nx)
+						temp -= plusX[pos] * precond[pos] * x[pos+1];
+					if (y+1 < m_ny)
+						temp -= plusY[pos] * precond[pos] * x[pos+m_nx];
+					if (z+1 < z1)
+						temp -= plusZ[pos] * precond[pos] * x[pos+m_slice];
+					x[pos] = temp * precond[pos];
+				}
+			}
+		}
+	}
+}
+
+}	// namespace fdl
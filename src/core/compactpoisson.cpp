@@ -0,0 +1,390 @@
+#include <algorithm>
+#include <cmath>
+
+#include <boost/bind.hpp>
+
+#include "core/compactpoisson.h"
+#include "logger/logger.h"
+
+namespace fdl {
+
+/* Unknowns per task of the vector kernels */
+static const int BLOCK = 4096;
+
+/**
+ * Constructor.
+ *
+ */
+CompactPoisson::CompactPoisson() : m_nx(0), m_ny(0), m_nz(0), m_pool(NULL)
+{
+}
+
+
+/**
+ * Numbers the fluid cells, records their links and factors the unit matrix.
+ *
+ * @param fluidMask 1 for fluid cells, 0 for solids
+ * @param nx grid size in x
+ * @param ny grid size in y
+ * @param nz grid size in z
+ * @param tau MIC(0) tuning parameter
+ * @param rho MIC(0) safety factor
+ *
+ */
+void CompactPoisson::build(const Vector& fluidMask, int nx, int ny, int nz, float tau, float rho)
+{
+	m_nx = nx;
+	m_ny = ny;
+	m_nz = nz;
+	int slice = nx * ny;
+	int numPoints = slice * nz;
+
+	std::vector<int> unknown(numPoints, -1);
+	m_cells.clear();
+	m_rowStart.resize(ny * nz + 1);
+	for (int row=0, pos=0; row<ny*nz; ++row) {
+		m_rowStart[row] = (int) m_cells.size();
+		for (int i=0; i<nx; ++i, ++pos) {
+			if (fluidMask[pos] != 0.0f) {
+				unknown[pos] = (int) m_cells.size();
+				m_cells.push_back(pos);
+			}
+		}
+	}
+	int n = (int) m_cells.size();
+	m_rowStart[ny * nz] = n;
+
+	m_links.assign(n, 0);
+	m_minusY.assign(n, -1);
+	m_plusY.assign(n, -1);
+	m_minusZ.assign(n, -1);
+	m_plusZ.assign(n, -1);
+	for (int u=0; u<n; ++u) {
+		int pos = m_cells[u];
+		int i = pos % nx;
+		int j = (pos / nx) % ny;
+		int k = pos / slice;
+		unsigned char links = 0;
+		if (i > 0 && unknown[pos-1] >= 0) links |= LINK_MINUS_X;
+		if (i+1 < nx && unknown[pos+1] >= 0) links |= LINK_PLUS_X;
+		if (j > 0 && unknown[pos-nx] >= 0) { links |= LINK_MINUS_Y; m_minusY[u] = unknown[pos-nx]; }
+		if (j+1 < ny && unknown[pos+nx] >= 0) { links |= LINK_PLUS_Y; m_plusY[u] = unknown[pos+nx]; }
+		if (k > 0 && unknown[pos-slice] >= 0) { links |= LINK_MINUS_Z; m_minusZ[u] = unknown[pos-slice]; }
+		if (k+1 < nz && unknown[pos+slice] >= 0) { links |= LINK_PLUS_Z; m_plusZ[u] = unknown[pos+slice]; }
+		m_links[u] = links;
+	}
+
+	m_x.resize(n);
+	m_r.resize(n);
+	m_z.resize(n);
+	m_p.resize(n);
+	m_w.resize(n);
+	m_q.resize(n);
+
+	factor(tau, rho);
+
+	INFO() << "    Compact pressure system with " << n << " unknowns ("
+		<< (100.0 * n / std::max(numPoints, 1)) << "% of the grid)";
+}
+
+
+/**
+ * Computes the MIC(0) pivots of the unit matrix in grid order, as
+ * FluidSolver::factorPreconditionerRows does on the full grid.
+ *
+ * @param tau MIC(0) tuning parameter
+ * @param rho MIC(0) safety factor
+ *
+ */
+void CompactPoisson::factor(float tau, float rho)
+{
+	int n = (int) m_cells.size();
+	m_precond.resize(n);
+	for (int u=0; u<n; ++u) {
+		unsigned char links = m_links[u];
+		float diag = 0.0f;
+		for (int bit=1; bit<64; bit<<=1)
+			diag += (links & bit)? 1.0f: 0.0f;
+
+		float e = diag;
+		if (links & LINK_MINUS_X) {
+			int v = u - 1;
+			float p = m_precond[v];
+			int others = ((m_links[v] & LINK_PLUS_Y)? 1: 0) + ((m_links[v] & LINK_PLUS_Z)? 1: 0);
+			e -= p * p + tau * others * p * p;
+		}
+		if (links & LINK_MINUS_Y) {
+			int v = m_minusY[u];
+			float p = m_precond[v];
+			int others = ((m_links[v] & LINK_PLUS_X)? 1: 0) + ((m_links[v] & LINK_PLUS_Z)? 1: 0);
+			e -= p * p + tau * others * p * p;
+		}
+		if (links & LINK_MINUS_Z) {
+			int v = m_minusZ[u];
+			float p = m_precond[v];
+			int others = ((m_links[v] & LINK_PLUS_X)? 1: 0) + ((m_links[v] & LINK_PLUS_Y)? 1: 0);
+			e -= p * p + tau * others * p * p;
+		}
+		if (e < rho * diag)
+			e = diag;
+
+		m_precond[u] = e > 0.0f? 1.0f / std::sqrt(e): 0.0f;
+	}
+}
+
+
+/**
+ * Solves A x = b for the fluid cells with PCG. x is used as the initial guess and
+ * only its fluid cells are written.
+ *
+ * @param b the right hand side on the full grid
+ * @param x the solution on the full grid
+ * @param scale the coupling dt/(rho*dx^2) of the full matrix
+ * @param monitor decides when to stop, on sqrt(r^T M^-1 r) of the full system
+ * @param pool the threads that run the kernels
+ * @return the residual sqrt(r^T M^-1 r) of the full system
+ *
+ */
+float CompactPoisson::solve(const Vector& b, Vector& x, float scale, ConvergenceMonitor& monitor, ThreadPool* pool)
+{
+	m_pool = pool;
+	int n = (int) m_cells.size();
+	if (n == 0)
+		return 0.0f;
+
+	int blocks = (n + BLOCK - 1) / BLOCK;
+	const int* cells = &m_cells[0];
+
+	// r^T M^-1 r of the unit system A/s x = b/s is the one of the full system over s
+	float invScale = 1.0f / scale;
+	for (int u=0; u<n; ++u) {
+		m_x[u] = x[cells[u]];
+		m_r[u] = b[cells[u]] * invScale;
+	}
+
+	m_pool->parallelFor(0, blocks, boost::bind(&CompactPoisson::multiplyBlocks, this, &m_x[0], &m_w[0], _1, _2));
+	for (int u=0; u<n; ++u)
+		m_r[u] -= m_w[u];
+	precondition(&m_r[0], &m_z[0]);
+	double rho = dot(m_r, m_z);
+	double lastRho = 0.0;
+
+	int k = 0;
+	while (monitor.proceed(rho * scale, k)) {
+		if (k == 0) {
+			m_p = m_z;
+		} else {
+			float beta = (float) (rho / lastRho);
+			for (int u=0; u<n; ++u)
+				m_p[u] = m_z[u] + beta * m_p[u];
+		}
+
+		m_pool->parallelFor(0, blocks, boost::bind(&CompactPoisson::multiplyBlocks, this, &m_p[0], &m_w[0], _1, _2));
+		float alpha = (float) (rho / dot(m_p, m_w));
+		for (int u=0; u<n; ++u) {
+			m_x[u] += alpha * m_p[u];
+			m_r[u] -= alpha * m_w[u];
+		}
+
+		precondition(&m_r[0], &m_z[0]);
+		lastRho = rho;
+		rho = dot(m_r, m_z);
+		k++;
+	}
+
+	for (int u=0; u<n; ++u)
+		x[cells[u]] = m_x[u];
+
+	return (float) std::sqrt(rho * scale);
+}
+
+
+/**
+ * Applies the MIC(0) preconditioner, z = M^-1 r, as a wavefront over the x-rows like
+ * FluidSolver::triangularSolve, and removes the mean of z since the matrix is singular
+ * when no cell is open.
+ *
+ * @param r the vector to precondition
+ * @param z the result
+ *
+ */
+void CompactPoisson::precondition(const float* r, float* z)
+{
+	int diagonals = m_ny + m_nz - 1;
+	int grain = std::max(1, 2048 / m_nx);
+
+	for (int d=0; d<diagonals; ++d) {
+		int first = std::max(0, d - (m_nz-1));
+		int last = std::min(m_ny-1, d);
+		m_pool->parallelFor(first, last+1, boost::bind(&CompactPoisson::lowerSweepRows, this, r, d, _1, _2), grain);
+	}
+
+	for (int d=diagonals-1; d>=0; --d) {
+		int first = std::max(0, d - (m_nz-1));
+		int last = std::min(m_ny-1, d);
+		m_pool->parallelFor(first, last+1, boost::bind(&CompactPoisson::upperSweepRows, this, z, d, _1, _2), grain);
+	}
+
+	removeMean(z);
+}
+
+
+/**
+ * Forward substitution for the rows (y, d-y) of one diagonal, writing m_q.
+ *
+ * @param b the right hand side
+ * @param d the diagonal index y+z
+ * @param yBegin first row
+ * @param yEnd one past the last row
+ *
+ */
+void CompactPoisson::lowerSweepRows(const float* b, int d, int yBegin, int yEnd)
+{
+	const float* precond = &m_precond[0];
+	float* q = &m_q[0];
+
+	for (int y=yBegin; y<yEnd; ++y) {
+		int row = y + (d - y) * m_ny;
+		for (int u=m_rowStart[row]; u<m_rowStart[row+1]; ++u) {
+			unsigned char links = m_links[u];
+			float temp = b[u];
+			if (links & LINK_MINUS_X)
+				temp += precond[u-1] * q[u-1];
+			if (links & LINK_MINUS_Y)
+				temp += precond[m_minusY[u]] * q[m_minusY[u]];
+			if (links & LINK_MINUS_Z)
+				temp += precond[m_minusZ[u]] * q[m_minusZ[u]];
+			q[u] = temp * precond[u];
+		}
+	}
+}
+
+
+/**
+ * Backward substitution for the rows (y, d-y) of one diagonal, reading m_q.
+ *
+ * @param x the solution
+ * @param d the diagonal index y+z
+ * @param yBegin first row
+ * @param yEnd one past the last row
+ *
+ */
+void CompactPoisson::upperSweepRows(float* x, int d, int yBegin, int yEnd)
+{
+	const float* precond = &m_precond[0];
+	const float* q = &m_q[0];
+
+	for (int y=yBegin; y<yEnd; ++y) {
+		int row = y + (d - y) * m_ny;
+		for (int u=m_rowStart[row+1]-1; u>=m_rowStart[row]; --u) {
+			unsigned char links = m_links[u];
+			float temp = 0.0f;
+			if (links & LINK_PLUS_X)
+				temp += x[u+1];
+			if (links & LINK_PLUS_Y)
+				temp += x[m_plusY[u]];
+			if (links & LINK_PLUS_Z)
+				temp += x[m_plusZ[u]];
+			x[u] = (q[u] + precond[u] * temp) * precond[u];
+		}
+	}
+}
+
+
+/**
+ * y = A x with unit couplings for the unknowns of the blocks in [blockBegin, blockEnd).
+ *
+ * @param x the vector to multiply
+ * @param y the result
+ * @param blockBegin first block
+ * @param blockEnd one past the last block
+ *
+ */
+void CompactPoisson::multiplyBlocks(const float* x, float* y, int blockBegin, int blockEnd) const
+{
+	int n = (int) m_cells.size();
+	int last = std::min(blockEnd * BLOCK, n);
+	for (int u=blockBegin*BLOCK; u<last; ++u) {
+		unsigned char links = m_links[u];
+		float xu = x[u];
+		float sum = 0.0f;
+		if (links & LINK_MINUS_X)
+			sum += xu - x[u-1];
+		if (links & LINK_PLUS_X)
+			sum += xu - x[u+1];
+		if (links & LINK_MINUS_Y)
+			sum += xu - x[m_minusY[u]];
+		if (links & LINK_PLUS_Y)
+			sum += xu - x[m_plusY[u]];
+		if (links & LINK_MINUS_Z)
+			sum += xu - x[m_minusZ[u]];
+		if (links & LINK_PLUS_Z)
+			sum += xu - x[m_plusZ[u]];
+		y[u] = sum;
+	}
+}
+
+
+/**
+ * Per block inner products of dot.
+ *
+ * @param a the first vector
+ * @param b the second vector
+ * @param sums the inner product of each block
+ * @param blockBegin first block
+ * @param blockEnd one past the last block
+ *
+ */
+void CompactPoisson::dotBlocks(const float* a, const float* b, double* sums, int blockBegin, int blockEnd) const
+{
+	int n = (int) m_cells.size();
+	for (int block=blockBegin; block<blockEnd; ++block) {
+		int last = std::min((block + 1) * BLOCK, n);
+		double sum = 0.0;
+		for (int u=block*BLOCK; u<last; ++u)
+			sum += a[u] * b[u];
+		sums[block] = sum;
+	}
+}
+
+
+/**
+ * Inner product accumulated in double, one block per task.
+ *
+ * @param a the first vector
+ * @param b the second vector
+ * @return \f$a^T b\f$
+ *
+ */
+double CompactPoisson::dot(const std::vector<float>& a, const std::vector<float>& b)
+{
+	int blocks = ((int) m_cells.size() + BLOCK - 1) / BLOCK;
+	std::vector<double> sums(blocks, 0.0);
+	m_pool->parallelFor(0, blocks, boost::bind(&CompactPoisson::dotBlocks, this, &a[0], &b[0], &sums[0], _1, _2));
+
+	double total = 0.0;
+	for (int block=0; block<blocks; ++block)
+		total += sums[block];
+	return total;
+}
+
+
+/**
+ * Removes the mean of x over the unknowns.
+ *
+ * @param x the vector to project
+ *
+ */
+void CompactPoisson::removeMean(float* x)
+{
+	int n = (int) m_cells.size();
+	double total = 0.0;
+	for (int u=0; u<n; ++u)
+		total += x[u];
+
+	float mean = (float) (total / n);
+	for (int u=0; u<n; ++u)
+		x[u] -= mean;
+}
+
+}	// namespace fdl
@@ -0,0 +1,95 @@
+#include <algorithm>
+#include <cmath>
+
+#include "core/convergencemonitor.h"
+#include "logger/logger.h"
+
+namespace fdl {
+
+/**
+ * Constructor. By default a solve stagnates when the best residual has not dropped
+ * by 1% over 25 checks.
+ *
+ */
+ConvergenceMonitor::ConvergenceMonitor() : m_name(""), m_tolerance(0.0f), m_maxIter(0),
+	m_window(25), m_factor(0.99f), m_checkStagnation(true), m_iterations(0), m_converged(false), m_stagnated(false)
+{
+}
+
+
+/**
+ * Starts monitoring a solve, clearing the history and turning the stagnation test on.
+ *
+ * @param name the solver name used in the warnings
+ * @param tolerance the residual to reach
+ * @param maxIter the maximum number of iterations
+ *
+ */
+void ConvergenceMonitor::begin(const char* name, float tolerance, unsigned maxIter)
+{
+	m_name = name;
+	m_tolerance = tolerance;
+	m_maxIter = maxIter;
+	m_history.clear();
+	m_iterations = 0;
+	m_converged = false;
+	m_stagnated = false;
+	m_checkStagnation = true;
+}
+
+
+/**
+ * Records the residual after some iterations and tells whether to go on.
+ *
+ * @param rho the squared residual
+ * @param iteration the number of iterations done so far
+ * @return false when the solve should stop
+ *
+ */
+bool ConvergenceMonitor::proceed(double rho, unsigned iteration)
+{
+	float residual = (float) std::sqrt(rho);
+	m_history.push_back(residual);
+	m_iterations = iteration;
+
+	if (residual <= m_tolerance) {
+		m_converged = true;
+		return false;
+	}
+	if (iteration >= m_maxIter)
+		return false;
+
+	size_t n = m_history.size();
+	if (m_checkStagnation && m_window > 0 && n > m_window) {
+		float before = *std::min_element(m_history.begin(), m_history.end() - m_window);
+		float recent = *std::min_element(m_history.end() - m_window, m_history.end());
+		if (recent > m_factor * before) {
+			m_stagnated = true;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+/**
+ * Ends the solve, warning when it stopped without reaching the tolerance.
+ *
+ */
+void ConvergenceMonitor::end()
+{
+	if (m_converged)
+		return;
+
+	float residual = m_history.empty()? 0.0f: m_history.back();
+	if (m_stagnated) {
+		LOG(fdl::Logger::WARN) << "  + " << m_name << ": stagnated at residual " << residual
+			<< " after " << m_iterations << " iterations (tolerance " << m_tolerance << ")";
+	} else {
+		LOG(fdl::Logger::WARN) << "  + " << m_name << ": not converged after " << m_iterations
+			<< " iterations, residual " << residual << " (tolerance " << m_tolerance << ")";
+	}
+}
+
+}	// namespace fdl
@@ -0,0 +1,165 @@
+#include <cmath>
+
+#include "core/dct.h"
+#include "core/common.h"
+
+namespace fdl {
+
+/**
+ * Constructor.
+ *
+ */
+DCT::DCT() : m_n(0), m_radix2(false)
+{
+}
+
+
+/**
+ * Precomputes the tables for transforms of length n.
+ *
+ * @param n the transform length
+ *
+ */
+void DCT::init(int n)
+{
+	if (n == m_n)
+		return;
+	m_n = n;
+	m_radix2 = n > 0 && (n & (n-1)) == 0;
+
+	m_twiddle.resize(n);
+	for (int k=0; k<n; ++k)
+		m_twiddle[k] = std::polar(1.0, -PI * k / (2.0 * n));
+
+	m_roots.clear();
+	m_bitReverse.clear();
+	m_cos.clear();
+
+	if (m_radix2) {
+		m_roots.resize(n/2);
+		for (int j=0; j<n/2; ++j)
+			m_roots[j] = std::polar(1.0, -2.0 * PI * j / n);
+
+		int bits = 0;
+		while ((1 << bits) < n)
+			++bits;
+		m_bitReverse.resize(n);
+		for (int i=0; i<n; ++i) {
+			int r = 0;
+			for (int b=0; b<bits; ++b)
+				r |= ((i >> b) & 1) << (bits-1-b);
+			m_bitReverse[i] = r;
+		}
+	} else {
+		m_cos.resize(n * n);
+		for (int k=0; k<n; ++k)
+			for (int i=0; i<n; ++i)
+				m_cos[k*n+i] = std::cos(PI * k * (2*i+1) / (2.0 * n));
+	}
+}
+
+
+/**
+ * In place DCT-II.
+ *
+ * @param data n values, replaced by their transform
+ * @param work scratch space for n complex values
+ *
+ */
+void DCT::forward(double* data, std::complex<double>* work) const
+{
+	int n = m_n;
+	if (!m_radix2) {
+		for (int i=0; i<n; ++i)
+			work[i] = data[i];
+		for (int k=0; k<n; ++k) {
+			const double* c = &m_cos[k*n];
+			double sum = 0.0;
+			for (int i=0; i<n; ++i)
+				sum += c[i] * work[i].real();
+			data[k] = sum;
+		}
+		return;
+	}
+
+	// v = (x0, x2, x4, ..., x5, x3, x1)
+	for (int i=0; 2*i<n; ++i)
+		work[i] = data[2*i];
+	for (int i=0; 2*i+1<n; ++i)
+		work[n-1-i] = data[2*i+1];
+
+	fft(work, false);
+
+	for (int k=0; k<n; ++k)
+		data[k] = (m_twiddle[k] * work[k]).real();
+}
+
+
+/**
+ * In place inverse of forward (a DCT-III scaled by 2/n).
+ *
+ * @param data n coefficients, replaced by the values they transform from
+ * @param work scratch space for n complex values
+ *
+ */
+void DCT::inverse(double* data, std::complex<double>* work) const
+{
+	int n = m_n;
+	if (!m_radix2) {
+		for (int k=0; k<n; ++k)
+			work[k] = data[k] * (k == 0? 1.0 / n: 2.0 / n);
+		for (int i=0; i<n; ++i) {
+			double sum = 0.0;
+			for (int k=0; k<n; ++k)
+				sum += m_cos[k*n+i] * work[k].real();
+			data[i] = sum;
+		}
+		return;
+	}
+
+	// V_k = exp(i pi k / 2n) (X_k - i X_{n-k}), X_n = 0
+	work[0] = data[0];
+	for (int k=1; k<n; ++k)
+		work[k] = std::conj(m_twiddle[k]) * std::complex<double>(data[k], -data[n-k]);
+
+	fft(work, true);
+
+	double scale = 1.0 / n;
+	for (int i=0; 2*i<n; ++i)
+		data[2*i] = work[i].real() * scale;
+	for (int i=0; 2*i+1<n; ++i)
+		data[2*i+1] = work[n-1-i].real() * scale;
+}
+
+
+/**
+ * Iterative radix-2 FFT, unscaled in both directions.
+ *
+ * @param a n complex values, transformed in place
+ * @param inverse true for the positive exponent
+ *
+ */
+void DCT::fft(std::complex<double>* a, bool inverse) const
+{
+	int n = m_n;
+	for (int i=0; i<n; ++i) {
+		int j = m_bitReverse[i];
+		if (i < j)
+			std::swap(a[i], a[j]);
+	}
+
+	for (int len=2; len<=n; len<<=1) {
+		int half = len / 2;
+		int step = n / len;
+		for (int start=0; start<n; start+=len) {
+			for (int j=0; j<half; ++j) {
+				std::complex<double> w = inverse? std::conj(m_roots[j*step]): m_roots[j*step];
+				std::complex<double> t = w * a[start+j+half];
+				a[start+j+half] = a[start+j] - t;
+				a[start+j] += t;
+			}
+		}
+	}
+}
+
+}	// namespace fdl
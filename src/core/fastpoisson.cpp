@@ -0,0 +1,207 @@
+#include <algorithm>
+#include <cmath>
+
+#include <boost/bind.hpp>
+
+#include "core/fastpoisson.h"
+#include "logger/logger.h"
+
+namespace fdl {
+
+/**
+ * Constructor.
+ *
+ */
+FastPoisson::FastPoisson() : m_nx(0), m_ny(0), m_nz(0), m_slice(0), m_scale(0)
+{
+}
+
+
+/**
+ * Sets up the transforms and eigenvalues for a grid size and matrix scale. Only the
+ * scale is updated when the size has not changed.
+ *
+ * @param nx grid size in x
+ * @param ny grid size in y
+ * @param nz grid size in z
+ * @param scale the coupling between neighboring cells, dt/(rho*dx^2)
+ *
+ */
+void FastPoisson::build(int nx, int ny, int nz, float scale)
+{
+	m_scale = scale;
+	if (nx == m_nx && ny == m_ny && nz == m_nz)
+		return;
+
+	m_nx = nx;
+	m_ny = ny;
+	m_nz = nz;
+	m_slice = nx * ny;
+	m_dctX.init(nx);
+	m_dctY.init(ny);
+	m_dctZ.init(nz);
+
+	m_eigenX.resize(nx);
+	m_eigenY.resize(ny);
+	m_eigenZ.resize(nz);
+	for (int i=0; i<nx; ++i)
+		m_eigenX[i] = 2.0 - 2.0 * std::cos(PI * i / nx);
+	for (int j=0; j<ny; ++j)
+		m_eigenY[j] = 2.0 - 2.0 * std::cos(PI * j / ny);
+	for (int k=0; k<nz; ++k)
+		m_eigenZ[k] = 2.0 - 2.0 * std::cos(PI * k / nz);
+}
+
+
+/**
+ * Solves A x = b. Any constant component of b is ignored.
+ *
+ * @param b the right hand side
+ * @param x the solution, with zero mean
+ * @param pool the threads that run the transforms
+ *
+ */
+void FastPoisson::solve(const Vector& b, Vector& x, ThreadPool* pool)
+{
+	float* data = &x[0];
+	std::copy(b.begin(), b.end(), x.begin());
+
+	int rows = m_ny * m_nz;
+	int grain = std::max(1, 4096 / m_nx);
+	pool->parallelFor(0, rows, boost::bind(&FastPoisson::transformRows, this, data, false, _1, _2), grain);
+	pool->parallelFor(0, m_nz, boost::bind(&FastPoisson::transformSlices, this, data, false, _1, _2));
+	pool->parallelFor(0, m_ny, boost::bind(&FastPoisson::transformColumns, this, data, false, _1, _2));
+
+	pool->parallelFor(0, m_nz, boost::bind(&FastPoisson::divideSlices, this, data, _1, _2));
+
+	pool->parallelFor(0, m_ny, boost::bind(&FastPoisson::transformColumns, this, data, true, _1, _2));
+	pool->parallelFor(0, m_nz, boost::bind(&FastPoisson::transformSlices, this, data, true, _1, _2));
+	pool->parallelFor(0, rows, boost::bind(&FastPoisson::transformRows, this, data, true, _1, _2), grain);
+}
+
+
+/**
+ * Transforms the x-rows [rowBegin, rowEnd), row y + z*ny starting at (y + z*ny)*nx.
+ *
+ * @param data the grid
+ * @param inverse true for the inverse transform
+ * @param rowBegin first row
+ * @param rowEnd one past the last row
+ *
+ */
+void FastPoisson::transformRows(float* data, bool inverse, int rowBegin, int rowEnd)
+{
+	std::vector<double> line(m_nx);
+	std::vector<std::complex<double> > work(m_nx);
+
+	for (int row=rowBegin; row<rowEnd; ++row) {
+		float* p = data + row * m_nx;
+		std::copy(p, p + m_nx, line.begin());
+		if (inverse)
+			m_dctX.inverse(&line[0], &work[0]);
+		else
+			m_dctX.forward(&line[0], &work[0]);
+		for (int i=0; i<m_nx; ++i)
+			p[i] = (float) line[i];
+	}
+}
+
+
+/**
+ * Transforms along y in the z-slices [zBegin, zEnd). Each slice is copied whole so
+ * that the strided lines are gathered from cache.
+ *
+ * @param data the grid
+ * @param inverse true for the inverse transform
+ * @param zBegin first slice
+ * @param zEnd one past the last slice
+ *
+ */
+void FastPoisson::transformSlices(float* data, bool inverse, int zBegin, int zEnd)
+{
+	std::vector<double> plane(m_slice);
+	std::vector<double> line(m_ny);
+	std::vector<std::complex<double> > work(m_ny);
+
+	for (int z=zBegin; z<zEnd; ++z) {
+		float* p = data + z * m_slice;
+		std::copy(p, p + m_slice, plane.begin());
+		for (int i=0; i<m_nx; ++i) {
+			for (int j=0; j<m_ny; ++j)
+				line[j] = plane[i + j * m_nx];
+			if (inverse)
+				m_dctY.inverse(&line[0], &work[0]);
+			else
+				m_dctY.forward(&line[0], &work[0]);
+			for (int j=0; j<m_ny; ++j)
+				plane[i + j * m_nx] = line[j];
+		}
+		for (int i=0; i<m_slice; ++i)
+			p[i] = (float) plane[i];
+	}
+}
+
+
+/**
+ * Transforms along z in the xz-planes [yBegin, yEnd). Each plane is copied row by
+ * row so that the strided lines are gathered from cache.
+ *
+ * @param data the grid
+ * @param inverse true for the inverse transform
+ * @param yBegin first plane
+ * @param yEnd one past the last plane
+ *
+ */
+void FastPoisson::transformColumns(float* data, bool inverse, int yBegin, int yEnd)
+{
+	std::vector<double> plane(m_nx * m_nz);
+	std::vector<double> line(m_nz);
+	std::vector<std::complex<double> > work(m_nz);
+
+	for (int y=yBegin; y<yEnd; ++y) {
+		for (int k=0; k<m_nz; ++k) {
+			float* p = data + y * m_nx + k * m_slice;
+			std::copy(p, p + m_nx, plane.begin() + k * m_nx);
+		}
+		for (int i=0; i<m_nx; ++i) {
+			for (int k=0; k<m_nz; ++k)
+				line[k] = plane[i + k * m_nx];
+			if (inverse)
+				m_dctZ.inverse(&line[0], &work[0]);
+			else
+				m_dctZ.forward(&line[0], &work[0]);
+			for (int k=0; k<m_nz; ++k)
+				plane[i + k * m_nx] = line[k];
+		}
+		for (int k=0; k<m_nz; ++k) {
+			float* p = data + y * m_nx + k * m_slice;
+			for (int i=0; i<m_nx; ++i)
+				p[i] = (float) plane[i + k * m_nx];
+		}
+	}
+}
+
+
+/**
+ * Divides the transformed slices [zBegin, zEnd) by the eigenvalues of the matrix.
+ *
+ * @param data the transformed grid
+ * @param zBegin first slice
+ * @param zEnd one past the last slice
+ *
+ */
+void FastPoisson::divideSlices(float* data, int zBegin, int zEnd)
+{
+	for (int k=zBegin; k<zEnd; ++k) {
+		for (int j=0; j<m_ny; ++j) {
+			float* p = data + j * m_nx + k * m_slice;
+			double eigenYZ = m_eigenY[j] + m_eigenZ[k];
+			for (int i=0; i<m_nx; ++i) {
+				double eigen = m_scale * (m_eigenX[i] + eigenYZ);
+				p[i] = eigen > 0.0? (float) (p[i] / eigen): 0.0f;
+			}
+		}
+	}
+}
+
+}	// namespace fdl
@@ -7,9 +7,13 @@
 #include <cfloat>
 
 #include <png.h>
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/bind.hpp>
 
+#include "core/advectionpolicy.h"
 #include "core/common.h"
 #include "core/fluidsolver.h"
+#include "core/simd.hpp"
 #include "logger/logger.h"
 
 
@@ -34,6 +38,26 @@ FluidSolver::FluidSolver(Grid* _grid)
 	m_velSlice = grid->getVelocityGridSlice();
 	m_dx = grid->getVoxelSize();
 	m_time = 0.0f;
+	m_preconditioner = MIC0;
+	m_solver = AUTO;
+	m_deflationSize = 8;
+	m_relativeTolerance = 0.0f;
+	m_stencil = COEFFICIENT_ARRAYS;
+	m_advection = SEMI_LAGRANGIAN;
+	m_interpolation = CATMULLROM;
+	m_integration = RK2;
+	m_tilesX = (m_gridX + TILE_SIZE-1) / TILE_SIZE;
+	m_tilesY = (m_gridY + TILE_SIZE-1) / TILE_SIZE;
+	m_tilesZ = (m_gridZ + TILE_SIZE-1) / TILE_SIZE;
+	m_occupiedTiles.resize(m_tilesX * m_tilesY * m_tilesZ, 1);
+	m_activeTiles.resize(m_tilesX * m_tilesY * m_tilesZ, 1);
+	m_activityThreshold = -1.0f;
+	m_maxSpeed = 0.0f;
+	m_lowPrecisionDirty = true;
+	m_compactDirty = true;
+	m_ssorDirty = true;
+	m_batchFactorDirty = true;
+	m_pool = new ThreadPool();
 	
 	// allocate memory
 	m_tempW.resize(m_numPoints);
@@ -41,9 +65,14 @@ FluidSolver::FluidSolver(Grid* _grid)
 	m_tempZ.resize(m_numPoints);
 	m_tempR.resize(m_numPoints);
 	m_tempQ.resize(m_numPoints);
+	m_tempS.resize(m_numPoints);
 	m_curl.resize(m_numPoints);
 	m_vorticityConfinementForce.resize(m_numPoints);
 	m_curlMagnitude.resize(m_numPoints);
+	m_departureCell.resize(m_numPoints, -1);
+	m_departureAlpha.resize(m_numPoints);
+	m_departureBeta.resize(m_numPoints);
+	m_departureGamma.resize(m_numPoints);
 	m_divergence.resize(m_numPoints);
 	m_pressure.resize(m_numPoints);
 	m_precond.resize(m_numPoints);
@@ -51,6 +80,8 @@ FluidSolver::FluidSolver(Grid* _grid)
 	m_APlusX.resize(m_numPoints);
 	m_APlusY.resize(m_numPoints);
 	m_APlusZ.resize(m_numPoints);
+	m_fluidMask.resize(m_numPoints);
+	m_faceFlags.resize(m_numPoints);
 	
 	// initialize matrix/preconditioner
 	constructMatrix(m_dx, 0.1f);
@@ -73,6 +104,7 @@ FluidSolver::FluidSolver(Grid* _grid)
 
 FluidSolver::~FluidSolver()
 {
+	delete m_pool;
 }
 
 
@@ -89,6 +121,84 @@ void FluidSolver::setCGTolerance(float tol) { tol_cg = tol; }
 void FluidSolver::setCGMaxIter(unsigned N) { maxiter_cg = N; }
 
 
+/**
+ * Selects the preconditioner used by pcgSolve. The preconditioner is rebuilt so that
+ * it can be changed between steps.
+ *
+ * @param type MIC0 for modified incomplete Cholesky, MULTIGRID for a V-cycle (MGPCG),
+ * FAST_POISSON, BLOCK_JACOBI or INCOMPLETE_POISSON
+ */
+void FluidSolver::setPreconditioner(precond_T type)
+{
+	m_preconditioner = type;
+	constructPreconditioner();
+}
+
+
+/**
+ * The linear solvers project() can use, by the name given to --solver or to the type 
+ * attribute of the scene's solver element.
+ */
+const FluidSolver::SolverEntry FluidSolver::s_solvers[] = {
+	{ "PCG", PCG, &FluidSolver::pcgSolve },
+	{ "CG", CG, &FluidSolver::cgSolve },
+	{ "FusedPCG", FUSED_PCG, &FluidSolver::fusedPcgSolve },
+	{ "DeflatedPCG", DEFLATED_PCG, &FluidSolver::deflatedPcgSolve },
+	{ "MixedPCG", MIXED_PCG, &FluidSolver::mixedPcgSolve },
+	{ "Jacobi", CHEBYSHEV_JACOBI, &FluidSolver::chebyshevJacobiSolve },
+	{ "SOR", RB_SOR, &FluidSolver::sorSolve },
+	{ "SSOR", SSOR_PCG, &FluidSolver::ssorPcgSolve },
+	{ "CompactPCG", COMPACT_PCG, &FluidSolver::compactPcgSolve },
+	{ "FastPoisson", DCT_POISSON, &FluidSolver::fastPoissonSolve },
+	{ NULL, PCG, NULL }
+};
+
+
+/**
+ * Selects the linear solver by its registry name (case insensitive).
+ *
+ * @param name one of the names listed by getSolverNames
+ * @return false if there is no such solver, in which case the solver is unchanged
+ */
+bool FluidSolver::setSolver(const std::string& name)
+{
+	for (const SolverEntry* entry=s_solvers; entry->name; ++entry) {
+		if (boost::algorithm::iequals(name, entry->name)) {
+			m_solver = entry->type;
+			return true;
+		}
+	}
+	return false;
+}
+
+
+/**
+ * Lists the names of the registered linear solvers, as "[ PCG | CG | ... ]".
+ *
+ */
+std::string FluidSolver::getSolverNames()
+{
+	std::string names = "[";
+	for (const SolverEntry* entry=s_solvers; entry->name; ++entry)
+		names += std::string(entry == s_solvers? " ": " | ") + entry->name;
+	return names + " ]";
+}
+
+
+/**
+ * Sets the number of threads used by the parallel kernels.
+ *
+ * @param threads number of threads, zero or less for one per hardware thread
+ */
+void FluidSolver::setNumberOfThreads(int threads)
+{
+	delete m_pool;
+	m_pool = new ThreadPool(threads);
+	if (m_preconditioner == BLOCK_JACOBI)
+		constructPreconditioner();
+}
+
+
 /**
  * Set density source parameters: position and size.
  */
@@ -134,7 +244,7 @@ float FluidSolver::computeMaxTimeStep() const {
 	g.y *= (5.0 * m_dx);
 	g.z *= (5.0 * m_dx);
 	
-	float maxVelocity = grid->getMaximumVelocity();
+	float maxVelocity = (m_activityThreshold < 0)? grid->getMaximumVelocity(): m_maxSpeed;
 	
 	if (maxVelocity < 0.2) maxVelocity = 0.2f;
 	
@@ -151,6 +261,10 @@ float FluidSolver::computeMaxTimeStep() const {
  * @param dt delta time value to step forward
  */
 void FluidSolver::step(float dt) {
+	// The tile scan also finds the greatest velocity for the time step
+	if (m_activityThreshold >= 0)
+		scanTiles();
+
 	if(dt <= 0){
 		dt = computeMaxTimeStep();
 	}
@@ -159,6 +273,9 @@ void FluidSolver::step(float dt) {
 	}
 		
 	INFO() << "FluidSolver: step ("  << dt << ") ..";
+
+	if (m_activityThreshold >= 0)
+		dilateTiles(dt);
 	
 	INFO() << "  + Performing advection step ..";
 	advect(dt);
@@ -240,25 +357,58 @@ void FluidSolver::applyForces(float dt)
 {
 	grid->clearForces();
 
-	// Calculate the magnitude of the curl
+	// Calculate the magnitude of the curl, sampling the velocity on the six faces of
+	// the fluid cells of a row as batches: left, right, top, bottom, front and back
+	const float offset[6][3] = {
+		{ 0.0f, 0.5f, 0.5f }, { 1.0f, 0.5f, 0.5f }, { 0.5f, 0.0f, 0.5f },
+		{ 0.5f, 1.0f, 0.5f }, { 0.5f, 0.5f, 0.0f }, { 0.5f, 0.5f, 1.0f }
+	};
+	std::vector<float> buffer(21 * m_gridX);
+	std::vector<int> cells(m_gridX);
+	float* px = &buffer[0];
+	float* py = px + m_gridX;
+	float* pz = py + m_gridX;
+	float* vel = pz + m_gridX;
+
 	for (int z=0; z<m_gridZ; ++z) {
-		int pos = z * m_slice;
 		for (int y=0; y<m_gridY; ++y) {
-			for (int x=0; x<m_gridX; ++x, ++pos) {
-				if (grid->isSolid(pos))
+			int row = y*m_gridX + z*m_slice;
+			const unsigned char* tiles = activeTileRow(y, z);
+			int n = 0;
+			for (int x=0; x<m_gridX; ++x) {
+				if (grid->isSolid(row + x))
 					continue;
-					
-				fdl::Vector3 velTop     = grid->getVelocity(fdl::Point3((x+0.5f)*m_dx, (y+0.0f)*m_dx, (z+0.5f)*m_dx));
-				fdl::Vector3 velBot     = grid->getVelocity(fdl::Point3((x+0.5f)*m_dx, (y+1.0f)*m_dx, (z+0.5f)*m_dx));
-				fdl::Vector3 velLeft    = grid->getVelocity(fdl::Point3((x+0.0f)*m_dx, (y+0.5f)*m_dx, (z+0.5f)*m_dx));
-				fdl::Vector3 velRight   = grid->getVelocity(fdl::Point3((x+1.0f)*m_dx, (y+0.5f)*m_dx, (z+0.5f)*m_dx));
-				fdl::Vector3 velFront   = grid->getVelocity(fdl::Point3((x+0.5f)*m_dx, (y+0.5f)*m_dx, (z+0.0f)*m_dx));
-				fdl::Vector3 velBack    = grid->getVelocity(fdl::Point3((x+0.5f)*m_dx, (y+0.5f)*m_dx, (z+1.0f)*m_dx));
-
-				fdl::Vector3 dudx = (velRight - velLeft) / m_dx;
-				fdl::Vector3 dudy = (velBot - velTop) / m_dx;
-				fdl::Vector3 dudz = (velBack - velFront) / m_dx;
+				if (tiles[x / TILE_SIZE]) {
+					cells[n++] = x;
+				}
+				else {
+					m_curl[row + x] = fdl::Vector3(0,0,0);
+					m_curlMagnitude[row + x] = 0.0f;
+				}
+			}
+
+			for (int f=0; f<6; ++f) {
+				for (int i=0; i<n; ++i) {
+					px[i] = (cells[i] + offset[f][0])*m_dx;
+					py[i] = (y + offset[f][1])*m_dx;
+					pz[i] = (z + offset[f][2])*m_dx;
+				}
+				float* u = vel + 3*f*m_gridX;
+				grid->getVelocities(px, py, pz, u, u + m_gridX, u + 2*m_gridX, n);
+			}
+
+			for (int i=0; i<n; ++i) {
+				fdl::Vector3 face[6];
+				for (int f=0; f<6; ++f) {
+					const float* u = vel + 3*f*m_gridX + i;
+					face[f] = fdl::Vector3(u[0], u[m_gridX], u[2*m_gridX]);
+				}
+
+				fdl::Vector3 dudx = (face[1] - face[0]) / m_dx;
+				fdl::Vector3 dudy = (face[3] - face[2]) / m_dx;
+				fdl::Vector3 dudz = (face[5] - face[4]) / m_dx;
 				fdl::Vector3 curl(dudy.z - dudz.y, dudz.x - dudx.z, dudx.y-dudy.x);
+				int pos = row + cells[i];
 				m_curl[pos] = curl;
 				m_curlMagnitude[pos] = curl.length();
 			}
@@ -269,12 +419,17 @@ void FluidSolver::applyForces(float dt)
 	for (int z=0; z<m_gridZ; ++z) {
 		int pos = z * m_slice;
 		for (int y=0; y<m_gridY; ++y) {
+			const unsigned char* tiles = activeTileRow(y, z);
 			for (int x=0; x<m_gridX; ++x, ++pos) {
 				if (y==0 || x==0 || z == 0 || x==m_gridX-1 
 					|| y==m_gridY-1 || z == m_gridZ-1 || grid->isSolid(pos)) {
 					m_curl[pos] = fdl::Vector3(0,0,0);
 					continue;
 				}
+				if (!tiles[x / TILE_SIZE]) {
+					m_vorticityConfinementForce[pos] = fdl::Vector3(0,0,0);
+					continue;
+				}
 				fdl::Vector3 N(
 					m_curlMagnitude[pos+1] - m_curlMagnitude[pos-1],
 					m_curlMagnitude[pos+m_gridX] - m_curlMagnitude[pos-m_gridX],
@@ -288,7 +443,24 @@ void FluidSolver::applyForces(float dt)
 		}
 	}
 
-	// Add the buoyancy force (Boussinesq approximation)
+	// Add the buoyancy force (Boussinesq approximation), sampling the density at the 
+	// faces with the interpolation advect uses
+	if (m_interpolation == LINEAR)
+		addBuoyancy<LinearInterpolator>();
+	else
+		addBuoyancy<CatmullRomInterpolator>();
+}
+
+
+/**
+ * Adds the buoyancy force (Boussinesq approximation) to the faces of the fluid cells,
+ * along with the vorticity confinement force computed by applyForces. The density 
+ * and temperature are sampled at each face with the given interpolation.
+ *
+ */
+template<class Interpolator>
+void FluidSolver::addBuoyancy()
+{
 	float ambient = 0;
 	// a and b "scaled" over g default (9.8), so we can use them with a generic gravity
 	float a = 0.0625f*0.5f/9.8;
@@ -297,32 +469,190 @@ void FluidSolver::applyForces(float dt)
 		int pos = z * m_slice;
 		int velIdx = z * m_velSlice;
 		for (int y=0; y<m_gridY; ++y, ++velIdx) {
+			const unsigned char* tiles = activeTileRow(y, z);
 			for (int x=0; x<m_gridX; ++x, ++velIdx, ++pos) {
 				if (grid->isSolid(pos))
 					continue;
 				
-				const Sample topX = grid->getDensity(x*m_dx, (y+0.5f)*m_dx, (z+0.5f)*m_dx);
-				const Sample topY = grid->getDensity((x+0.5f)*m_dx, y*m_dx, (z+0.5f)*m_dx);
-				const Sample topZ = grid->getDensity((x+0.5f)*m_dx, (y+0.5f)*m_dx, z*m_dx);
+				// Quiescent cells are uniform up to the activity threshold
+				Sample topX, topY, topZ;
+				if (tiles[x / TILE_SIZE]) {
+					topX = Interpolator::sample(*grid, x*m_dx, (y+0.5f)*m_dx, (z+0.5f)*m_dx);
+					topY = Interpolator::sample(*grid, (x+0.5f)*m_dx, y*m_dx, (z+0.5f)*m_dx);
+					topZ = Interpolator::sample(*grid, (x+0.5f)*m_dx, (y+0.5f)*m_dx, z*m_dx);
+				}
+				else {
+					topX = topY = topZ = grid->getDensity(pos);
+				}
 				
-				if (x != 0 && !grid->isSolid(pos-1)) 
+				if (x != 0 && !grid->isSolid(pos-1)) {
 					grid->getForce(0)[velIdx] += -(-a*topX.density + b*(topX.temperature - ambient))*m_gravity.x;
 					grid->getForce(0)[velIdx] += (m_vorticityConfinementForce[pos].x + m_vorticityConfinementForce[pos-1].x) * 0.5f;
+				}
 
 				if (y!= 0 && !grid->isSolid(pos-m_gridX)) {
 					grid->getForce(1)[velIdx] += -(-a*topY.density + b*(topY.temperature - ambient))*m_gravity.y;
 					grid->getForce(1)[velIdx] += (m_vorticityConfinementForce[pos].y + m_vorticityConfinementForce[pos-m_gridX].y) * 0.5f;
 				}
 
-				if (z != 0 && !grid->isSolid(pos-m_slice)) 
+				if (z != 0 && !grid->isSolid(pos-m_slice)) {
 					grid->getForce(2)[velIdx] += -(-a*topZ.density + b*(topZ.temperature - ambient))*m_gravity.z;
 					grid->getForce(2)[velIdx] += (m_vorticityConfinementForce[pos].z + m_vorticityConfinementForce[pos-m_slice].z) * 0.5f;
+				}
 			}
 		}
 	}
 }
 
 
+/**
+ * Sets the magnitude below which the velocity, and the variation of density, smoke
+ * and temperature across cells, count as quiescent. Each step then only advects
+ * and applies forces within the tiles that hold more than that, widened by the
+ * distance the flow can travel in the step, so its cost follows the footprint of
+ * the flow rather than the size of the grid. The pressure projection stays global.
+ * A negative threshold turns tracking off.
+ *
+ * @param threshold largest magnitude of a quiescent value
+ */
+void FluidSolver::setActivityThreshold(float threshold)
+{
+	m_activityThreshold = threshold;
+	std::fill(m_activeTiles.begin(), m_activeTiles.end(), 1);
+}
+
+
+/**
+ * Marks the tiles where the velocity, or the difference of density, smoke or
+ * temperature between neighboring cells, is above the activity threshold, and finds
+ * the greatest velocity at the cell centers as getMaximumVelocity does. Runs one
+ * layer of tiles per task.
+ */
+void FluidSolver::scanTiles()
+{
+	std::vector<float> speeds(m_tilesZ);
+	m_pool->parallelFor(0, m_tilesZ, boost::bind(&FluidSolver::scanTileSlices, this, &speeds[0], _1, _2));
+	m_maxSpeed = *std::max_element(speeds.begin(), speeds.end());
+}
+
+
+/**
+ * Scans the layers of tiles [tzBegin, tzEnd) for scanTiles.
+ *
+ * @param speeds the greatest cell center speed of each layer
+ * @param tzBegin first layer of tiles
+ * @param tzEnd one past the last layer of tiles
+ */
+void FluidSolver::scanTileSlices(float* speeds, int tzBegin, int tzEnd)
+{
+	SampleArray& cells = grid->getDensity();
+	const float* density = cells.densityData();
+	const float* smoke = cells.smokeData();
+	const float* temperature = cells.temperatureData();
+	const float* u = &grid->getVelocity(0)[0];
+	const float* v = &grid->getVelocity(1)[0];
+	const float* w = &grid->getVelocity(2)[0];
+	const int neighbor[DIMENSIONS] = { 1, m_gridX, m_slice };
+	const int layer = m_tilesX * m_tilesY;
+
+	for (int tz=tzBegin; tz<tzEnd; ++tz) {
+		unsigned char* tiles = &m_occupiedTiles[tz * layer];
+		std::fill(tiles, tiles + layer, 0);
+		float speed = 0.0f;
+
+		for (int z=tz*TILE_SIZE; z<std::min((tz+1)*TILE_SIZE, m_gridZ); ++z) {
+			for (int y=0; y<m_gridY; ++y) {
+				unsigned char* row = tiles + (y / TILE_SIZE) * m_tilesX;
+				int pos = y*m_gridX + z*m_slice;
+				int velIdx = y*(m_gridX+1) + z*m_velSlice;
+				for (int x=0; x<m_gridX; ++x, ++pos, ++velIdx) {
+					float cu = 0.5f * (u[velIdx] + u[velIdx+1]);
+					float cv = 0.5f * (v[velIdx] + v[velIdx+m_gridX+1]);
+					float cw = 0.5f * (w[velIdx] + w[velIdx+m_velSlice]);
+					speed = std::max(speed, cu*cu + cv*cv + cw*cw);
+
+					float motion = std::max(std::max(std::fabs(u[velIdx]), std::fabs(u[velIdx+1])),
+						std::max(std::max(std::fabs(v[velIdx]), std::fabs(v[velIdx+m_gridX+1])),
+						std::max(std::fabs(w[velIdx]), std::fabs(w[velIdx+m_velSlice]))));
+					float variation = 0.0f;
+					for (int d=0; d<DIMENSIONS; ++d) {
+						int i = (d == 0)? x: (d == 1)? y: z;
+						if (i == 0)
+							continue;
+						int prev = pos - neighbor[d];
+						variation = std::max(variation, std::max(std::fabs(density[pos] - density[prev]),
+							std::max(std::fabs(smoke[pos] - smoke[prev]), std::fabs(temperature[pos] - temperature[prev]))));
+					}
+					if (std::max(motion, variation) > m_activityThreshold)
+						row[x / TILE_SIZE] = 1;
+				}
+			}
+		}
+		speeds[tz] = std::sqrt(speed);
+	}
+}
+
+
+/**
+ * Activates the tiles within reach of an occupied tile in a step of dt: the distance
+ * the fastest flow travels plus the three cells the samplers read around a departure
+ * point. The dilation is separable, one axis after the other.
+ *
+ * @param dt delta time value to step forward
+ */
+void FluidSolver::dilateTiles(float dt)
+{
+	const int reach = (int) std::ceil((m_maxSpeed * dt / m_dx + 3.0f) / TILE_SIZE);
+	const int size[DIMENSIONS] = { m_tilesX, m_tilesY, m_tilesZ };
+	const int stride[DIMENSIONS] = { 1, m_tilesX, m_tilesX * m_tilesY };
+	std::vector<unsigned char> from(m_occupiedTiles);
+
+	for (int d=0; d<DIMENSIONS; ++d) {
+		for (int t=0; t<(int) from.size(); ++t) {
+			int i = (t / stride[d]) % size[d];
+			unsigned char active = 0;
+			for (int j=std::max(i-reach, 0); j<=std::min(i+reach, size[d]-1) && !active; ++j)
+				active = from[t + (j-i)*stride[d]];
+			m_activeTiles[t] = active;
+		}
+		if (d < DIMENSIONS-1)
+			from = m_activeTiles;
+	}
+
+	INFO() << "  + Active tiles: " << std::count(m_activeTiles.begin(), m_activeTiles.end(), 1)
+		<< " of " << m_activeTiles.size();
+}
+
+
+/**
+ * Returns the activity of the tiles along the row of cells (y, z), one entry per
+ * TILE_SIZE cells.
+ *
+ * @param y the y coordinate of the row
+ * @param z the z coordinate of the row
+ */
+const unsigned char* FluidSolver::activeTileRow(int y, int z) const
+{
+	return &m_activeTiles[(y / TILE_SIZE) * m_tilesX + (z / TILE_SIZE) * m_tilesX * m_tilesY];
+}
+
+
+/**
+ * Sets the number of past solutions kept as deflation basis by DEFLATED_PCG.
+ *
+ * @param n maximum number of basis vectors
+ */
+void FluidSolver::setDeflationSize(unsigned n)
+{
+	m_deflationSize = n;
+	while (m_deflationW.size() > m_deflationSize) {
+		m_deflationW.pop_front();
+		m_deflationAW.pop_front();
+	}
+	factorDeflationSystem();
+}
+
+
 /**
  * Takes the fluid field update and projects it down to a divergence-free field using
  * a linear solve on the new pressure values. Afterwards, the solved pressures will be
@@ -400,15 +730,16 @@ void FluidSolver::project(float dt)
 	
 	// TODO: Include smoke divergence control
 	
-	// Construct new coefficient matrix
+	// Bring the cached coefficient matrix and preconditioner up to date
 	//constructMatrix(m_dx, dt, rho, true);
-	constructMatrix(m_dx, dt, rho);
-	
-	// Re-construct the preconditioner 
-	constructPreconditioner(rho);
+	updatePressureSystem(m_dx, dt, rho);
+
+	// The walls make the system singular (pressure is defined up to a constant), so only
+	// the part of the divergence orthogonal to the constant vector can be solved for.
+	removeNullSpace(m_divergence);
 
 	// Perform linear solve
-	m_tmp_residual = pcgSolve(m_divergence, m_pressure);
+	m_tmp_residual = solvePressure(m_divergence, m_pressure);
 
 	// Apply the computed pressure gradients [CONSTANT DENSITY]
 	float scale = dt / (rho * m_dx);
@@ -497,8 +828,9 @@ void FluidSolver::diffuse(float dt, float rate) // WHY DOES DENSITY DISAPPEAR?
 	for (int z=0; z<m_gridZ; ++z) {
 		int pos = z * m_slice;
 		for (int y=0; y<m_gridY; ++y) {
+			const unsigned char* tiles = activeTileRow(y, z);
 			for (int x=0; x<m_gridX; ++x, ++pos) {
-				if (grid->isSolid(pos)) 
+				if (grid->isSolid(pos) || !tiles[x / TILE_SIZE])
 					continue;
 				
 				cell.density = grid->getDensity(pos).density * scale;
@@ -616,73 +948,422 @@ void FluidSolver::applyViscosity(float dt)
 
 
 /**
- * Performs a semi-lagrangian particle back-trace from each cell center. 
+ * Performs a semi-lagrangian particle back-trace from each cell center. Every cell
+ * only reads the current fields and writes its own entries of the last fields, so
+ * the passes each run in parallel over z slices. The departure points of the cell
+ * centers are traced once and kept for the step, so the density and any scalar
+ * passed to advectScalar only pay for the interpolation.<br/>
+ * With MACCORMACK each semi-lagrangian result is advected back and half of the
+ * difference to the start of the step is added to it, which cancels the leading
+ * error term. The result is clamped to the range of the values around the departure
+ * point, so that it cannot create new extrema.<br/>
+ * The back-trace integrator (m_integration) and the density interpolation
+ * (m_interpolation) are template policies of the kernels, picked here once per step.
  * 
  * See: <a href="http://www.dgp.toronto.edu/people/stam/reality/Research/pdf/ns.pdf">Jos Stam. Stable Fluids. SIGGRAPH, pages 121–128, 1999.</a>
+ * See: Andrew Selle, Ronald Fedkiw, ByungMoon Kim, Yingjie Liu and Jarek Rossignac. An
+ * Unconditionally Stable MacCormack Method. Journal of Scientific Computing 35(2), 2008.
  *
  * @param dt delta time value to step forward
  *
  */
 void FluidSolver::advect(float dt)
 {
-	// Advect the density field 	
-	for (int z=0; z<m_gridZ; ++z) {
-		int pos = z*m_slice;
+	switch (m_integration) {
+	case EULER:
+		advectWith<EulerIntegrator>(dt);
+		break;
+	case RK4:
+		advectWith<RungeKutta4Integrator>(dt);
+		break;
+	default:
+		advectWith<MidpointIntegrator>(dt);
+		break;
+	}
+}
+
+
+/**
+ * Picks the density interpolation for advect.
+ *
+ * @param dt delta time value to step forward
+ */
+template<class Integrator>
+void FluidSolver::advectWith(float dt)
+{
+	if (m_interpolation == LINEAR)
+		advectWith<Integrator, LinearInterpolator>(dt);
+	else
+		advectWith<Integrator, CatmullRomInterpolator>(dt);
+}
+
+
+/**
+ * The passes of advect for one integrator and interpolation.
+ *
+ * @param dt delta time value to step forward
+ */
+template<class Integrator, class Interpolator>
+void FluidSolver::advectWith(float dt)
+{
+	// Trace the cell centers back, then advect the density field
+	m_pool->parallelFor(0, m_gridZ, boost::bind(&FluidSolver::traceCellSlices<Integrator>, this, dt, _1, _2));
+	m_pool->parallelFor(0, m_gridZ, boost::bind(&FluidSolver::advectDensitySlices<Interpolator>, this, _1, _2));
+	grid->swapDensities();
+	if (m_advection == MACCORMACK) {
+		m_densityCorrection = grid->getDensity();
+		m_pool->parallelFor(0, m_gridZ, boost::bind(&FluidSolver::correctDensitySlices<Integrator, Interpolator>, this, dt, _1, _2));
+		grid->getDensity().swap(m_densityCorrection);
+	}
+
+	// Advect the velocity field
+	m_pool->parallelFor(0, m_gridZ, boost::bind(&FluidSolver::advectVelocitySlices<Integrator>, this, dt, _1, _2));
+	grid->swapVelocities();
+	if (m_advection == MACCORMACK) {
+		for (int c=0; c<DIMENSIONS; ++c) {
+			m_velocityCorrection = grid->getVelocity(c);
+			m_pool->parallelFor(0, m_gridZ, boost::bind(&FluidSolver::correctVelocitySlices<Integrator>, this, dt, c, _1, _2));
+			grid->getVelocity(c).swap(m_velocityCorrection);
+		}
+	}
+}
+
+
+/**
+ * Advects a cell centered scalar field along the departure points of the last call
+ * to advect, with trilinear interpolation. Solid cells are left at zero and samples
+ * outside of the grid read zero.
+ *
+ * @param field the values at the start of the step
+ * @param result the advected values
+ */
+void FluidSolver::advectScalar(const Vector& field, Vector& result)
+{
+	m_pool->parallelFor(0, m_gridZ, boost::bind(&FluidSolver::advectScalarSlices, this, &field[0], &result[0], _1, _2));
+}
+
+
+/**
+ * Back-traces the fluid cell centers of slices [zBegin, zEnd) and stores the cell and
+ * the position within it of each departure point. The fluid cells of a row are
+ * traced as one batch.
+ *
+ * @param dt delta time value to step forward
+ * @param zBegin first slice
+ * @param zEnd one past the last slice
+ */
+template<class Integrator>
+void FluidSolver::traceCellSlices(float dt, int zBegin, int zEnd)
+{
+	std::vector<float> buffer((3 + Integrator::SCRATCH) * m_gridX);
+	std::vector<int> cells(m_gridX);
+	float* px = &buffer[0];
+	float* py = px + m_gridX;
+	float* pz = py + m_gridX;
+
+	for (int z=zBegin; z<zEnd; ++z) {
 		for (int y=0; y<m_gridY; ++y) {
-			for (int x=0; x<m_gridX; ++x, ++pos) {
-				if (pos >= m_numPoints) {
-					break;
-				}
-				if (grid->isSolid(pos)) {
+			int row = y*m_gridX + z*m_slice;
+			const unsigned char* tiles = activeTileRow(y, z);
+			int n = 0;
+			for (int x=0; x<m_gridX; ++x) {
+				if (grid->isSolid(row + x))
+					continue;
+				if (!tiles[x / TILE_SIZE]) {
+					// Quiescent cells stay where they are
+					m_departureCell[row + x] = row + x;
+					m_departureAlpha[row + x] = m_departureBeta[row + x] = m_departureGamma[row + x] = 0.0f;
 					continue;
 				}
-				fdl::Point3 p((x+0.5f)*m_dx, (y+0.5f)*m_dx, (z+0.5f)*m_dx);
-				fdl::Vector3 vel = grid->getVelocity(p + grid->getVelocity(p) * (-dt * 0.5f)) * -dt;
-				p += vel;
-				grid->setLastDensity(pos, grid->getDensity(p.x, p.y, p.z));
+				cells[n] = row + x;
+				px[n] = (x+0.5f)*m_dx;
+				py[n] = (y+0.5f)*m_dx;
+				pz[n] = (z+0.5f)*m_dx;
+				++n;
+			}
+
+			Integrator::trace(*grid, dt, px, py, pz, pz + m_gridX, n, false);
+			for (int i=0; i<n; ++i) {
+				int pos = cells[i];
+				m_departureCell[pos] = grid->locateCell(px[i], py[i], pz[i],
+					m_departureAlpha[pos], m_departureBeta[pos], m_departureGamma[pos]);
 			}
 		}
 	}
-	
-	grid->swapDensities();
+}
 
-	// Advect the velocity field
-	for (int z=0; z<m_gridZ; ++z) {
-		int pos = z*m_slice;
+
+/**
+ * Stores the density at the departure point of each fluid cell of slices
+ * [zBegin, zEnd) in the last density field.
+ *
+ * @param zBegin first slice
+ * @param zEnd one past the last slice
+ */
+template<class Interpolator>
+void FluidSolver::advectDensitySlices(int zBegin, int zEnd)
+{
+	for (int z=zBegin; z<zEnd; ++z) {
+		int pos = z * m_slice;
 		for (int y=0; y<m_gridY; ++y) {
+			const unsigned char* tiles = activeTileRow(y, z);
 			for (int x=0; x<m_gridX; ++x, ++pos) {
-				int velIdx = x + y * (m_gridX+1) + z * m_velSlice;
-				if (grid->isSolid(pos)) 
+				if (grid->isSolid(pos))
 					continue;
+				int cell = m_departureCell[pos];
+				if (!tiles[x / TILE_SIZE])
+					grid->setLastDensity(pos, grid->getDensity(pos));
+				else if (cell < 0)
+					grid->setLastDensity(pos, 0);
+				else
+					grid->setLastDensity(pos, Interpolator::sample(*grid, cell, m_departureAlpha[pos], m_departureBeta[pos], m_departureGamma[pos]));
+			}
+		}
+	}
+}
 
-				// Advect X velocities
-				if (x < m_gridX-1 && !grid->isSolid(pos + 1)) {					
-					fdl::Point3 p((x+1.0f)*m_dx, (y+.5f)*m_dx, (z+0.5f)*m_dx);
-					fdl::Vector3 vel = grid->getVelocity(p + grid->getVelocity(p) * (-dt * 0.5f)) * -dt;
-					p += vel;
-					grid->getLastVelocity(0)[velIdx+1] = grid->getVelocity(p).x;
-				}
 
-				// Advect Y velocities
-				if (y < m_gridY-1 && !grid->isSolid(pos + m_gridX)) {
-					fdl::Point3 p((x+0.5f)*m_dx, (y+1.0f)*m_dx, (z+0.5f)*m_dx);
-					fdl::Vector3 vel = grid->getVelocity(p + grid->getVelocity(p) * (-dt * 0.5f)) * -dt;
-					p += vel;
-					grid->getLastVelocity(1)[velIdx+m_gridX+1] = grid->getVelocity(p).y;
+/**
+ * Interpolates a cell centered field trilinearly at the departure points of the cells
+ * of slices [zBegin, zEnd).
+ *
+ * @param field the values at the start of the step
+ * @param result the advected values
+ * @param zBegin first slice
+ * @param zEnd one past the last slice
+ */
+void FluidSolver::advectScalarSlices(const float* field, float* result, int zBegin, int zEnd) const
+{
+	for (int pos=zBegin*m_slice; pos<zEnd*m_slice; ++pos) {
+		int cell = m_departureCell[pos];
+		if (grid->isSolid(pos) || cell < 0) {
+			result[pos] = 0.0f;
+			continue;
+		}
+
+		int i = cell % m_gridX;
+		int j = (cell / m_gridX) % m_gridY;
+		int k = cell / m_slice;
+		int dx = (i+1 < m_gridX)? 1: 0;
+		int dy = (j+1 < m_gridY)? m_gridX: 0;
+		int dz = (k+1 < m_gridZ)? m_slice: 0;
+		float alpha = m_departureAlpha[pos];
+		float beta = m_departureBeta[pos];
+		float gamma = m_departureGamma[pos];
+
+		/* Neighbors past the last cell read zero */
+		float A1 = field[cell];
+		float B1 = dx? field[cell+dx]: 0.0f;
+		float C1 = dy? field[cell+dy]: 0.0f;
+		float D1 = (dx && dy)? field[cell+dx+dy]: 0.0f;
+		float A2 = dz? field[cell+dz]: 0.0f;
+		float B2 = (dz && dx)? field[cell+dz+dx]: 0.0f;
+		float C2 = (dz && dy)? field[cell+dz+dy]: 0.0f;
+		float D2 = (dz && dx && dy)? field[cell+dz+dx+dy]: 0.0f;
+
+		result[pos] = (1-gamma) * ((1-alpha) * (1-beta) * A1 + alpha * (1-beta) * B1 + (1-alpha) * beta * C1 + alpha*beta*D1)
+			+ gamma * ((1-alpha) * (1-beta) * A2 + alpha * (1-beta) * B2 + (1-alpha) * beta * C2 + alpha*beta*D2);
+	}
+}
+
+
+/**
+ * Back-traces the faces on the positive side of the cells of slices [zBegin, zEnd)
+ * and stores the velocities found there in the last velocity field. The +z faces
+ * of slice z belong to cell z+1 of the velocity grid, but each is still written by
+ * one cell only. The faces of one direction in a row are traced as one batch.
+ *
+ * @param dt delta time value to step forward
+ * @param zBegin first slice
+ * @param zEnd one past the last slice
+ */
+template<class Integrator>
+void FluidSolver::advectVelocitySlices(float dt, int zBegin, int zEnd)
+{
+	const int neighbor[DIMENSIONS] = { 1, m_gridX, m_slice };
+	const int face[DIMENSIONS] = { 1, m_gridX+1, m_velSlice };
+	std::vector<float> buffer((3 + Integrator::SCRATCH) * m_gridX);
+	std::vector<int> faces(m_gridX);
+	float* px = &buffer[0];
+	float* py = px + m_gridX;
+	float* pz = py + m_gridX;
+	float* scratch = pz + m_gridX;
+
+	for (int z=zBegin; z<zEnd; ++z) {
+		for (int y=0; y<m_gridY; ++y) {
+			int row = y*m_gridX + z*m_slice;
+			int velRow = y*(m_gridX+1) + z*m_velSlice;
+			const unsigned char* tiles = activeTileRow(y, z);
+			for (int c=0; c<DIMENSIONS; ++c) {
+				if ((c == 1 && y == m_gridY-1) || (c == 2 && z == m_gridZ-1))
+					continue;
+
+				const Vector& u0 = grid->getVelocity(c);
+				Vector& u1 = grid->getLastVelocity(c);
+				int last = (c == 0)? m_gridX-1: m_gridX;
+				int n = 0;
+				for (int x=0; x<last; ++x) {
+					if (grid->isSolid(row + x) || grid->isSolid(row + x + neighbor[c]))
+						continue;
+					if (!tiles[x / TILE_SIZE]) {
+						u1[velRow + x + face[c]] = u0[velRow + x + face[c]];
+						continue;
+					}
+					faces[n] = velRow + x + face[c];
+					px[n] = (x + (c == 0? 1.0f: 0.5f))*m_dx;
+					py[n] = (y + (c == 1? 1.0f: 0.5f))*m_dx;
+					pz[n] = (z + (c == 2? 1.0f: 0.5f))*m_dx;
+					++n;
 				}
 
-				// Advect Z velocities
-				if (z < m_gridZ-1 && !grid->isSolid(pos + m_slice)) {
-					fdl::Point3 p((x+0.5f)*m_dx, (y+0.5f)*m_dx, (z+1.0f)*m_dx);
-					fdl::Vector3 vel = grid->getVelocity(p + grid->getVelocity(p) * (-dt * 0.5f)) * -dt;
-					p += vel;
-					grid->getLastVelocity(2)[velIdx+m_velSlice] = grid->getVelocity(p).z;
+				Integrator::trace(*grid, dt, px, py, pz, scratch, n, false);
+				grid->getVelocityComponents(px, py, pz, c, scratch, n);
+				for (int i=0; i<n; ++i)
+					u1[faces[i]] = scratch[i];
+			}
+		}
+	}
+}
+
+
+/**
+ * MACCORMACK correction of the density of the fluid cells of slices [zBegin, zEnd).
+ * The current density holds the semi-lagrangian result and the last density the one
+ * at the start of the step; the velocity has not been advected yet. The corrected
+ * channels are written to m_densityCorrection.
+ *
+ * @param dt delta time value to step forward
+ * @param zBegin first slice
+ * @param zEnd one past the last slice
+ */
+template<class Integrator, class Interpolator>
+void FluidSolver::correctDensitySlices(float dt, int zBegin, int zEnd)
+{
+	std::vector<float> buffer((3 + Integrator::SCRATCH) * m_gridX);
+	std::vector<int> cells(m_gridX);
+	float* px = &buffer[0];
+	float* py = px + m_gridX;
+	float* pz = py + m_gridX;
+
+	SampleArray& advected = grid->getDensity();
+	SampleArray& initial = grid->getLastDensity();
+	const float* before[3] = { initial.densityData(), initial.smokeData(), initial.temperatureData() };
+	const float* after[3] = { advected.densityData(), advected.smokeData(), advected.temperatureData() };
+	float* corrected[3] = { m_densityCorrection.densityData(), m_densityCorrection.smokeData(), m_densityCorrection.temperatureData() };
+
+	for (int z=zBegin; z<zEnd; ++z) {
+		for (int y=0; y<m_gridY; ++y) {
+			int row = y*m_gridX + z*m_slice;
+			const unsigned char* tiles = activeTileRow(y, z);
+			int n = 0;
+			for (int x=0; x<m_gridX; ++x) {
+				if (grid->isSolid(row + x) || m_departureCell[row + x] < 0 || !tiles[x / TILE_SIZE])
+					continue;
+				cells[n] = row + x;
+				px[n] = (x+0.5f)*m_dx;
+				py[n] = (y+0.5f)*m_dx;
+				pz[n] = (z+0.5f)*m_dx;
+				++n;
+			}
+
+			// Advect the result back to the start of the step
+			Integrator::trace(*grid, -dt, px, py, pz, pz + m_gridX, n, false);
+			for (int i=0; i<n; ++i) {
+				int pos = cells[i];
+				Sample back = Interpolator::sample(*grid, px[i], py[i], pz[i]);
+				float error[3] = { back.density, back.smoke, back.temperature };
+
+				// The cells around the departure point bound the corrected value
+				int cell = m_departureCell[pos];
+				int dx = (cell % m_gridX + 1 < m_gridX)? 1: 0;
+				int dy = ((cell / m_gridX) % m_gridY + 1 < m_gridY)? m_gridX: 0;
+				int dz = (cell / m_slice + 1 < m_gridZ)? m_slice: 0;
+				int corner[8] = { cell, cell+dx, cell+dy, cell+dx+dy, cell+dz, cell+dz+dx, cell+dz+dy, cell+dz+dx+dy };
+
+				for (int ch=0; ch<3; ++ch) {
+					float lo = before[ch][cell];
+					float hi = lo;
+					for (int m=1; m<8; ++m) {
+						lo = std::min(lo, before[ch][corner[m]]);
+						hi = std::max(hi, before[ch][corner[m]]);
+					}
+					float value = after[ch][pos] + 0.5f * (before[ch][pos] - error[ch]);
+					corrected[ch][pos] = std::min(std::max(value, lo), hi);
 				}
 			}
 		}
 	}
-	
-	grid->swapVelocities();
+}
+
+
+/**
+ * MACCORMACK correction of the velocity component c on the faces of slices
+ * [zBegin, zEnd) that advectVelocitySlices moved. The current velocity holds the
+ * semi-lagrangian result and the last velocity the one at the start of the step,
+ * which both traces follow. The corrected values are written to m_velocityCorrection.
+ *
+ * @param dt delta time value to step forward
+ * @param c the array index for the dimension of the velocity vector
+ * @param zBegin first slice
+ * @param zEnd one past the last slice
+ */
+template<class Integrator>
+void FluidSolver::correctVelocitySlices(float dt, int c, int zBegin, int zEnd)
+{
+	const int neighbor[DIMENSIONS] = { 1, m_gridX, m_slice };
+	const int face[DIMENSIONS] = { 1, m_gridX+1, m_velSlice };
+	std::vector<float> buffer((8 + Integrator::SCRATCH) * m_gridX);
+	std::vector<int> faces(m_gridX);
+	float* px = &buffer[0];
+	float* py = px + m_gridX;
+	float* pz = py + m_gridX;
+	float* qx = pz + m_gridX;
+	float* qy = qx + m_gridX;
+	float* qz = qy + m_gridX;
+	float* lo = qz + m_gridX;
+	float* hi = lo + m_gridX;
+	float* scratch = hi + m_gridX;
+
+	const Vector& advected = grid->getVelocity(c);
+	const Vector& initial = grid->getLastVelocity(c);
+
+	for (int z=zBegin; z<zEnd; ++z) {
+		if (c == 2 && z == m_gridZ-1)
+			continue;
+		for (int y=0; y<m_gridY; ++y) {
+			if (c == 1 && y == m_gridY-1)
+				continue;
+
+			int row = y*m_gridX + z*m_slice;
+			int velRow = y*(m_gridX+1) + z*m_velSlice;
+			const unsigned char* tiles = activeTileRow(y, z);
+			int last = (c == 0)? m_gridX-1: m_gridX;
+			int n = 0;
+			for (int x=0; x<last; ++x) {
+				if (grid->isSolid(row + x) || grid->isSolid(row + x + neighbor[c]) || !tiles[x / TILE_SIZE])
+					continue;
+				faces[n] = velRow + x + face[c];
+				px[n] = qx[n] = (x + (c == 0? 1.0f: 0.5f))*m_dx;
+				py[n] = qy[n] = (y + (c == 1? 1.0f: 0.5f))*m_dx;
+				pz[n] = qz[n] = (z + (c == 2? 1.0f: 0.5f))*m_dx;
+				++n;
+			}
+
+			// The values around the departure point bound the corrected value
+			Integrator::trace(*grid, dt, px, py, pz, scratch, n, true);
+			grid->getVelocityComponentRanges(px, py, pz, c, lo, hi, n, true);
+
+			// Advect the result back to the start of the step
+			Integrator::trace(*grid, -dt, qx, qy, qz, scratch, n, true);
+			grid->getVelocityComponents(qx, qy, qz, c, scratch, n);
+
+			for (int i=0; i<n; ++i) {
+				int f = faces[i];
+				float value = advected[f] + 0.5f * (initial[f] - scratch[i]);
+				m_velocityCorrection[f] = std::min(std::max(value, lo[i]), hi[i]);
+			}
+		}
+	}
 }
 
 
@@ -700,41 +1381,225 @@ void FluidSolver::constructMatrix(float dx, float dt, float rho)
 {
 	INFO() << "    Constructing pressure matrix for constant density";
 	
-	// clear the coefficients matrix
-	m_ADiag *= 0.0f;
-	m_APlusX *= 0.0f;
-	m_APlusY *= 0.0f;
-	m_APlusZ *= 0.0f;
-	
-	const float scale = dt / (rho * dx * dx);
-	for (int z=0, pos=0; z<m_gridZ; ++z) {
-		for (int y=0; y<m_gridY; ++y) {
-			for (int x=0; x<m_gridX; ++x, ++pos) {
-				bool fluid = !grid->isSolid(pos);
-				bool fluidRight = (x != m_gridX-1) && !grid->isSolid(pos+1);
-				bool fluidBelow = (y != m_gridY-1) && !grid->isSolid(pos+m_gridX);
-				bool fluidBehind = (z != m_gridZ-1) && !grid->isSolid(pos+m_slice);
+	m_matrixScale = dt / (rho * dx * dx);
+	clearDeflationBasis();
+	m_compactDirty = true;
+	m_ssorDirty = true;
+	m_batchFactorDirty = true;
+	m_fluidMask *= 0.0f;
+	m_fluidCells = 0;
+	assembleMatrixRows(0, m_gridX, 0, m_gridY, 0, m_gridZ);
+}
 
-				if (fluid && fluidRight) {
-					m_ADiag[pos] += scale;
-					m_ADiag[pos+1] += scale;
-					m_APlusX[pos] = -scale;
-				}
 
-				if (fluid && fluidBelow) {
-					m_ADiag[pos] += scale;
-					m_ADiag[pos+m_gridX] += scale;
-					m_APlusY[pos] = -scale;
-				}
+/**
+ * Assembles the rows of the pressure matrix for the cells of a box, so that any box
+ * can be redone on its own. The fluid mask of the box is updated from the grid first,
+ * then each row is gathered from the mask of the cell and of its six neighbors; both
+ * passes write only the cells of their own slice and run one slice per task. Uses the
+ * current m_matrixScale and keeps m_fluidCells up to date.
+ *
+ * @param x0 first x
+ * @param x1 one past the last x
+ * @param y0 first y
+ * @param y1 one past the last y
+ * @param z0 first z
+ * @param z1 one past the last z
+ *
+ */
+void FluidSolver::assembleMatrixRows(int x0, int x1, int y0, int y1, int z0, int z1)
+{
+	std::vector<int> changes(m_gridZ, 0);
+	m_pool->parallelFor(z0, z1, boost::bind(&FluidSolver::updateMaskSlices, this, x0, x1, y0, y1, &changes[0], _1, _2));
+	for (int z=z0; z<z1; ++z)
+		m_fluidCells += changes[z];
 
-				if (fluid && fluidBehind) {
-					m_ADiag[pos] += scale;
-					m_ADiag[pos+m_slice] += scale;
-					m_APlusZ[pos] = -scale;
-				}
+	m_pool->parallelFor(z0, z1, boost::bind(&FluidSolver::assembleSlices, this, x0, x1, y0, y1, _1, _2));
+}
+
+
+/**
+ * Copies the solid state of the grid into m_fluidMask for the box [x0, x1)x[y0, y1)
+ * of the slices [zBegin, zEnd).
+ *
+ * @param x0 first x
+ * @param x1 one past the last x
+ * @param y0 first y
+ * @param y1 one past the last y
+ * @param changes the change of the number of fluid cells of each slice
+ * @param zBegin first slice
+ * @param zEnd one past the last slice
+ *
+ */
+void FluidSolver::updateMaskSlices(int x0, int x1, int y0, int y1, int* changes, int zBegin, int zEnd)
+{
+	float* mask = &m_fluidMask[0];
+	for (int z=zBegin; z<zEnd; ++z) {
+		int change = 0;
+		for (int y=y0; y<y1; ++y) {
+			int pos = x0 + y * m_gridX + z * m_slice;
+			for (int x=x0; x<x1; ++x, ++pos) {
+				float fluid = grid->isSolid(pos)? 0.0f: 1.0f;
+				change += (int) fluid - (mask[pos] != 0.0f? 1: 0);
+				mask[pos] = fluid;
+			}
+		}
+		changes[z] = change;
+	}
+}
+
+
+/**
+ * Gathers the rows of the pressure matrix and the face flags for the box
+ * [x0, x1)x[y0, y1) of the slices [zBegin, zEnd) from the fluid mask. Neighbors
+ * outside the grid read a row of zeros, so the inner loop has no branches.
+ *
+ * @param x0 first x
+ * @param x1 one past the last x
+ * @param y0 first y
+ * @param y1 one past the last y
+ * @param zBegin first slice
+ * @param zEnd one past the last slice
+ *
+ */
+void FluidSolver::assembleSlices(int x0, int x1, int y0, int y1, int zBegin, int zEnd)
+{
+	const float* mask = &m_fluidMask[0];
+	const float scale = m_matrixScale;
+	std::vector<float> zeros(m_gridX + 2, 0.0f);
+	const float* none = &zeros[1];
+
+	for (int z=zBegin; z<zEnd; ++z) {
+		for (int y=y0; y<y1; ++y) {
+			int first = y * m_gridX + z * m_slice;
+			const float* row = mask + first;
+			const float* above = y > 0? row - m_gridX: none;
+			const float* below = y+1 < m_gridY? row + m_gridX: none;
+			const float* front = z > 0? row - m_slice: none;
+			const float* behind = z+1 < m_gridZ? row + m_slice: none;
+			float* diag = &m_ADiag[first];
+			float* plusX = &m_APlusX[first];
+			float* plusY = &m_APlusY[first];
+			float* plusZ = &m_APlusZ[first];
+			unsigned char* flags = &m_faceFlags[first];
+
+			// The two ends of the row have one x neighbor, the loop between them two
+			int inner0 = std::max(x0, 1), inner1 = std::min(x1, m_gridX-1);
+			for (int x=inner0; x<inner1; ++x) {
+				float coupling = row[x] * scale;
+				diag[x] = coupling * (row[x+1] + row[x-1] + above[x] + below[x] + front[x] + behind[x]);
+				plusX[x] = -coupling * row[x+1];
+				plusY[x] = -coupling * below[x];
+				plusZ[x] = -coupling * behind[x];
+				flags[x] = row[x] == 0.0f? 0: (unsigned char) ((row[x-1] != 0.0f? FACE_MINUS_X: 0) | (row[x+1] != 0.0f? FACE_PLUS_X: 0)
+					| (above[x] != 0.0f? FACE_MINUS_Y: 0) | (below[x] != 0.0f? FACE_PLUS_Y: 0)
+					| (front[x] != 0.0f? FACE_MINUS_Z: 0) | (behind[x] != 0.0f? FACE_PLUS_Z: 0));
+			}
+			int ends[2] = { 0, m_gridX-1 };
+			for (int end=0; end<(m_gridX > 1? 2: 1); ++end) {
+				int x = ends[end];
+				if (x < x0 || x >= x1)
+					continue;
+				float right = x+1 < m_gridX? row[x+1]: 0.0f;
+				float left = x > 0? row[x-1]: 0.0f;
+				float coupling = row[x] * scale;
+				diag[x] = coupling * (right + left + above[x] + below[x] + front[x] + behind[x]);
+				plusX[x] = -coupling * right;
+				plusY[x] = -coupling * below[x];
+				plusZ[x] = -coupling * behind[x];
+				flags[x] = row[x] == 0.0f? 0: (unsigned char) ((left != 0.0f? FACE_MINUS_X: 0) | (right != 0.0f? FACE_PLUS_X: 0)
+					| (above[x] != 0.0f? FACE_MINUS_Y: 0) | (below[x] != 0.0f? FACE_PLUS_Y: 0)
+					| (front[x] != 0.0f? FACE_MINUS_Z: 0) | (behind[x] != 0.0f? FACE_PLUS_Z: 0));
+			}
+		}
+	}
+}
+
+
+/**
+ * Brings the cached pressure matrix and preconditioner up to date for this step
+ * instead of rebuilding them. The matrix only depends on the solid cells and on
+ * dt/(rho*dx^2): a new scale multiplies the matrix and the multigrid hierarchy by the
+ * ratio, and the MIC(0) factor by its inverse square root (each pivot is linear in
+ * the scale). Cells whose solid state changed since the last assembly are found by
+ * comparing with m_fluidMask; only the rows around them are assembled again and the
+ * MIC(0) factor is recomputed from there on, over a margin downstream since each
+ * pivot depends on the ones before it.
+ *
+ * @param dx cell width of the grid
+ * @param dt delta time value to step forward
+ * @param rho the global scaling factor accounting for density
+ *
+ */
+void FluidSolver::updatePressureSystem(float dx, float dt, float rho)
+{
+	const float scale = dt / (rho * dx * dx);
+	if (!(scale > 0.0f) || !(m_matrixScale > 0.0f)) {
+		constructMatrix(dx, dt, rho);
+		constructPreconditioner(rho);
+		return;
+	}
+
+	if (scale != m_matrixScale) {
+		float ratio = scale / m_matrixScale;
+		m_ADiag *= ratio;
+		m_APlusX *= ratio;
+		m_APlusY *= ratio;
+		m_APlusZ *= ratio;
+		if (m_preconditioner == MULTIGRID)
+			m_multigrid.rescale(ratio);
+		else if (m_preconditioner == FAST_POISSON)
+			m_fastPoisson.build(m_gridX, m_gridY, m_gridZ, scale);
+		else if (m_preconditioner == BLOCK_JACOBI)
+			m_blockJacobi.rescale(ratio);
+		else if (m_preconditioner == INCOMPLETE_POISSON)
+			m_invDiag *= 1.0f / ratio;
+		else
+			m_precond *= 1.0f / std::sqrt(ratio);
+		m_lowPrecisionDirty = true;
+		m_ssorDirty = true;
+		m_batchFactorDirty = true;
+		rescaleDeflationBasis(ratio);
+		m_matrixScale = scale;
+	}
+
+	// Bounding box of the cells that changed their solid state
+	int x0 = m_gridX, y0 = m_gridY, z0 = m_gridZ, x1 = -1, y1 = -1, z1 = -1;
+	for (int z=0, pos=0; z<m_gridZ; ++z) {
+		for (int y=0; y<m_gridY; ++y) {
+			for (int x=0; x<m_gridX; ++x, ++pos) {
+				if (grid->isSolid(pos) == (m_fluidMask[pos] == 0.0f))
+					continue;
+				x0 = std::min(x0, x); x1 = std::max(x1, x);
+				y0 = std::min(y0, y); y1 = std::max(y1, y);
+				z0 = std::min(z0, z); z1 = std::max(z1, z);
 			}
 		}
 	}
+	if (x1 < 0)
+		return;
+
+	// The rows of the changed cells and of their neighbors
+	x0 = std::max(x0-1, 0); x1 = std::min(x1+2, m_gridX);
+	y0 = std::max(y0-1, 0); y1 = std::min(y1+2, m_gridY);
+	z0 = std::max(z0-1, 0); z1 = std::min(z1+2, m_gridZ);
+	INFO() << "    Updating pressure matrix in [" << x0 << "," << x1 << ")x[" << y0 << "," << y1 
+		<< ")x[" << z0 << "," << z1 << ")";
+	assembleMatrixRows(x0, x1, y0, y1, z0, z1);
+	clearDeflationBasis();
+	m_compactDirty = true;
+	m_ssorDirty = true;
+	m_batchFactorDirty = true;
+
+	const int margin = 4;
+	x1 = std::min(x1+margin, m_gridX);
+	y1 = std::min(y1+margin, m_gridY);
+	z1 = std::min(z1+margin, m_gridZ);
+	if (m_preconditioner != MIC0 || 2 * (x1-x0) * (y1-y0) * (z1-z0) > m_numPoints) {
+		constructPreconditioner(rho);
+		return;
+	}
+	factorPreconditionerRows(x0, x1, y0, y1, z0, z1, rho);
 }
 
 // VARIABLE DENSITY MATRIX
@@ -828,9 +1693,11 @@ void FluidSolver::constructMatrix(float dx, float dt, float rho, bool variable_d
 
 
 /**
- * constructPreconditioner currently makes the modified incomplete cholesky preconditioner 
+ * constructPreconditioner makes the modified incomplete cholesky preconditioner 
  * for a preconditioned conjugate gradient solve of the positive semi-definite pressure 
- * matrix.
+ * matrix, the multigrid hierarchy when MULTIGRID is selected, sets up the DCT 
+ * solver for FAST_POISSON, factors the z-slabs for BLOCK_JACOBI, or inverts the
+ * diagonal for INCOMPLETE_POISSON.
  *
  * @param rho the global scaling factor accounting for density
  * @param tau precondiitoner "tuning parameter"
@@ -838,49 +1705,145 @@ void FluidSolver::constructMatrix(float dx, float dt, float rho, bool variable_d
  */
 void FluidSolver::constructPreconditioner(float rho, float tau)
 {	
+	if (m_preconditioner == MULTIGRID) {
+		INFO() << "    Building multigrid preconditioner";
+		m_multigrid.build(m_ADiag, m_APlusX, m_APlusY, m_APlusZ, m_gridX, m_gridY, m_gridZ);
+		return;
+	}
+
+	if (m_preconditioner == FAST_POISSON) {
+		m_fastPoisson.build(m_gridX, m_gridY, m_gridZ, m_matrixScale);
+		return;
+	}
+
+	if (m_preconditioner == BLOCK_JACOBI) {
+		m_blockJacobi.build(m_ADiag, m_APlusX, m_APlusY, m_APlusZ, m_gridX, m_gridY, m_gridZ,
+			m_pool->getNumberOfThreads(), m_pool);
+		return;
+	}
+
+	if (m_preconditioner == INCOMPLETE_POISSON) {
+		m_invDiag.resize(m_numPoints);
+		for (int pos=0; pos<m_numPoints; ++pos)
+			m_invDiag[pos] = m_ADiag[pos] != 0.0f? 1.0f / m_ADiag[pos]: 0.0f;
+		return;
+	}
+
 	INFO() << "    Computing modified incomplete cholesky preconditioner";
-	
-	float termLeft = 0.0f;
-	float termAbove = 0.0f;
-	float termRight = 0.0f;
-	float termLeft2 = 0.0f;
-	float termAbove2 = 0.0f;
-	float termRight2 = 0.0f;
+	factorPreconditionerRows(0, m_gridX, 0, m_gridY, 0, m_gridZ, rho, tau);
+}
 
-	for (int z=0, pos=0; z<m_gridZ; ++z) {
-		for (int y=0; y<m_gridY; ++y) {
-			for (int x=0; x<m_gridX; ++x, ++pos) {
-				if (grid->isSolid(pos))
-					continue;
-					
-				termLeft = termAbove = termRight = termLeft2 = termAbove2 = termRight2 = 0.0f;
-				
-				if (x > 0 && !grid->isSolid(pos-1)) {
-					termLeft  = m_APlusX[pos-1] * m_precond[pos-1];
-					termLeft2 = m_APlusX[pos-1] * (m_APlusY[pos-1] + m_APlusZ[pos-1]) * m_precond[pos-1] * m_precond[pos-1];
-				}
 
-				if (y > 0 && !grid->isSolid(pos-m_gridX)) {
-					termAbove  = m_APlusY[pos-m_gridX] * m_precond[pos-m_gridX];
-					termAbove2 = m_APlusY[pos-m_gridX] * (m_APlusX[pos-m_gridX] + m_APlusZ[pos-m_gridX]) * m_precond[pos-m_gridX] * m_precond[pos-m_gridX];
-				}
+/**
+ * Computes the MIC(0) pivots of the cells of a box in lexicographic order. Pivots
+ * before the box are read from m_precond as they are. The pivot of a cell only
+ * depends on its -x, -y and -z neighbors, so the x-rows of a diagonal y+z = d of the
+ * box are factored in parallel once diagonal d-1 is done, as in triangularSolve.
+ *
+ * @param x0 first x
+ * @param x1 one past the last x
+ * @param y0 first y
+ * @param y1 one past the last y
+ * @param z0 first z
+ * @param z1 one past the last z
+ * @param rho the global scaling factor accounting for density
+ * @param tau precondiitoner "tuning parameter"
+ *
+ */
+void FluidSolver::factorPreconditionerRows(int x0, int x1, int y0, int y1, int z0, int z1, float rho, float tau)
+{
+	m_lowPrecisionDirty = true;
 
-				if (z > 0 && !grid->isSolid(pos-m_slice)) {
-					termRight  = m_APlusZ[pos-m_slice] * m_precond[pos-m_slice];
-					termRight2 = m_APlusZ[pos-m_slice] * (m_APlusX[pos-m_slice] + m_APlusY[pos-m_slice]) * m_precond[pos-m_slice] * m_precond[pos-m_slice];
-				}
-				
-				termRight = termRight*termRight;
-				termAbove = termAbove*termAbove;
-				termLeft = termLeft*termLeft;
+	int grain = std::max(1, 2048 / std::max(x1 - x0, 1));
+	for (int d=y0+z0; d<=(y1-1)+(z1-1); ++d) {
+		int first = std::max(y0, d - (z1-1));
+		int last = std::min(y1-1, d - z0);
+		m_pool->parallelFor(first, last+1, boost::bind(&FluidSolver::factorDiagonalRows, this, x0, x1, d, rho, tau, _1, _2), grain);
+	}
+}
 
-				float e = m_ADiag[pos] - termLeft - termAbove - termRight - tau * (termLeft2 + termAbove2 + termRight2);
-				if (e < rho * m_ADiag[pos]){
-					e = m_ADiag[pos];
-				}
-				
-				m_precond[pos] = 1.0f / std::sqrt(e);
+
+/**
+ * Computes the MIC(0) pivots of [x0, x1) on the rows (y, d-y) of one diagonal. The
+ * couplings to solid cells are zero, so only the neighbors inside the grid are
+ * checked; cells with a zero diagonal (solids, or fluid cells without fluid
+ * neighbors) get a zero pivot.
+ *
+ * @param x0 first x
+ * @param x1 one past the last x
+ * @param d the diagonal index y+z
+ * @param rho the global scaling factor accounting for density
+ * @param tau precondiitoner "tuning parameter"
+ * @param yBegin first row
+ * @param yEnd one past the last row
+ *
+ */
+void FluidSolver::factorDiagonalRows(int x0, int x1, int d, float rho, float tau, int yBegin, int yEnd)
+{
+	// Each pivot waits for the one before it in x, so a few independent rows of the
+	// diagonal are factored side by side to overlap their latencies.
+	const int group = 8;
+	for (int y=yBegin; y<yEnd; y+=group)
+		factorRowGroup(x0, x1, d, rho, tau, y, std::min(group, yEnd - y));
+}
+
+
+/**
+ * Computes the MIC(0) pivots of [x0, x1) for count rows (y, d-y) of one diagonal,
+ * cell x of every row before cell x+1.
+ *
+ * @param x0 first x
+ * @param x1 one past the last x
+ * @param d the diagonal index y+z
+ * @param rho the global scaling factor accounting for density
+ * @param tau precondiitoner "tuning parameter"
+ * @param y the first row
+ * @param count the number of rows, at most 8
+ *
+ */
+void FluidSolver::factorRowGroup(int x0, int x1, int d, float rho, float tau, int y, int count)
+{
+	const float* diag = &m_ADiag[0];
+	const float* plusX = &m_APlusX[0];
+	const float* plusY = &m_APlusY[0];
+	const float* plusZ = &m_APlusZ[0];
+	float* precond = &m_precond[0];
+
+	int start[8];
+	bool hasY[8], hasZ[8];
+	for (int r=0; r<count; ++r) {
+		start[r] = (y + r) * m_gridX + (d - y - r) * m_slice;
+		hasY[r] = y + r > 0;
+		hasZ[r] = d - y - r > 0;
+	}
+
+	for (int x=x0; x<x1; ++x) {
+		for (int r=0; r<count; ++r) {
+			int pos = start[r] + x;
+			if (diag[pos] == 0.0f) {
+				precond[pos] = 0.0f;
+				continue;
 			}
+
+			float e = diag[pos];
+			if (x > 0) {
+				float p = plusX[pos-1] * precond[pos-1];
+				e -= p * p + tau * plusX[pos-1] * (plusY[pos-1] + plusZ[pos-1]) * precond[pos-1] * precond[pos-1];
+			}
+			if (hasY[r]) {
+				int n = pos - m_gridX;
+				float p = plusY[n] * precond[n];
+				e -= p * p + tau * plusY[n] * (plusX[n] + plusZ[n]) * precond[n] * precond[n];
+			}
+			if (hasZ[r]) {
+				int n = pos - m_slice;
+				float p = plusZ[n] * precond[n];
+				e -= p * p + tau * plusZ[n] * (plusX[n] + plusY[n]) * precond[n] * precond[n];
+			}
+			if (e < rho * diag[pos])
+				e = diag[pos];
+
+			precond[pos] = 1.0f / std::sqrt(e);
 		}
 	}
 }
@@ -901,13 +1864,12 @@ float FluidSolver::cgSolve(const Vector& b, Vector& x)
 	float beta = 0;
 	float lastRho = 0;
 	float rho = 0;
-	float tolerance = tol_cg * tol_cg; // rho is a "norm squared" measurement.
 
 	axpy_prod(x, m_tempR);
 	m_tempR = b - m_tempR;
 	rho = inner_prod(m_tempR, m_tempR);
 
-	while (k < maxiter_cg && rho > tolerance) {
+	while (m_monitor.proceed(rho, k)) {
 		if (k == 0) {
 			noalias(m_tempP) = m_tempR;
 		} else {
@@ -939,6 +1901,22 @@ float FluidSolver::cgSolve(const Vector& b, Vector& x)
  * @return float value representing the residual after the iterative solve
  */
 float FluidSolver::pcgSolve(const Vector& b, Vector& x)
+{
+	return preconditionedCG(b, x, &FluidSolver::solvePreconditioner, "PCG");
+}
+
+
+/**
+ * The preconditioned conjugate gradient iteration shared by pcgSolve and ssorPcgSolve.
+ *
+ * @param b the vector representing the negative divergence
+ * @param x the resulting pressure gradient after the linear solve
+ * @param precond the preconditioner, x = M^-1 b
+ * @param name the solver name for the log
+ *
+ * @return float value representing the residual after the iterative solve
+ */
+float FluidSolver::preconditionedCG(const Vector& b, Vector& x, PrecondMethod precond, const char* name)
 {
 	float M = inner_prod(x, b);
 	if(M!=M){
@@ -950,18 +1928,17 @@ float FluidSolver::pcgSolve(const Vector& b, Vector& x)
 	float beta = 0;
 	float lastRho = 0;
 	float rho = 0;
-	float tolerance = tol_cg * tol_cg; // rho is a "norm squared" measurement.
 
 	axpy_prod(x, m_tempR);
 	m_tempR = b - m_tempR;
-	solvePreconditioner(m_tempR, m_tempZ);
+	(this->*precond)(m_tempR, m_tempZ);
 	rho = inner_prod(m_tempR, m_tempZ);
 	if(rho!=rho){
 		std::cerr << "rho is nan!" << std::endl;
 		exit(1);
 	}
 
-	while (k < maxiter_cg && rho > tolerance) {
+	while (m_monitor.proceed(rho, k)) {
 		if (k == 0) {
 			noalias(m_tempP) = m_tempZ;
 		} else {
@@ -975,123 +1952,2010 @@ float FluidSolver::pcgSolve(const Vector& b, Vector& x)
 		noalias(x) += alpha * m_tempP;
 		noalias(m_tempR) -= alpha * m_tempW;
 
-		solvePreconditioner(m_tempR, m_tempZ);
+		(this->*precond)(m_tempR, m_tempZ);
 		lastRho = rho;
 		rho = inner_prod(m_tempR, m_tempZ);
 		k++;
 	}
 
-	INFO() << "  + PCG: Residual after " << k << " iterations : " << std::sqrt(rho);
+	INFO() << "  + " << name << ": Residual after " << k << " iterations : " << std::sqrt(rho);
 
 	return std::sqrt(rho);
 }
 
 
 /**
- * axpy_prod computes y = Ax. This function provides an alternative to the BLAS function 
- * axpy_prod which uses the sparse matrix A represented by vectors only. <br/>
- * See <a href="http://www.boost.org/doc/libs/1_41_0/libs/numeric/ublas/doc/products.htm">the uBlas axpy_prod method</a> for more info.
+ * chebyshevJacobiSolve runs the Chebyshev semi-iteration on the Jacobi preconditioned
+ * system. It needs bounds on the spectrum of D^-1 A instead of inner products: the 
+ * upper bound is 2 (Gershgorin) and the lower one is the smallest nonzero eigenvalue
+ * of the box without solids. Solids can push the smallest eigenvalue below that
+ * bound; the error along those eigenvectors then still decreases, only more slowly
+ * than the Chebyshev rate. The iteration has no global reductions apart from the
+ * stopping test.
  *
- * @param x vector to be multiplied by A
- * @param y result of Ax
+ * See: Y. Saad. Iterative methods for sparse linear systems, 2nd edition. SIAM, 2003.
+ * Algorithm 12.1.
+ *
+ * @param b the vector representing the negative divergence
+ * @param x the resulting pressure gradient after the linear solve
  *
+ * @return float value representing the residual after the iterative solve
  */
-void FluidSolver::axpy_prod(const Vector& x, Vector& y) const
+float FluidSolver::chebyshevJacobiSolve(const Vector& b, Vector& x)
 {
-	for (int i=0; i<m_slice; ++i) {
-		float result = m_ADiag[i] * x[i]
-					+ m_APlusX[i] * x[i+1]
-					+ m_APlusY[i] * x[i+m_gridX]
-					+ m_APlusZ[i] * x[i+m_slice];
-		if (i-1 >= 0){
-			result += m_APlusX[i-1] * x[i-1];
-		}
-		if (i-m_gridX >= 0){
-			result += m_APlusY[i-m_gridX] * x[i-m_gridX];
-		}
-		if (i-m_slice >= 0){
-			result += m_APlusZ[i-m_slice] * x[i-m_slice];
-		}
+	int n = std::max(m_gridX, std::max(m_gridY, m_gridZ));
+	double lambdaMax = 2.0;
+	// Exact for the box without solids only, see above
+	double lambdaMin = (1.0 - std::cos(PI / n)) / 3.0;
+	double theta = 0.5 * (lambdaMax + lambdaMin);
+	double delta = 0.5 * (lambdaMax - lambdaMin);
+	double sigma = theta / delta;
+	double rhoCheb = 1.0 / sigma;
+
+	// The residual of the Chebyshev iteration is not monotone
+	m_monitor.ignoreStagnation();
+
+	axpy_prod(x, m_tempR);
+	m_tempR = b - m_tempR;
+	m_pool->parallelFor(0, m_gridZ, boost::bind(&FluidSolver::jacobiSlices, this, &m_tempR[0], &m_tempZ[0], _1, _2));
+	noalias(m_tempP) = (float) (1.0 / theta) * m_tempZ;
+	double rho = innerProduct(m_tempR, m_tempZ);
+
+	int k = 0;
+	while (m_monitor.proceed(rho, k)) {
+		noalias(x) += m_tempP;
+		axpy_prod(m_tempP, m_tempW);
+		noalias(m_tempR) -= m_tempW;
+		m_pool->parallelFor(0, m_gridZ, boost::bind(&FluidSolver::jacobiSlices, this, &m_tempR[0], &m_tempZ[0], _1, _2));
 
-		y[i] = result;
+		double nextRho = 1.0 / (2.0 * sigma - rhoCheb);
+		m_tempP = (float) (nextRho * rhoCheb) * m_tempP + (float) (2.0 * nextRho / delta) * m_tempZ;
+		rhoCheb = nextRho;
+
+		rho = innerProduct(m_tempR, m_tempZ);
+		k++;
 	}
-	
-	for (int i=m_numPoints-m_slice; i<m_numPoints; ++i) {
-		float result = m_ADiag[i] * x[i]
-					+ m_APlusX[i-1] * x[i-1]
-					+ m_APlusY[i-m_gridX] * x[i-m_gridX]
-					+ m_APlusZ[i-m_slice] * x[i-m_slice];
-
-		if (i+1 < m_numPoints){
-			result += m_APlusX[i] * x[i+1];
-		}
-		if (i+m_gridX < m_numPoints){
-			result += m_APlusY[i] * x[i+m_gridX];
-		}
-		if (i+m_slice < m_numPoints){
-			result += m_APlusZ[i] * x[i+m_slice];
-		}
 
-		y[i] = result;
+	INFO() << "  + Chebyshev-Jacobi: Residual after " << k << " iterations : " << std::sqrt(rho);
+	return (float) std::sqrt(rho);
+}
+
+
+/**
+ * sorSolve performs red-black successive over-relaxation with the optimal factor of 
+ * the box (see sorFactor). Each color is relaxed in parallel since its cells only 
+ * depend on the other color. The residual is checked every few sweeps.
+ *
+ * @param b the vector representing the negative divergence
+ * @param x the resulting pressure gradient after the linear solve
+ *
+ * @return float value representing the residual after the iterative solve
+ */
+float FluidSolver::sorSolve(const Vector& b, Vector& x)
+{
+	const int checkEvery = 8;
+	float omega = sorFactor();
+
+	unsigned k = 0;
+	double rho = 0.0;
+	while (true) {
+		axpy_prod(x, m_tempR);
+		m_tempR = b - m_tempR;
+		m_pool->parallelFor(0, m_gridZ, boost::bind(&FluidSolver::jacobiSlices, this, &m_tempR[0], &m_tempZ[0], _1, _2));
+		rho = innerProduct(m_tempR, m_tempZ);
+		if (!m_monitor.proceed(rho, k))
+			break;
+
+		for (int i=0; i<checkEvery && k<maxiter_cg; ++i, ++k) {
+			relax(b, x, 0, omega);
+			relax(b, x, 1, omega);
+		}
 	}
-	
-	for (int i=m_slice; i<m_numPoints-m_slice; ++i) {
-		y[i] = m_ADiag[i] * x[i]
-			+ m_APlusX[i] * x[i+1]
-			+ m_APlusY[i] * x[i+m_gridX]
-			+ m_APlusZ[i] * x[i+m_slice]
-			+ m_APlusX[i-1] * x[i-1]
-			+ m_APlusY[i-m_gridX] * x[i-m_gridX]
-			+ m_APlusZ[i-m_slice] * x[i-m_slice];
+
+	INFO() << "  + Red-black SOR (omega " << omega << "): Residual after " << k << " sweeps : " << std::sqrt(rho);
+	return (float) std::sqrt(rho);
+}
+
+
+/**
+ * ssorPcgSolve is PCG with the symmetric SOR preconditioner 
+ * \f$M = (D/\omega + L) (D/\omega)^{-1} (D/\omega + U)\f$, which is the incomplete 
+ * factorization with E = D/omega and needs no factorization, only the diagonal. It 
+ * is applied with the same wavefront as MIC(0), with the SOR factor of the box. The
+ * pivots are kept until the matrix changes.
+ *
+ * @param b the vector representing the negative divergence
+ * @param x the resulting pressure gradient after the linear solve
+ *
+ * @return float value representing the residual after the iterative solve
+ */
+float FluidSolver::ssorPcgSolve(const Vector& b, Vector& x)
+{
+	if (m_ssorDirty) {
+		float omega = sorFactor();
+		m_ssorPivots.resize(m_numPoints);
+		for (int pos=0; pos<m_numPoints; ++pos)
+			m_ssorPivots[pos] = m_ADiag[pos] > 0.0f? std::sqrt(omega / m_ADiag[pos]): 0.0f;
+		m_ssorDirty = false;
 	}
+
+	return preconditionedCG(b, x, &FluidSolver::applySSOR, "SSOR-PCG");
 }
 
 
 /**
- * solvePreconditioner 
+ * Applies the SSOR preconditioner set up by ssorPcgSolve.
  *
- * @param b
- * @param x
+ * @param b the vector to precondition
+ * @param x the result
  *
  */
-void FluidSolver::solvePreconditioner(const Vector& b, Vector& x)
+void FluidSolver::applySSOR(const Vector& b, Vector& x)
 {
-	// Solve lower triangular system
-	for (int i=0; i<m_numPoints; ++i) {
-		if (grid->isSolid(i))
-			continue;
-			
-		float temp = b[i];
-		if (i > 0) {
-			temp -= m_APlusX[i-1] * m_precond[i-1] * m_tempQ[i-1];
-		}
-		if (i > m_gridX) {
-			temp -= m_APlusY[i-m_gridX] * m_precond[i-m_gridX] * m_tempQ[i-m_gridX];
-		}
-		if (i > m_slice) {
-			temp -= m_APlusZ[i-m_slice] * m_precond[i-m_slice] * m_tempQ[i-m_slice];
+	triangularSolve(b, x, &m_ssorPivots[0]);
+	removeNullSpace(x);
+}
+
+
+/**
+ * The optimal over-relaxation factor of the Laplacian on the box,
+ * \f$2 / (1 + \sin(\pi / n))\f$ for the largest dimension n.
+ *
+ */
+float FluidSolver::sorFactor() const
+{
+	int n = std::max(m_gridX, std::max(m_gridY, m_gridZ));
+	return (float) (2.0 / (1.0 + std::sin(PI / n)));
+}
+
+
+/**
+ * Relaxes the cells of one color, (x+y+z)%2 == color, in parallel over the slices.
+ *
+ * @param b the right hand side
+ * @param x the solution, updated in place
+ * @param color 0 for red, 1 for black
+ * @param omega the relaxation factor
+ *
+ */
+void FluidSolver::relax(const Vector& b, Vector& x, int color, float omega)
+{
+	m_pool->parallelFor(0, m_gridZ, boost::bind(&FluidSolver::relaxSlices, this, &b[0], &x[0], color, omega, _1, _2));
+}
+
+
+/**
+ * Over-relaxes the cells of one color in the slices [zBegin, zEnd),
+ * \f$x_i \leftarrow (1-\omega) x_i + \omega (b_i - \sum_{j \neq i} A_{ij} x_j) / A_{ii}\f$.
+ *
+ * @param b the right hand side
+ * @param x the solution
+ * @param color 0 for red, 1 for black
+ * @param omega the relaxation factor
+ * @param zBegin first slice
+ * @param zEnd one past the last slice
+ *
+ */
+void FluidSolver::relaxSlices(const float* b, float* x, int color, float omega, int zBegin, int zEnd)
+{
+	const float* mask = &m_fluidMask[0];
+	const float* diag = &m_ADiag[0];
+	for (int z=zBegin; z<zEnd; ++z) {
+		for (int y=0; y<m_gridY; ++y) {
+			int first = (y + z + color) & 1;
+			int pos = first + y * m_gridX + z * m_slice;
+			for (int i=first; i<m_gridX; i+=2, pos+=2) {
+				if (diag[pos] == 0.0f)
+					continue;
+				float sum = 0.0f;
+				if (i > 0) sum += mask[pos-1] * x[pos-1];
+				if (i+1 < m_gridX) sum += mask[pos+1] * x[pos+1];
+				if (y > 0) sum += mask[pos-m_gridX] * x[pos-m_gridX];
+				if (y+1 < m_gridY) sum += mask[pos+m_gridX] * x[pos+m_gridX];
+				if (z > 0) sum += mask[pos-m_slice] * x[pos-m_slice];
+				if (z+1 < m_gridZ) sum += mask[pos+m_slice] * x[pos+m_slice];
+				float gs = (b[pos] + m_matrixScale * sum) / diag[pos];
+				x[pos] += omega * (gs - x[pos]);
+			}
 		}
-		
-		m_tempQ[i] = temp * m_precond[i];
 	}
+}
 
-	// Solve upper triangular system
-	for (int i=m_numPoints-1; i>=0; --i) {
-		if (grid->isSolid(i))
-			continue;
-			
-		float temp = m_tempQ[i];
-		if (i+1 < m_numPoints) {
-			temp -= m_APlusX[i] * m_precond[i] * x[i+1];
-		}
-		if (i+m_gridX < m_numPoints) {
-			temp -= m_APlusY[i] * m_precond[i] * x[i+m_gridX];
-		}
-		if (i+m_slice < m_numPoints) {
-			temp -= m_APlusZ[i] * m_precond[i] * x[i+m_slice];
-		}
-		
-		x[i] = temp * m_precond[i];
+
+/**
+ * Jacobi preconditioner for the slices [zBegin, zEnd), z = D^-1 r (0 where the
+ * diagonal is).
+ *
+ * @param r the residual
+ * @param z the result
+ * @param zBegin first slice
+ * @param zEnd one past the last slice
+ *
+ */
+void FluidSolver::jacobiSlices(const float* r, float* z, int zBegin, int zEnd) const
+{
+	const float* diag = &m_ADiag[0];
+	for (int i=zBegin*m_slice; i<zEnd*m_slice; ++i)
+		z[i] = diag[i] != 0.0f? r[i] / diag[i]: 0.0f;
+}
+
+
+/**
+ * fastPoissonSolve solves the pressure matrix of a box without solid cells directly 
+ * with the DCT (see FastPoisson). The residual is measured with the selected
+ * preconditioner, as PCG does, and given to the monitor as a single iteration.
+ *
+ * @param b the vector representing the negative divergence
+ * @param x the resulting pressure gradient after the linear solve
+ * @return the residual, \f$\sqrt{r^T M^{-1} r}\f$
+ *
+ */
+float FluidSolver::fastPoissonSolve(const Vector& b, Vector& x)
+{
+	m_fastPoisson.build(m_gridX, m_gridY, m_gridZ, m_matrixScale);
+	m_fastPoisson.solve(b, x, m_pool);
+
+	axpy_prod(x, m_tempR);
+	m_tempR = b - m_tempR;
+	solvePreconditioner(m_tempR, m_tempZ);
+	double rho = innerProduct(m_tempR, m_tempZ);
+	m_monitor.proceed(rho, 1);
+
+	INFO() << "  + Fast Poisson: Residual : " << std::sqrt(rho);
+
+	return (float) std::sqrt(rho);
+}
+
+
+/**
+ * The residual the solve of A x = b stops at. With a relative tolerance it is the 
+ * larger of tol_cg and that fraction of the divergence, measured as 
+ * \f$\sqrt{b^T D^{-1} b}\f$ with D the diagonal of A. This is close to the 
+ * \f$\sqrt{r^T M^{-1} r}\f$ the solvers test and scales with dt the same way, so
+ * the solve stops once most of the divergence of the step is gone instead of at
+ * the same residual whatever the step.
+ *
+ * @param b the right hand side
+ * @return the tolerance on the residual
+ *
+ */
+float FluidSolver::solverTolerance(const Vector& b)
+{
+	if (m_relativeTolerance <= 0.0f)
+		return tol_cg;
+
+	m_pool->parallelFor(0, m_gridZ, boost::bind(&FluidSolver::jacobiSlices, this, &b[0], &m_tempZ[0], _1, _2));
+	float divergence = (float) std::sqrt(innerProduct(b, m_tempZ));
+	return std::max(tol_cg, m_relativeTolerance * divergence);
+}
+
+
+/**
+ * compactPcgSolve is MIC(0) PCG on the fluid cells only (see CompactPoisson), the
+ * index being rebuilt when the solid cells have changed since the last solve.
+ *
+ * @param b the right hand side
+ * @param x the initial guess and the solution
+ * @return the residual sqrt(r^T M^-1 r)
+ *
+ */
+float FluidSolver::compactPcgSolve(const Vector& b, Vector& x)
+{
+	if (m_compactDirty) {
+		m_compactPoisson.build(m_fluidMask, m_gridX, m_gridY, m_gridZ);
+		m_compactDirty = false;
+	}
+
+	float residual = m_compactPoisson.solve(b, x, m_matrixScale, m_monitor, m_pool);
+	INFO() << "  + Compact PCG (" << m_compactPoisson.getNumberOfUnknowns() << " unknowns): Residual after "
+		<< m_monitor.getIterations() << " iterations : " << residual;
+
+	return residual;
+}
+
+
+/**
+ * solvePressure solves A x = b with the selected linear solver, monitored against 
+ * solverTolerance(b). Unless a solver was chosen, a box without solids, whose matrix
+ * is the Neumann Laplacian, is solved directly and any other domain by PCG. The
+ * pressure system must be up to date (see updatePressureSystem).
+ *
+ * @param b the right hand side, zero mean over the fluid cells when no cell is open
+ * @param x the initial guess and the solution
+ * @return the residual the solver reports
+ *
+ */
+float FluidSolver::solvePressure(const Vector& b, Vector& x)
+{
+	solver_T type = m_solver;
+	if (type == AUTO)
+		type = (m_fluidCells == m_numPoints)? DCT_POISSON: PCG;
+	if (type == DCT_POISSON && m_fluidCells != m_numPoints) {
+		LOG(fdl::Logger::WARN) << "  + FastPoisson needs a domain without solids, using PCG";
+		type = PCG;
+	}
+	const SolverEntry* entry = s_solvers;
+	while (entry->name && entry->type != type)
+		++entry;
+	SolveMethod solve = entry->name? entry->solve: &FluidSolver::pcgSolve;
+	m_monitor.begin(entry->name? entry->name: "PCG", solverTolerance(b), maxiter_cg);
+	float residual = (this->*solve)(b, x);
+	m_monitor.end();
+
+	return residual;
+}
+
+
+/**
+ * batchPcgSolve solves A x_j = b_j for k right hand sides at once with MIC(0) PCG,
+ * for ensembles of scenes that share the grid and the solids and so the pressure
+ * matrix, which is brought up to date for dt first as project does. The vectors are
+ * interleaved, entry j of cell pos at pos*k+j, so that every coefficient of the
+ * matrix and of the factorization is loaded once per sweep for all k systems, and
+ * the wavefront of the triangular solves synchronises once per diagonal for all of
+ * them. Each system has its own alpha and beta and its own tolerance (see
+ * solverTolerance), and stops moving when it has converged. The monitor is given the
+ * largest ratio of a residual to its tolerance, so the loop ends when all systems
+ * have converged. If another preconditioner is selected, the MIC(0) pivots are 
+ * factored here, and again only once the matrix has changed.
+ *
+ * @param b the right hand sides, zero mean over the fluid cells when no cell is open
+ * @param x the initial guesses and the solutions
+ * @param dt delta time value of the step the systems belong to
+ * @return the largest residual, \f$\sqrt{r^T M^{-1} r}\f$
+ *
+ */
+float FluidSolver::batchPcgSolve(const std::vector<Vector>& b, std::vector<Vector>& x, float dt)
+{
+	int k = (int) b.size();
+	if (k == 0)
+		return 0.0f;
+	updatePressureSystem(m_dx, dt, 0.25f);
+	if (m_preconditioner != MIC0 && m_batchFactorDirty) {
+		factorPreconditionerRows(0, m_gridX, 0, m_gridY, 0, m_gridZ);
+		m_batchFactorDirty = false;
+	}
+
+	// rho is a "norm squared" measurement
+	std::vector<double> tolerance(k);
+	for (int j=0; j<k; ++j) {
+		double t = solverTolerance(b[j]);
+		tolerance[j] = std::max(t * t, (double) FLT_MIN);
+	}
+
+	size_t size = (size_t) m_numPoints * k;
+	m_batchX.resize(size);
+	m_batchR.resize(size);
+	m_batchZ.resize(size);
+	m_batchP.resize(size);
+	m_batchW.resize(size);
+	m_batchQ.resize(size);
+	for (int pos=0; pos<m_numPoints; ++pos) {
+		for (int j=0; j<k; ++j) {
+			m_batchX[pos*k+j] = x[j][pos];
+			m_batchZ[pos*k+j] = b[j][pos];
+		}
+	}
+
+	int rows = m_gridY * m_gridZ;
+	int grain = std::max(1, 4096 / (m_gridX * k));
+	m_pool->parallelFor(0, rows, boost::bind(&FluidSolver::batchLaplacianRows, this, &m_batchX[0], &m_batchW[0], k, _1, _2), grain);
+	for (size_t i=0; i<size; ++i)
+		m_batchR[i] = m_batchZ[i] - m_batchW[i];
+
+	batchPrecondition(k);
+	std::vector<double> rho(k), lastRho(k), denom(k);
+	std::vector<float> alpha(k), beta(k);
+	batchDots(&m_batchR[0], &m_batchZ[0], k, rho);
+
+	m_monitor.begin("Batched PCG", 1.0f, maxiter_cg);
+	unsigned iter = 0;
+	while (true) {
+		double worst = 0.0;
+		for (int j=0; j<k; ++j)
+			worst = std::max(worst, rho[j] / tolerance[j]);
+		if (!m_monitor.proceed(worst, iter))
+			break;
+
+		// p = z + beta p, with beta = 0 on the first iteration
+		for (int j=0; j<k; ++j)
+			beta[j] = iter == 0? 0.0f: (float) (rho[j] / lastRho[j]);
+		m_pool->parallelFor(0, m_gridZ, boost::bind(&FluidSolver::batchDirectionSlices, this, &beta[0], k, _1, _2));
+
+		// The converged systems keep x and r as they are
+		m_pool->parallelFor(0, rows, boost::bind(&FluidSolver::batchLaplacianRows, this, &m_batchP[0], &m_batchW[0], k, _1, _2), grain);
+		batchDots(&m_batchP[0], &m_batchW[0], k, denom);
+		for (int j=0; j<k; ++j)
+			alpha[j] = rho[j] > tolerance[j] && denom[j] > 0.0? (float) (rho[j] / denom[j]): 0.0f;
+		m_pool->parallelFor(0, m_gridZ, boost::bind(&FluidSolver::batchUpdateSlices, this, &alpha[0], k, _1, _2));
+
+		batchPrecondition(k);
+		lastRho = rho;
+		batchDots(&m_batchR[0], &m_batchZ[0], k, rho);
+		for (int j=0; j<k; ++j) {
+			if (alpha[j] == 0.0f)
+				rho[j] = lastRho[j];
+		}
+		iter++;
+	}
+
+	m_monitor.end();
+
+	double worst = 0.0;
+	int unconverged = 0;
+	for (int j=0; j<k; ++j) {
+		worst = std::max(worst, rho[j]);
+		unconverged += rho[j] > tolerance[j]? 1: 0;
+	}
+	for (int pos=0; pos<m_numPoints; ++pos) {
+		for (int j=0; j<k; ++j)
+			x[j][pos] = m_batchX[pos*k+j];
+	}
+
+	INFO() << "  + Batched PCG (" << k << " systems, " << unconverged << " not converged): Largest residual after "
+		<< iter << " iterations : " << std::sqrt(worst);
+
+	return (float) std::sqrt(worst);
+}
+
+
+/**
+ * k interleaved products y = Ax for the x-rows [rowBegin, rowEnd), reading each
+ * coefficient of A once for the k systems.
+ *
+ * @param x the interleaved vectors to multiply
+ * @param y the interleaved results
+ * @param k the number of systems
+ * @param rowBegin first row (y + z*gridY)
+ * @param rowEnd one past the last row
+ *
+ */
+void FluidSolver::batchLaplacianRows(const float* x, float* y, int k, int rowBegin, int rowEnd) const
+{
+	const float* diag = &m_ADiag[0];
+	const float* plusX = &m_APlusX[0];
+	const float* plusY = &m_APlusY[0];
+	const float* plusZ = &m_APlusZ[0];
+	const size_t sx = k, sy = (size_t) m_gridX * k, sz = (size_t) m_slice * k;
+
+	for (int row=rowBegin; row<rowEnd; ++row) {
+		int yy = row % m_gridY;
+		int zz = row / m_gridY;
+		int pos = row * m_gridX;
+		for (int i=0; i<m_gridX; ++i, ++pos) {
+			// Missing neighbors get a zero coupling and point at the cell itself, so
+			// that the loop over the systems has no branches
+			const float* xc = x + (size_t) pos * k;
+			float c0 = i > 0? plusX[pos-1]: 0.0f;
+			float c1 = i+1 < m_gridX? plusX[pos]: 0.0f;
+			float c2 = yy > 0? plusY[pos-m_gridX]: 0.0f;
+			float c3 = yy+1 < m_gridY? plusY[pos]: 0.0f;
+			float c4 = zz > 0? plusZ[pos-m_slice]: 0.0f;
+			float c5 = zz+1 < m_gridZ? plusZ[pos]: 0.0f;
+			const float* x0 = i > 0? xc - sx: xc;
+			const float* x1 = i+1 < m_gridX? xc + sx: xc;
+			const float* x2 = yy > 0? xc - sy: xc;
+			const float* x3 = yy+1 < m_gridY? xc + sy: xc;
+			const float* x4 = zz > 0? xc - sz: xc;
+			const float* x5 = zz+1 < m_gridZ? xc + sz: xc;
+			float a = diag[pos];
+			float* out = y + (size_t) pos * k;
+			for (int j=0; j<k; ++j)
+				out[j] = a * xc[j] + c0 * x0[j] + c1 * x1[j] + c2 * x2[j] + c3 * x3[j] + c4 * x4[j] + c5 * x5[j];
+		}
+	}
+}
+
+
+/**
+ * m_batchZ = M^-1 m_batchR for the k systems, with the wavefront of triangularSolve,
+ * and the mean of each system over the fluid cells removed as in removeNullSpace.
+ *
+ * @param k the number of systems
+ *
+ */
+void FluidSolver::batchPrecondition(int k)
+{
+	int diagonals = m_gridY + m_gridZ - 1;
+	int grain = std::max(1, 2048 / (m_gridX * k));
+
+	for (int d=0; d<diagonals; ++d) {
+		int first = std::max(0, d - (m_gridZ-1));
+		int last = std::min(m_gridY-1, d);
+		m_pool->parallelFor(first, last+1, boost::bind(&FluidSolver::batchLowerSweepRows, this, k, d, _1, _2), grain);
+	}
+	for (int d=diagonals-1; d>=0; --d) {
+		int first = std::max(0, d - (m_gridZ-1));
+		int last = std::min(m_gridY-1, d);
+		m_pool->parallelFor(first, last+1, boost::bind(&FluidSolver::batchUpperSweepRows, this, k, d, _1, _2), grain);
+	}
+
+	if (m_fluidCells == 0)
+		return;
+	std::vector<double> means(k);
+	batchDots(&m_batchZ[0], NULL, k, means);
+	for (int j=0; j<k; ++j)
+		means[j] /= m_fluidCells;
+
+	const float* mask = &m_fluidMask[0];
+	float* z = &m_batchZ[0];
+	for (int pos=0; pos<m_numPoints; ++pos) {
+		if (mask[pos] == 0.0f)
+			continue;
+		for (int j=0; j<k; ++j)
+			z[pos*k+j] -= (float) means[j];
+	}
+}
+
+
+/**
+ * Forward substitution of batchPrecondition for the rows (y, d-y) of one diagonal,
+ * from m_batchR to m_batchQ.
+ *
+ * @param k the number of systems
+ * @param d the diagonal index y+z
+ * @param yBegin first row
+ * @param yEnd one past the last row
+ *
+ */
+void FluidSolver::batchLowerSweepRows(int k, int d, int yBegin, int yEnd)
+{
+	const float* plusX = &m_APlusX[0];
+	const float* plusY = &m_APlusY[0];
+	const float* plusZ = &m_APlusZ[0];
+	const float* precond = &m_precond[0];
+	const float* mask = &m_fluidMask[0];
+	const float* b = &m_batchR[0];
+	float* q = &m_batchQ[0];
+	const size_t sx = k, sy = (size_t) m_gridX * k, sz = (size_t) m_slice * k;
+
+	for (int y=yBegin; y<yEnd; ++y) {
+		int z = d - y;
+		int pos = y * m_gridX + z * m_slice;
+		for (int i=0; i<m_gridX; ++i, ++pos) {
+			float* out = q + (size_t) pos * k;
+			if (mask[pos] == 0.0f) {
+				std::fill(out, out + k, 0.0f);
+				continue;
+			}
+
+			// As in batchLaplacianRows, missing neighbors read the (zero) output itself
+			const float* in = b + (size_t) pos * k;
+			float c0 = i > 0? plusX[pos-1] * precond[pos-1]: 0.0f;
+			float c1 = y > 0? plusY[pos-m_gridX] * precond[pos-m_gridX]: 0.0f;
+			float c2 = z > 0? plusZ[pos-m_slice] * precond[pos-m_slice]: 0.0f;
+			const float* q0 = i > 0? out - sx: out;
+			const float* q1 = y > 0? out - sy: out;
+			const float* q2 = z > 0? out - sz: out;
+			float p = precond[pos];
+			std::fill(out, out + k, 0.0f);
+			for (int j=0; j<k; ++j)
+				out[j] = (in[j] - c0 * q0[j] - c1 * q1[j] - c2 * q2[j]) * p;
+		}
+	}
+}
+
+
+/**
+ * Backward substitution of batchPrecondition for the rows (y, d-y) of one diagonal,
+ * from m_batchQ to m_batchZ.
+ *
+ * @param k the number of systems
+ * @param d the diagonal index y+z
+ * @param yBegin first row
+ * @param yEnd one past the last row
+ *
+ */
+void FluidSolver::batchUpperSweepRows(int k, int d, int yBegin, int yEnd)
+{
+	const float* plusX = &m_APlusX[0];
+	const float* plusY = &m_APlusY[0];
+	const float* plusZ = &m_APlusZ[0];
+	const float* precond = &m_precond[0];
+	const float* mask = &m_fluidMask[0];
+	const float* q = &m_batchQ[0];
+	float* x = &m_batchZ[0];
+	const size_t sx = k, sy = (size_t) m_gridX * k, sz = (size_t) m_slice * k;
+
+	for (int y=yBegin; y<yEnd; ++y) {
+		int z = d - y;
+		int pos = (m_gridX-1) + y * m_gridX + z * m_slice;
+		for (int i=m_gridX-1; i>=0; --i, --pos) {
+			float* out = x + (size_t) pos * k;
+			if (mask[pos] == 0.0f) {
+				std::fill(out, out + k, 0.0f);
+				continue;
+			}
+
+			const float* in = q + (size_t) pos * k;
+			float p = precond[pos];
+			float c0 = i+1 < m_gridX? plusX[pos] * p: 0.0f;
+			float c1 = y+1 < m_gridY? plusY[pos] * p: 0.0f;
+			float c2 = z+1 < m_gridZ? plusZ[pos] * p: 0.0f;
+			const float* x0 = i+1 < m_gridX? out + sx: out;
+			const float* x1 = y+1 < m_gridY? out + sy: out;
+			const float* x2 = z+1 < m_gridZ? out + sz: out;
+			std::fill(out, out + k, 0.0f);
+			for (int j=0; j<k; ++j)
+				out[j] = (in[j] - c0 * x0[j] - c1 * x1[j] - c2 * x2[j]) * p;
+		}
+	}
+}
+
+
+/**
+ * The k inner products of two sets of interleaved vectors, accumulated in double one
+ * slice per task. Without b, the sums of a over the fluid cells.
+ *
+ * @param a the first vectors
+ * @param b the second vectors, or NULL
+ * @param k the number of systems
+ * @param dots the k results
+ *
+ */
+void FluidSolver::batchDots(const float* a, const float* b, int k, std::vector<double>& dots)
+{
+	std::vector<double> sums((size_t) m_gridZ * k, 0.0);
+	m_pool->parallelFor(0, m_gridZ, boost::bind(&FluidSolver::batchDotSlices, this, a, b, k, &sums[0], _1, _2));
+
+	dots.assign(k, 0.0);
+	for (int z=0; z<m_gridZ; ++z) {
+		for (int j=0; j<k; ++j)
+			dots[j] += sums[z*k+j];
+	}
+}
+
+
+/**
+ * Per slice inner products of batchDots.
+ *
+ * @param a the first vectors
+ * @param b the second vectors, or NULL
+ * @param k the number of systems
+ * @param sums the k inner products of each slice
+ * @param zBegin first slice
+ * @param zEnd one past the last slice
+ *
+ */
+void FluidSolver::batchDotSlices(const float* a, const float* b, int k, double* sums, int zBegin, int zEnd) const
+{
+	const float* mask = &m_fluidMask[0];
+	for (int z=zBegin; z<zEnd; ++z) {
+		double* out = sums + (size_t) z * k;
+		for (int pos=z*m_slice; pos<(z+1)*m_slice; ++pos) {
+			const float* va = a + (size_t) pos * k;
+			if (b) {
+				const float* vb = b + (size_t) pos * k;
+				for (int j=0; j<k; ++j)
+					out[j] += va[j] * vb[j];
+			} else if (mask[pos] != 0.0f) {
+				for (int j=0; j<k; ++j)
+					out[j] += va[j];
+			}
+		}
+	}
+}
+
+
+/**
+ * x += alpha p and r -= alpha w for the k systems over the slices [zBegin, zEnd).
+ *
+ * @param alpha the step of each system
+ * @param k the number of systems
+ * @param zBegin first slice
+ * @param zEnd one past the last slice
+ *
+ */
+void FluidSolver::batchUpdateSlices(const float* alpha, int k, int zBegin, int zEnd)
+{
+	float* x = &m_batchX[0];
+	float* r = &m_batchR[0];
+	const float* p = &m_batchP[0];
+	const float* w = &m_batchW[0];
+
+	for (size_t i=(size_t) zBegin*m_slice*k; i<(size_t) zEnd*m_slice*k; i+=k) {
+		for (int j=0; j<k; ++j) {
+			x[i+j] += alpha[j] * p[i+j];
+			r[i+j] -= alpha[j] * w[i+j];
+		}
+	}
+}
+
+
+/**
+ * p = z + beta p for the k systems over the slices [zBegin, zEnd).
+ *
+ * @param beta the factor of each system
+ * @param k the number of systems
+ * @param zBegin first slice
+ * @param zEnd one past the last slice
+ *
+ */
+void FluidSolver::batchDirectionSlices(const float* beta, int k, int zBegin, int zEnd)
+{
+	float* p = &m_batchP[0];
+	const float* z = &m_batchZ[0];
+
+	for (size_t i=(size_t) zBegin*m_slice*k; i<(size_t) zEnd*m_slice*k; i+=k) {
+		for (int j=0; j<k; ++j)
+			p[i+j] = z[i+j] + beta[j] * p[i+j];
+	}
+}
+
+
+/**
+ * mixedPcgSolve solves in mixed precision with iterative refinement. The pressure is
+ * accumulated in double, and every refinement step computes the true residual 
+ * b - Ax in double and solves for the correction with PCG in float, to a relative 
+ * accuracy of 1e-3, using a bfloat16 copy of the MIC(0) factor. Inner products are
+ * accumulated in double. The low precision only has to be good enough to make the
+ * correction useful; the answer is as accurate as tol_cg asks since the stopping 
+ * test is made on the true residual. The MIC(0) sweeps then read 8 bytes per cell 
+ * instead of 16 plus the grid samples.
+ *
+ * @param b the vector representing the negative divergence
+ * @param x the resulting pressure gradient after the linear solve
+ * @return the residual, \f$\sqrt{r^T M^{-1} r}\f$
+ *
+ */
+float FluidSolver::mixedPcgSolve(const Vector& b, Vector& x)
+{
+	int rows = m_gridY * m_gridZ;
+	int grain = std::max(1, 4096 / m_gridX);
+	double tolerance = m_monitor.getTolerance() * m_monitor.getTolerance();
+	const double innerReduction = 1e-6; // of rho, i.e. 1e-3 of the residual
+
+	updateLowPrecision();
+	std::vector<double> pressure(x.begin(), x.end());
+
+	unsigned k = 0;
+	int refinements = 0;
+	double rho = 0.0;
+	while (true) {
+		// r = b - Ax in double, rounded to float for the correction
+		m_pool->parallelFor(0, rows, boost::bind(&FluidSolver::residualRows, this,
+			&pressure[0], &b[0], &m_tempR[0], _1, _2), grain);
+		lowPrecisionSolve(m_tempR, m_tempZ);
+		rho = innerProduct(m_tempR, m_tempZ);
+		if(rho!=rho){
+			std::cerr << "rho is nan!" << std::endl;
+			exit(1);
+		}
+		if (!m_monitor.proceed(rho, k))
+			break;
+
+		// Solve A d = r in float, d in m_tempS
+		double target = std::max(tolerance, innerReduction * rho);
+		double innerRho = rho;
+		std::fill(m_tempS.begin(), m_tempS.end(), 0.0f);
+		noalias(m_tempP) = m_tempZ;
+		while (k < maxiter_cg && innerRho > target) {
+			axpy_prod(m_tempP, m_tempW);
+			float alpha = (float) (innerRho / innerProduct(m_tempP, m_tempW));
+			noalias(m_tempS) += alpha * m_tempP;
+			noalias(m_tempR) -= alpha * m_tempW;
+
+			lowPrecisionSolve(m_tempR, m_tempZ);
+			double lastRho = innerRho;
+			innerRho = innerProduct(m_tempR, m_tempZ);
+			k++;
+
+			// The direction is not needed after the last inner iteration
+			if (k < maxiter_cg && innerRho > target)
+				m_tempP = m_tempZ + m_tempP * (float) (innerRho / lastRho);
+		}
+
+		for (int i=0; i<m_numPoints; ++i)
+			pressure[i] += m_tempS[i];
+		refinements++;
+	}
+	std::copy(pressure.begin(), pressure.end(), x.begin());
+
+	INFO() << "  + Mixed PCG: Residual after " << k << " iterations (" << refinements 
+		<< " refinements) : " << std::sqrt(rho);
+
+	return (float) std::sqrt(rho);
+}
+
+
+/**
+ * Computes the residual r = b - Ax for the x-rows [rowBegin, rowEnd) with x in double,
+ * so that the refinement steps of mixedPcgSolve see the true residual.
+ *
+ * @param x the current solution
+ * @param b the right hand side
+ * @param r the residual, rounded to float
+ * @param rowBegin first row, row j + k*gridY being (y=j, z=k)
+ * @param rowEnd one past the last row
+ *
+ */
+void FluidSolver::residualRows(const double* x, const float* b, float* r, int rowBegin, int rowEnd) const
+{
+	const float* mask = &m_fluidMask[0];
+	for (int row=rowBegin; row<rowEnd; ++row) {
+		int j = row % m_gridY;
+		int k = row / m_gridY;
+		int pos = row * m_gridX;
+		for (int i=0; i<m_gridX; ++i, ++pos) {
+			if (mask[pos] == 0.0f) {
+				r[pos] = 0.0f;
+				continue;
+			}
+			double sum = 0.0;
+			if (i > 0) sum += mask[pos-1] * (x[pos] - x[pos-1]);
+			if (i+1 < m_gridX) sum += mask[pos+1] * (x[pos] - x[pos+1]);
+			if (j > 0) sum += mask[pos-m_gridX] * (x[pos] - x[pos-m_gridX]);
+			if (j+1 < m_gridY) sum += mask[pos+m_gridX] * (x[pos] - x[pos+m_gridX]);
+			if (k > 0) sum += mask[pos-m_slice] * (x[pos] - x[pos-m_slice]);
+			if (k+1 < m_gridZ) sum += mask[pos+m_slice] * (x[pos] - x[pos+m_slice]);
+			r[pos] = (float) (b[pos] - m_matrixScale * sum);
+		}
+	}
+}
+
+
+/**
+ * fusedPcgSolve is the Chronopoulos-Gear variant of pcgSolve. The recurrences are 
+ * rearranged so that both inner products of an iteration are taken right after the 
+ * matrix-vector product, and the four vector updates share a single pass. Besides the 
+ * preconditioner, an iteration makes two sweeps over the grid instead of about ten.
+ *
+ * See: A.T. Chronopoulos, C.W. Gear. s-step iterative methods for symmetric linear 
+ * systems. J. Comput. Appl. Math. 25, pages 153-168, 1989.
+ *
+ * @param b the vector representing the negative divergence
+ * @param x the resulting pressure gradient after the linear solve
+ *
+ * @return float value representing the residual after the iterative solve
+ */
+float FluidSolver::fusedPcgSolve(const Vector& b, Vector& x)
+{
+	int rows = m_gridY * m_gridZ;
+	int grain = std::max(1, 4096 / m_gridX);
+	std::vector<double> dots(2 * rows);
+
+	axpy_prod(x, m_tempR);
+	m_tempR = b - m_tempR;
+	std::fill(m_tempP.begin(), m_tempP.end(), 0.0f);
+	std::fill(m_tempS.begin(), m_tempS.end(), 0.0f);
+
+	int k = 0;
+	float alpha = 0, beta = 0, gamma = 0, lastGamma = 0;
+	while (true) {
+		// u = M^-1 r, w = Au, gamma = (r, u), delta = (w, u)
+		solvePreconditioner(m_tempR, m_tempZ);
+		m_pool->parallelFor(0, rows, boost::bind(&FluidSolver::laplacianDotRows, this,
+			&m_tempZ[0], &m_tempW[0], &m_tempR[0], &dots[0], _1, _2), grain);
+
+		double g = 0.0, delta = 0.0;
+		for (int i=0; i<rows; ++i) {
+			g += dots[2*i];
+			delta += dots[2*i+1];
+		}
+		gamma = (float) g;
+		if (gamma != gamma) {
+			std::cerr << "gamma is nan!" << std::endl;
+			exit(1);
+		}
+
+		if (!m_monitor.proceed(gamma, k))
+			break;
+
+		if (k == 0) {
+			beta = 0;
+			alpha = gamma / delta;
+		} else {
+			beta = gamma / lastGamma;
+			alpha = gamma / (delta - beta * gamma / alpha);
+		}
+		lastGamma = gamma;
+
+		// p = u + beta p, s = w + beta s, x += alpha p, r -= alpha s
+		m_pool->parallelFor(0, m_gridZ, boost::bind(&FluidSolver::fusedUpdateSlices, this, alpha, beta, &x[0], _1, _2));
+		k++;
+	}
+
+	INFO() << "  + Fused PCG: Residual after " << k << " iterations : " << std::sqrt(gamma);
+
+	return std::sqrt(gamma);
+}
+
+
+/**
+ * The vector updates of one fusedPcgSolve iteration over the z-slices [zBegin, zEnd).
+ *
+ * @param alpha the step length
+ * @param beta the search direction update factor
+ * @param x the solution being updated
+ * @param zBegin first slice
+ * @param zEnd one past the last slice
+ *
+ */
+void FluidSolver::fusedUpdateSlices(float alpha, float beta, float* x, int zBegin, int zEnd)
+{
+	const float* u = &m_tempZ[0];
+	const float* w = &m_tempW[0];
+	float* p = &m_tempP[0];
+	float* s = &m_tempS[0];
+	float* r = &m_tempR[0];
+
+	for (int i=zBegin*m_slice; i<zEnd*m_slice; ++i) {
+		p[i] = u[i] + beta * p[i];
+		s[i] = w[i] + beta * s[i];
+		x[i] += alpha * p[i];
+		r[i] -= alpha * s[i];
+	}
+}
+
+
+/**
+ * Computes w = Au for the x-rows [rowBegin, rowEnd) together with the per row partial
+ * inner products (r, u) and (w, u), while the row is still in cache.
+ *
+ * @param u vector to be multiplied by A
+ * @param w result of Au
+ * @param r the residual
+ * @param dots two partial sums per row
+ * @param rowBegin first row
+ * @param rowEnd one past the last row
+ *
+ */
+void FluidSolver::laplacianDotRows(const float* u, float* w, const float* r, double* dots, int rowBegin, int rowEnd) const
+{
+	for (int row=rowBegin; row<rowEnd; ++row) {
+		laplacianRows(u, w, row, row+1);
+
+		float ru = 0.0f, wu = 0.0f;
+		for (int pos=row*m_gridX; pos<(row+1)*m_gridX; ++pos) {
+			ru += r[pos] * u[pos];
+			wu += w[pos] * u[pos];
+		}
+		dots[2*row] = ru;
+		dots[2*row+1] = wu;
+	}
+}
+
+
+/**
+ * deflatedPcgSolve is pcgSolve with the span of the past solutions in m_deflationW
+ * projected out of the search directions. The initial guess is first corrected by
+ * the Galerkin solution on that span, after which the residual is orthogonal to it
+ * and every search direction is kept A-orthogonal to it. Successive pressures are
+ * close to each other, so the slowly converging components are handled by the basis.
+ *
+ * See: Y. Saad, M. Yeung, J. Erhel, F. Guyomarc'h. A deflated version of the conjugate
+ * gradient algorithm. SIAM J. Sci. Comput. 21(5), pages 1909-1926, 2000.
+ *
+ * @param b the vector representing the negative divergence
+ * @param x the resulting pressure gradient after the linear solve
+ * @return the residual, \f$\sqrt{r^T M^{-1} r}\f$
+ *
+ */
+float FluidSolver::deflatedPcgSolve(const Vector& b, Vector& x)
+{
+	size_t m = m_deflationW.size();
+	std::vector<double> mu(m);
+
+	axpy_prod(x, m_tempR);
+	m_tempR = b - m_tempR;
+
+	// x += W E^-1 W^T r, r -= AW E^-1 W^T r
+	if (m > 0) {
+		deflationDots(m_deflationW, m_tempR, mu);
+		solveDeflationSystem(mu);
+		deflationUpdate(m_deflationW, mu, 1.0f, x);
+		deflationUpdate(m_deflationAW, mu, -1.0f, m_tempR);
+	}
+
+	int k = 0;
+	float beta = 0;
+	float lastRho = 0;
+	solvePreconditioner(m_tempR, m_tempZ);
+	float rho = inner_prod(m_tempR, m_tempZ);
+	if(rho!=rho){
+		std::cerr << "rho is nan!" << std::endl;
+		exit(1);
+	}
+
+	while (m_monitor.proceed(rho, k)) {
+		if (k == 0) {
+			noalias(m_tempP) = m_tempZ;
+		} else {
+			beta = rho / lastRho;
+			m_tempP = m_tempZ + m_tempP * beta;
+		}
+
+		// p -= W E^-1 (AW)^T z
+		if (m > 0) {
+			deflationDots(m_deflationAW, m_tempZ, mu);
+			solveDeflationSystem(mu);
+			deflationUpdate(m_deflationW, mu, -1.0f, m_tempP);
+		}
+
+		axpy_prod(m_tempP, m_tempW);
+		float denom = inner_prod(m_tempP, m_tempW);
+		float alpha = rho / denom;
+		noalias(x) += alpha * m_tempP;
+		noalias(m_tempR) -= alpha * m_tempW;
+
+		solvePreconditioner(m_tempR, m_tempZ);
+		lastRho = rho;
+		rho = inner_prod(m_tempR, m_tempZ);
+		k++;
+	}
+
+	INFO() << "  + Deflated PCG (" << m << " vectors): Residual after " << k << " iterations : " << std::sqrt(rho);
+
+	recycleSolution(x);
+	return std::sqrt(rho);
+}
+
+
+/**
+ * Computes the inner products of v with every vector of a deflation basis, in one
+ * parallel pass over the grid and accumulated in double.
+ *
+ * @param basis W or AW
+ * @param v the vector
+ * @param dots the inner products
+ *
+ */
+void FluidSolver::deflationDots(const std::deque<Vector>& basis, const Vector& v, std::vector<double>& dots)
+{
+	size_t m = basis.size();
+	std::vector<double> sums(m * m_gridZ, 0.0);
+	m_pool->parallelFor(0, m_gridZ, boost::bind(&FluidSolver::deflationDotSlices, this, 
+		&basis, &v[0], &sums[0], _1, _2));
+
+	dots.assign(m, 0.0);
+	for (int z=0; z<m_gridZ; ++z)
+		for (size_t j=0; j<m; ++j)
+			dots[j] += sums[z*m+j];
+}
+
+
+/**
+ * Per slice inner products of deflationDots, sums[z*m+j] = (basis_j, v) on slice z.
+ *
+ * @param basis W or AW
+ * @param v the vector
+ * @param sums the partial inner products
+ * @param zBegin first slice
+ * @param zEnd one past the last slice
+ *
+ */
+void FluidSolver::deflationDotSlices(const std::deque<Vector>* basis, const float* v, double* sums, int zBegin, int zEnd) const
+{
+	size_t m = basis->size();
+	for (int z=zBegin; z<zEnd; ++z) {
+		int first = z * m_slice;
+		for (size_t j=0; j<m; ++j) {
+			const float* w = &(*basis)[j][first];
+			double sum = 0.0;
+			for (int i=0; i<m_slice; ++i)
+				sum += w[i] * v[first+i];
+			sums[z*m+j] = sum;
+		}
+	}
+}
+
+
+/**
+ * v += sign * sum_j coefficients_j basis_j, in one parallel pass over the grid.
+ *
+ * @param basis W or AW
+ * @param coefficients the weight of each basis vector
+ * @param sign 1 or -1
+ * @param v the vector to update
+ *
+ */
+void FluidSolver::deflationUpdate(const std::deque<Vector>& basis, const std::vector<double>& coefficients, float sign, Vector& v)
+{
+	std::vector<float> c(coefficients.size());
+	for (size_t j=0; j<c.size(); ++j)
+		c[j] = sign * (float) coefficients[j];
+	m_pool->parallelFor(0, m_gridZ, boost::bind(&FluidSolver::deflationUpdateSlices, this, 
+		&basis, &c[0], &v[0], _1, _2));
+}
+
+
+/**
+ * Slices [zBegin, zEnd) of deflationUpdate.
+ *
+ * @param basis W or AW
+ * @param c the signed weight of each basis vector
+ * @param v the vector to update
+ * @param zBegin first slice
+ * @param zEnd one past the last slice
+ *
+ */
+void FluidSolver::deflationUpdateSlices(const std::deque<Vector>* basis, const float* c, float* v, int zBegin, int zEnd) const
+{
+	size_t m = basis->size();
+	for (int z=zBegin; z<zEnd; ++z) {
+		int first = z * m_slice;
+		for (size_t j=0; j<m; ++j) {
+			const float* w = &(*basis)[j][first];
+			for (int i=0; i<m_slice; ++i)
+				v[first+i] += c[j] * w[i];
+		}
+	}
+}
+
+
+/**
+ * Adds a solution to the deflation basis. It is A-orthogonalized against the vectors
+ * already in it and normalized, which keeps E = W^T A W well conditioned. The oldest
+ * vector is dropped once the basis is full, and solutions that are (nearly) in the
+ * span of the basis are not added.
+ *
+ * @param x the solution of the last pressure solve
+ *
+ */
+void FluidSolver::recycleSolution(const Vector& x)
+{
+	if (m_deflationSize == 0)
+		return;
+
+	Vector v(x);
+	Vector av(m_numPoints);
+	v = element_prod(v, m_fluidMask);
+	removeNullSpace(v);
+	axpy_prod(v, av);
+	double norm = innerProduct(v, av);
+	if (!(norm > 0.0))
+		return;
+
+	for (size_t j=0; j<m_deflationW.size(); ++j) {
+		double c = innerProduct(m_deflationAW[j], v) / innerProduct(m_deflationW[j], m_deflationAW[j]);
+		noalias(v) -= (float) c * m_deflationW[j];
+	}
+	axpy_prod(v, av);
+	double rest = innerProduct(v, av);
+	if (!(rest > 1e-4 * norm))
+		return;
+
+	if (m_deflationW.size() >= m_deflationSize) {
+		m_deflationW.pop_front();
+		m_deflationAW.pop_front();
+	}
+	float s = (float) (1.0 / std::sqrt(rest));
+	m_deflationW.push_back(v * s);
+	m_deflationAW.push_back(av * s);
+	factorDeflationSystem();
+}
+
+
+/**
+ * Computes E = W^T A W and its Cholesky factor into m_deflationE. Trailing vectors
+ * that make E numerically singular are dropped.
+ *
+ */
+void FluidSolver::factorDeflationSystem()
+{
+	size_t m = m_deflationW.size();
+	std::vector<double> e(m * m);
+	for (size_t i=0; i<m; ++i)
+		for (size_t j=0; j<=i; ++j)
+			e[i*m+j] = e[j*m+i] = 0.5 * (innerProduct(m_deflationW[i], m_deflationAW[j])
+				+ innerProduct(m_deflationW[j], m_deflationAW[i]));
+
+	m_deflationE.assign(m * m, 0.0);
+	for (size_t i=0; i<m; ++i) {
+		for (size_t j=0; j<=i; ++j) {
+			double sum = e[i*m+j];
+			for (size_t l=0; l<j; ++l)
+				sum -= m_deflationE[i*m+l] * m_deflationE[j*m+l];
+			if (i != j) {
+				m_deflationE[i*m+j] = sum / m_deflationE[j*m+j];
+			} else if (sum > 1e-6 * e[i*m+i]) {
+				m_deflationE[i*m+i] = std::sqrt(sum);
+			} else {
+				m_deflationW.resize(i);
+				m_deflationAW.resize(i);
+				factorDeflationSystem();
+				return;
+			}
+		}
+	}
+}
+
+
+/**
+ * Solves E y = rhs in place with the Cholesky factor of the deflation basis.
+ *
+ * @param y the right hand side, overwritten by the solution
+ *
+ */
+void FluidSolver::solveDeflationSystem(std::vector<double>& y) const
+{
+	size_t m = y.size();
+	for (size_t i=0; i<m; ++i) {
+		for (size_t l=0; l<i; ++l)
+			y[i] -= m_deflationE[i*m+l] * y[l];
+		y[i] /= m_deflationE[i*m+i];
+	}
+	for (size_t i=m; i-->0; ) {
+		for (size_t l=i+1; l<m; ++l)
+			y[i] -= m_deflationE[l*m+i] * y[l];
+		y[i] /= m_deflationE[i*m+i];
+	}
+}
+
+
+/**
+ * Keeps the deflation basis consistent when the matrix is multiplied by ratio.
+ *
+ * @param ratio the ratio of the new matrix to the old one
+ *
+ */
+void FluidSolver::rescaleDeflationBasis(float ratio)
+{
+	for (size_t j=0; j<m_deflationAW.size(); ++j)
+		m_deflationAW[j] *= ratio;
+	for (size_t i=0; i<m_deflationE.size(); ++i)
+		m_deflationE[i] *= std::sqrt((double) ratio);
+}
+
+
+/**
+ * Empties the deflation basis, which is needed whenever the solid cells change.
+ *
+ */
+void FluidSolver::clearDeflationBasis()
+{
+	m_deflationW.clear();
+	m_deflationAW.clear();
+	m_deflationE.clear();
+}
+
+
+/**
+ * axpy_prod computes y = Ax. This function provides an alternative to the BLAS function 
+ * axpy_prod for the pressure matrix, which is applied matrix-free: every coupling is 
+ * -m_matrixScale between two fluid cells, so the 7-point stencil only reads x and the 
+ * fluid mask, or only the face flags with the FACE_FLAGS stencil. The rows are split
+ * over the thread pool and vectorized along x.<br/>
+ * See <a href="http://www.boost.org/doc/libs/1_41_0/libs/numeric/ublas/doc/products.htm">the uBlas axpy_prod method</a> for more info.
+ *
+ * @param x vector to be multiplied by A
+ * @param y result of Ax
+ *
+ */
+void FluidSolver::axpy_prod(const Vector& x, Vector& y) const
+{
+	int grain = std::max(1, 4096 / m_gridX);
+	if (m_stencil == FACE_FLAGS)
+		m_pool->parallelFor(0, m_gridY * m_gridZ, boost::bind(&FluidSolver::laplacianFlagRows, this, &x[0], &y[0], _1, _2), grain);
+	else
+		m_pool->parallelFor(0, m_gridY * m_gridZ, boost::bind(&FluidSolver::laplacianRows, this, &x[0], &y[0], _1, _2), grain);
+}
+
+
+/**
+ * Row (i, j, k) of Ax, with bounds checks, for the cells the vector loop can't take.
+ *
+ * @param x vector to be multiplied by A
+ * @param pos the cell index
+ * @param i the x coordinate of the cell
+ * @param j the y coordinate of the cell
+ * @param k the z coordinate of the cell
+ *
+ * @return the row of Ax
+ */
+inline float FluidSolver::laplacianAt(const float* x, int pos, int i, int j, int k) const
+{
+	const float* mask = &m_fluidMask[0];
+	const float xc = x[pos];
+	float sum = 0.0f;
+
+	if (i > 0)          sum += mask[pos-1] * (xc - x[pos-1]);
+	if (i+1 < m_gridX)  sum += mask[pos+1] * (xc - x[pos+1]);
+	if (j > 0)          sum += mask[pos-m_gridX] * (xc - x[pos-m_gridX]);
+	if (j+1 < m_gridY)  sum += mask[pos+m_gridX] * (xc - x[pos+m_gridX]);
+	if (k > 0)          sum += mask[pos-m_slice] * (xc - x[pos-m_slice]);
+	if (k+1 < m_gridZ)  sum += mask[pos+m_slice] * (xc - x[pos+m_slice]);
+
+	return mask[pos] * m_matrixScale * sum;
+}
+
+
+/**
+ * Row pos of Ax from the face flags, for the cells at the ends of the x-rows.
+ *
+ * @param x vector to be multiplied by A
+ * @param pos the cell index
+ *
+ * @return the row of Ax
+ */
+inline float FluidSolver::laplacianFlagAt(const float* x, int pos) const
+{
+	unsigned flags = m_faceFlags[pos];
+	const float xc = x[pos];
+	float sum = 0.0f;
+
+	if (flags & FACE_MINUS_X) sum += xc - x[pos-1];
+	if (flags & FACE_PLUS_X)  sum += xc - x[pos+1];
+	if (flags & FACE_MINUS_Y) sum += xc - x[pos-m_gridX];
+	if (flags & FACE_PLUS_Y)  sum += xc - x[pos+m_gridX];
+	if (flags & FACE_MINUS_Z) sum += xc - x[pos-m_slice];
+	if (flags & FACE_PLUS_Z)  sum += xc - x[pos+m_slice];
+
+	return m_matrixScale * sum;
+}
+
+
+/**
+ * Computes y = Ax for the x-rows [rowBegin, rowEnd) from the face flags. Rows of
+ * neighbors outside the grid are replaced by the row itself, their flag being 0,
+ * so the loop over the inside of the row only has the flag tests, done as selects.
+ *
+ * @param x vector to be multiplied by A
+ * @param y result of Ax
+ * @param rowBegin first row
+ * @param rowEnd one past the last row
+ *
+ */
+void FluidSolver::laplacianFlagRows(const float* x, float* y, int rowBegin, int rowEnd) const
+{
+	const unsigned char* faces = &m_faceFlags[0];
+	const float scale = m_matrixScale;
+
+	for (int row=rowBegin; row<rowEnd; ++row) {
+		int j = row % m_gridY;
+		int k = row / m_gridY;
+		int first = row * m_gridX;
+		const unsigned char* flags = faces + first;
+		const float* xr = x + first;
+		const float* above = j > 0? xr - m_gridX: xr;
+		const float* below = j+1 < m_gridY? xr + m_gridX: xr;
+		const float* front = k > 0? xr - m_slice: xr;
+		const float* behind = k+1 < m_gridZ? xr + m_slice: xr;
+		float* yr = y + first;
+
+		for (int i=1; i<m_gridX-1; ++i) {
+			unsigned f = flags[i];
+			float xc = xr[i];
+			float sum = ((f & FACE_MINUS_X)? xc - xr[i-1]: 0.0f) + ((f & FACE_PLUS_X)? xc - xr[i+1]: 0.0f)
+				+ ((f & FACE_MINUS_Y)? xc - above[i]: 0.0f) + ((f & FACE_PLUS_Y)? xc - below[i]: 0.0f)
+				+ ((f & FACE_MINUS_Z)? xc - front[i]: 0.0f) + ((f & FACE_PLUS_Z)? xc - behind[i]: 0.0f);
+			yr[i] = scale * sum;
+		}
+
+		yr[0] = laplacianFlagAt(x, first);
+		if (m_gridX > 1) {
+			yr[m_gridX-1] = laplacianFlagAt(x, first+m_gridX-1);
+		}
+	}
+}
+
+
+/**
+ * Computes y = Ax for the x-rows [rowBegin, rowEnd), row r being y = r % m_gridY, 
+ * z = r / m_gridY. The interior of each row goes through the SIMD path.
+ *
+ * @param x vector to be multiplied by A
+ * @param y result of Ax
+ * @param rowBegin first row
+ * @param rowEnd one past the last row
+ *
+ */
+void FluidSolver::laplacianRows(const float* x, float* y, int rowBegin, int rowEnd) const
+{
+	using namespace simd;
+	const float* mask = &m_fluidMask[0];
+	const vfloat scale = set1(m_matrixScale);
+
+	for (int row=rowBegin; row<rowEnd; ++row) {
+		int j = row % m_gridY;
+		int k = row / m_gridY;
+		int first = row * m_gridX;
+		bool below = j > 0, above = j+1 < m_gridY;
+		bool front = k > 0, back = k+1 < m_gridZ;
+
+		int i = 1;
+		for (; i + WIDTH < m_gridX; i += WIDTH) {
+			int pos = first + i;
+			vfloat xc = load(x + pos);
+			vfloat sum = add(mul(load(mask + pos - 1), sub(xc, load(x + pos - 1))),
+							 mul(load(mask + pos + 1), sub(xc, load(x + pos + 1))));
+			if (below) sum = add(sum, mul(load(mask + pos - m_gridX), sub(xc, load(x + pos - m_gridX))));
+			if (above) sum = add(sum, mul(load(mask + pos + m_gridX), sub(xc, load(x + pos + m_gridX))));
+			if (front) sum = add(sum, mul(load(mask + pos - m_slice), sub(xc, load(x + pos - m_slice))));
+			if (back)  sum = add(sum, mul(load(mask + pos + m_slice), sub(xc, load(x + pos + m_slice))));
+			store(y + pos, mul(mul(load(mask + pos), scale), sum));
+		}
+		for (; i < m_gridX-1; ++i) {
+			y[first+i] = laplacianAt(x, first+i, i, j, k);
+		}
+
+		y[first] = laplacianAt(x, first, 0, j, k);
+		if (m_gridX > 1) {
+			y[first+m_gridX-1] = laplacianAt(x, first+m_gridX-1, m_gridX-1, j, k);
+		}
+	}
+}
+
+
+/**
+ * Removes the mean over the fluid cells from x, i.e. projects x onto the range of the
+ * (singular) pressure matrix. Solid cells are left untouched.
+ *
+ * @param x the vector to project
+ *
+ */
+void FluidSolver::removeNullSpace(Vector& x)
+{
+	if (m_fluidCells == 0)
+		return;
+
+	std::vector<double> sums(m_gridZ, 0.0);
+	m_pool->parallelFor(0, m_gridZ, boost::bind(&FluidSolver::sumSlices, this, &x[0], &sums[0], _1, _2));
+
+	double total = 0.0;
+	for (int z=0; z<m_gridZ; ++z)
+		total += sums[z];
+
+	float mean = (float) (total / m_fluidCells);
+	m_pool->parallelFor(0, m_gridZ, boost::bind(&FluidSolver::shiftSlices, this, &x[0], -mean, _1, _2));
+}
+
+
+/**
+ * Sums x over the fluid cells of each z-slice in [zBegin, zEnd).
+ *
+ * @param x the vector to sum
+ * @param sums one sum per slice
+ * @param zBegin first slice
+ * @param zEnd one past the last slice
+ *
+ */
+void FluidSolver::sumSlices(const float* x, double* sums, int zBegin, int zEnd) const
+{
+	const float* mask = &m_fluidMask[0];
+	for (int z=zBegin; z<zEnd; ++z) {
+		double sum = 0.0;
+		for (int pos=z*m_slice; pos<(z+1)*m_slice; ++pos)
+			sum += mask[pos] * x[pos];
+		sums[z] = sum;
+	}
+}
+
+
+/**
+ * Adds shift to x over the fluid cells of the z-slices in [zBegin, zEnd).
+ *
+ * @param x the vector to shift
+ * @param shift the value to add
+ * @param zBegin first slice
+ * @param zEnd one past the last slice
+ *
+ */
+void FluidSolver::shiftSlices(float* x, float shift, int zBegin, int zEnd) const
+{
+	const float* mask = &m_fluidMask[0];
+	for (int pos=zBegin*m_slice; pos<zEnd*m_slice; ++pos)
+		x[pos] += mask[pos] * shift;
+}
+
+
+/**
+ * Inner product accumulated in double, one slice per task.
+ *
+ * @param a the first vector
+ * @param b the second vector
+ * @return \f$a^T b\f$
+ *
+ */
+double FluidSolver::innerProduct(const Vector& a, const Vector& b)
+{
+	std::vector<double> sums(m_gridZ, 0.0);
+	m_pool->parallelFor(0, m_gridZ, boost::bind(&FluidSolver::dotSlices, this, &a[0], &b[0], &sums[0], _1, _2));
+
+	double total = 0.0;
+	for (int z=0; z<m_gridZ; ++z)
+		total += sums[z];
+	return total;
+}
+
+
+/**
+ * Per slice inner products of innerProduct.
+ *
+ * @param a the first vector
+ * @param b the second vector
+ * @param sums the inner product of each slice
+ * @param zBegin first slice
+ * @param zEnd one past the last slice
+ *
+ */
+void FluidSolver::dotSlices(const float* a, const float* b, double* sums, int zBegin, int zEnd) const
+{
+	for (int z=zBegin; z<zEnd; ++z) {
+		int first = z * m_slice;
+		double sum = 0.0;
+		for (int i=first; i<first+m_slice; ++i)
+			sum += a[i] * b[i];
+		sums[z] = sum;
+	}
+}
+
+
+/**
+ * solvePreconditioner applies the preconditioner, x = M^-1 b. For MIC0 this is a 
+ * forward and a backward triangular solve, scheduled as a wavefront over the x-rows
+ * so that it runs on the thread pool; for MULTIGRID a single V-cycle; for FAST_POISSON
+ * a direct solve with the matrix of the box without its solids, which is symmetric
+ * positive definite on the fluid cells since b vanishes on the solid ones; for 
+ * BLOCK_JACOBI independent MIC(0) solves of z-slabs, one slab per thread; for
+ * INCOMPLETE_POISSON two stencil passes with no dependencies between cells. The constant
+ * component of x is removed since all of them amplify it.
+ *
+ * @param b the vector to precondition
+ * @param x the result
+ *
+ */
+void FluidSolver::solvePreconditioner(const Vector& b, Vector& x)
+{
+	if (m_preconditioner == MULTIGRID) {
+		m_multigrid.vcycle(b, x);
+		removeNullSpace(x);
+		return;
+	}
+
+	if (m_preconditioner == FAST_POISSON) {
+		m_fastPoisson.solve(b, x, m_pool);
+		removeNullSpace(x);
+		return;
+	}
+
+	if (m_preconditioner == BLOCK_JACOBI) {
+		m_blockJacobi.solve(b, x, m_pool);
+		removeNullSpace(x);
+		return;
+	}
+
+	if (m_preconditioner == INCOMPLETE_POISSON) {
+		int grain = std::max(1, 4096 / m_gridX);
+		m_pool->parallelFor(0, m_gridY * m_gridZ, boost::bind(&FluidSolver::incompletePoissonLowerRows, this, &b[0], &m_tempQ[0], _1, _2), grain);
+		m_pool->parallelFor(0, m_gridY * m_gridZ, boost::bind(&FluidSolver::incompletePoissonUpperRows, this, &m_tempQ[0], &x[0], _1, _2), grain);
+		removeNullSpace(x);
+		return;
+	}
+
+	triangularSolve(b, x, &m_precond[0]);
+	removeNullSpace(x);
+}
+
+
+/**
+ * First pass of the incomplete Poisson preconditioner, u = K r with K = I - L D^-1,
+ * L being the strictly lower part of A, for the x-rows [rowBegin, rowEnd).
+ * M^-1 = K^T D^-1 K is the first order expansion of the inverse of the symmetric
+ * Gauss-Seidel splitting (D+L) D^-1 (D+L^T), so it is symmetric positive definite
+ * and every cell only reads its neighbors: both passes run like a matvec. The
+ * couplings to solids vanish with the inverse diagonal of the solid cell, and
+ * neighbors outside the grid read a row of zeros.
+ *
+ * See: M. Ament, G. Knittel, D. Weiskopf, W. Strasser. A Parallel Preconditioned
+ * Conjugate Gradient Solver for the Poisson Problem on a Multi-GPU Platform. PDP, 2010.
+ *
+ * @param r the vector to precondition
+ * @param u the result
+ * @param rowBegin first row (y + z*gridY)
+ * @param rowEnd one past the last row
+ *
+ */
+void FluidSolver::incompletePoissonLowerRows(const float* r, float* u, int rowBegin, int rowEnd) const
+{
+	using namespace simd;
+	const float* inv = &m_invDiag[0];
+	const float scale = m_matrixScale;
+	const vfloat vscale = set1(scale);
+	std::vector<float> zeros(m_gridX, 0.0f);
+
+	for (int row=rowBegin; row<rowEnd; ++row) {
+		int j = row % m_gridY;
+		int k = row / m_gridY;
+		int first = row * m_gridX;
+		const float* rr = r + first;
+		const float* ir = inv + first;
+		const float* rAbove = j > 0? rr - m_gridX: &zeros[0];
+		const float* iAbove = j > 0? ir - m_gridX: &zeros[0];
+		const float* rFront = k > 0? rr - m_slice: &zeros[0];
+		const float* iFront = k > 0? ir - m_slice: &zeros[0];
+		float* ur = u + first;
+
+		// -L_ij / d_j = scale / d_j for every open face to a cell before i
+		ur[0] = rr[0] + scale * (iAbove[0] * rAbove[0] + iFront[0] * rFront[0]);
+		int i = 1;
+		for (; i + WIDTH <= m_gridX; i += WIDTH) {
+			vfloat sum = add(add(mul(load(ir + i - 1), load(rr + i - 1)), mul(load(iAbove + i), load(rAbove + i))),
+							 mul(load(iFront + i), load(rFront + i)));
+			store(ur + i, add(load(rr + i), mul(vscale, sum)));
+		}
+		for (; i < m_gridX; ++i)
+			ur[i] = rr[i] + scale * (ir[i-1] * rr[i-1] + iAbove[i] * rAbove[i] + iFront[i] * rFront[i]);
+	}
+}
+
+
+/**
+ * Second pass of the incomplete Poisson preconditioner, z = K^T D^-1 u, for the
+ * x-rows [rowBegin, rowEnd). Solid cells get z = 0 from their zero inverse diagonal.
+ *
+ * @param u the result of the first pass
+ * @param z the result
+ * @param rowBegin first row (y + z*gridY)
+ * @param rowEnd one past the last row
+ *
+ */
+void FluidSolver::incompletePoissonUpperRows(const float* u, float* z, int rowBegin, int rowEnd) const
+{
+	using namespace simd;
+	const float* inv = &m_invDiag[0];
+	const float scale = m_matrixScale;
+	const vfloat vscale = set1(scale);
+	std::vector<float> zeros(m_gridX, 0.0f);
+
+	for (int row=rowBegin; row<rowEnd; ++row) {
+		int j = row % m_gridY;
+		int k = row / m_gridY;
+		int first = row * m_gridX;
+		const float* ur = u + first;
+		const float* ir = inv + first;
+		const float* uBelow = j+1 < m_gridY? ur + m_gridX: &zeros[0];
+		const float* iBelow = j+1 < m_gridY? ir + m_gridX: &zeros[0];
+		const float* uBehind = k+1 < m_gridZ? ur + m_slice: &zeros[0];
+		const float* iBehind = k+1 < m_gridZ? ir + m_slice: &zeros[0];
+		float* zr = z + first;
+
+		int i = 0;
+		for (; i + WIDTH < m_gridX; i += WIDTH) {
+			vfloat sum = add(add(mul(load(ir + i + 1), load(ur + i + 1)), mul(load(iBelow + i), load(uBelow + i))),
+							 mul(load(iBehind + i), load(uBehind + i)));
+			store(zr + i, mul(load(ir + i), add(load(ur + i), mul(vscale, sum))));
+		}
+		for (; i < m_gridX-1; ++i)
+			zr[i] = ir[i] * (ur[i] + scale * (ir[i+1] * ur[i+1] + iBelow[i] * uBelow[i] + iBehind[i] * uBehind[i]));
+		zr[m_gridX-1] = ir[m_gridX-1] * (ur[m_gridX-1] + scale * (iBelow[m_gridX-1] * uBelow[m_gridX-1] + iBehind[m_gridX-1] * uBehind[m_gridX-1]));
+	}
+}
+
+
+/**
+ * Solves with the incomplete factorization (E+L) E^-1 (E+U) of the pressure matrix,
+ * E being given by its pivots E^-1/2: a forward and a backward triangular solve,
+ * scheduled as a wavefront over the x-rows so that it runs on the thread pool.
+ *
+ * @param b the right hand side
+ * @param x the result
+ * @param pivots the inverse square roots of the diagonal of E
+ *
+ */
+void FluidSolver::triangularSolve(const Vector& b, Vector& x, const float* pivots)
+{
+	// The rows on a diagonal y+z = d only depend on the rows of diagonal d-1 (d+1 for
+	// the upper system), so each diagonal is swept in parallel, one x-row per task.
+	int diagonals = m_gridY + m_gridZ - 1;
+	int grain = std::max(1, 2048 / m_gridX);
+	const float* rhs = &b[0];
+	float* out = &x[0];
+
+	// Solve lower triangular system
+	for (int d=0; d<diagonals; ++d) {
+		int first = std::max(0, d - (m_gridZ-1));
+		int last = std::min(m_gridY-1, d);
+		if (m_stencil == FACE_FLAGS)
+			m_pool->parallelFor(first, last+1, boost::bind(&FluidSolver::lowerSweepRowsFlags, this, rhs, pivots, d, _1, _2), grain);
+		else
+			m_pool->parallelFor(first, last+1, boost::bind(&FluidSolver::lowerSweepRows, this, rhs, pivots, d, _1, _2), grain);
+	}
+
+	// Solve upper triangular system
+	for (int d=diagonals-1; d>=0; --d) {
+		int first = std::max(0, d - (m_gridZ-1));
+		int last = std::min(m_gridY-1, d);
+		if (m_stencil == FACE_FLAGS)
+			m_pool->parallelFor(first, last+1, boost::bind(&FluidSolver::upperSweepRowsFlags, this, out, pivots, d, _1, _2), grain);
+		else
+			m_pool->parallelFor(first, last+1, boost::bind(&FluidSolver::upperSweepRows, this, out, pivots, d, _1, _2), grain);
+	}
+
+}
+
+
+/**
+ * lowPrecisionSolve is the preconditioner of mixedPcgSolve. For MIC0 it runs the 
+ * wavefront of triangularSolve on the bfloat16 copy of the factor, which 
+ * updateLowPrecision must have refreshed; any other preconditioner is applied by 
+ * solvePreconditioner in float.
+ *
+ * @param b the vector to precondition
+ * @param x the result
+ *
+ */
+void FluidSolver::lowPrecisionSolve(const Vector& b, Vector& x)
+{
+	if (m_preconditioner != MIC0) {
+		solvePreconditioner(b, x);
+		return;
+	}
+
+	int diagonals = m_gridY + m_gridZ - 1;
+	int grain = std::max(1, 2048 / m_gridX);
+	const float* rhs = &b[0];
+	float* out = &x[0];
+
+	for (int d=0; d<diagonals; ++d) {
+		int first = std::max(0, d - (m_gridZ-1));
+		int last = std::min(m_gridY-1, d);
+		m_pool->parallelFor(first, last+1, boost::bind(&FluidSolver::lowerSweepRowsLow, this, rhs, d, _1, _2), grain);
+	}
+	for (int d=diagonals-1; d>=0; --d) {
+		int first = std::max(0, d - (m_gridZ-1));
+		int last = std::min(m_gridY-1, d);
+		m_pool->parallelFor(first, last+1, boost::bind(&FluidSolver::upperSweepRowsLow, this, out, d, _1, _2), grain);
+	}
+	removeNullSpace(x);
+}
+
+
+/**
+ * Forward substitution for the rows (y, d-y) of one diagonal, writing m_tempQ, with
+ * the couplings read from the face flags. Solid cells have a zero pivot, so they
+ * need no test of their own.
+ *
+ * @param b the right hand side
+ * @param precond the pivots of the factorization
+ * @param d the diagonal index y+z
+ * @param yBegin first row
+ * @param yEnd one past the last row
+ *
+ */
+void FluidSolver::lowerSweepRowsFlags(const float* b, const float* precond, int d, int yBegin, int yEnd)
+{
+	const unsigned char* faces = &m_faceFlags[0];
+	const float scale = m_matrixScale;
+	float* q = &m_tempQ[0];
+
+	for (int y=yBegin; y<yEnd; ++y) {
+		int z = d - y;
+		int pos = y * m_gridX + z * m_slice;
+		for (int x=0; x<m_gridX; ++x, ++pos) {
+			unsigned f = faces[pos];
+			float sum = 0.0f;
+			if (f & FACE_MINUS_X)
+				sum += precond[pos-1] * q[pos-1];
+			if (f & FACE_MINUS_Y)
+				sum += precond[pos-m_gridX] * q[pos-m_gridX];
+			if (f & FACE_MINUS_Z)
+				sum += precond[pos-m_slice] * q[pos-m_slice];
+
+			q[pos] = (b[pos] + scale * sum) * precond[pos];
+		}
+	}
+}
+
+
+/**
+ * Backward substitution for the rows (y, d-y) of one diagonal, reading m_tempQ, with
+ * the couplings read from the face flags.
+ *
+ * @param x the solution
+ * @param precond the pivots of the factorization
+ * @param d the diagonal index y+z
+ * @param yBegin first row
+ * @param yEnd one past the last row
+ *
+ */
+void FluidSolver::upperSweepRowsFlags(float* x, const float* precond, int d, int yBegin, int yEnd)
+{
+	const unsigned char* faces = &m_faceFlags[0];
+	const float scale = m_matrixScale;
+	const float* q = &m_tempQ[0];
+
+	for (int y=yBegin; y<yEnd; ++y) {
+		int z = d - y;
+		int pos = (m_gridX-1) + y * m_gridX + z * m_slice;
+		for (int i=m_gridX-1; i>=0; --i, --pos) {
+			unsigned f = faces[pos];
+			float sum = 0.0f;
+			if (f & FACE_PLUS_X)
+				sum += x[pos+1];
+			if (f & FACE_PLUS_Y)
+				sum += x[pos+m_gridX];
+			if (f & FACE_PLUS_Z)
+				sum += x[pos+m_slice];
+
+			float p = precond[pos];
+			x[pos] = (q[pos] + scale * p * sum) * p;
+		}
+	}
+}
+
+
+/**
+ * Forward substitution for the rows (y, d-y) of one diagonal, writing m_tempQ.
+ *
+ * @param b the right hand side
+ * @param precond the pivots of the factorization
+ * @param d the diagonal index y+z
+ * @param yBegin first row
+ * @param yEnd one past the last row
+ *
+ */
+void FluidSolver::lowerSweepRows(const float* b, const float* precond, int d, int yBegin, int yEnd)
+{
+	const float* plusX = &m_APlusX[0];
+	const float* plusY = &m_APlusY[0];
+	const float* plusZ = &m_APlusZ[0];
+	float* q = &m_tempQ[0];
+
+	for (int y=yBegin; y<yEnd; ++y) {
+		int z = d - y;
+		int pos = y * m_gridX + z * m_slice;
+		for (int x=0; x<m_gridX; ++x, ++pos) {
+			if (grid->isSolid(pos))
+				continue;
+
+			float temp = b[pos];
+			if (x > 0) {
+				temp -= plusX[pos-1] * precond[pos-1] * q[pos-1];
+			}
+			if (y > 0) {
+				temp -= plusY[pos-m_gridX] * precond[pos-m_gridX] * q[pos-m_gridX];
+			}
+			if (z > 0) {
+				temp -= plusZ[pos-m_slice] * precond[pos-m_slice] * q[pos-m_slice];
+			}
+
+			q[pos] = temp * precond[pos];
+		}
+	}
+}
+
+
+/**
+ * Backward substitution for the rows (y, d-y) of one diagonal, reading m_tempQ.
+ *
+ * @param x the solution
+ * @param precond the pivots of the factorization
+ * @param d the diagonal index y+z
+ * @param yBegin first row
+ * @param yEnd one past the last row
+ *
+ */
+void FluidSolver::upperSweepRows(float* x, const float* precond, int d, int yBegin, int yEnd)
+{
+	const float* plusX = &m_APlusX[0];
+	const float* plusY = &m_APlusY[0];
+	const float* plusZ = &m_APlusZ[0];
+	const float* q = &m_tempQ[0];
+
+	for (int y=yBegin; y<yEnd; ++y) {
+		int z = d - y;
+		int pos = (m_gridX-1) + y * m_gridX + z * m_slice;
+		for (int i=m_gridX-1; i>=0; --i, --pos) {
+			if (grid->isSolid(pos))
+				continue;
+
+			float temp = q[pos];
+			if (i+1 < m_gridX) {
+				temp -= plusX[pos] * precond[pos] * x[pos+1];
+			}
+			if (y+1 < m_gridY) {
+				temp -= plusY[pos] * precond[pos] * x[pos+m_gridX];
+			}
+			if (z+1 < m_gridZ) {
+				temp -= plusZ[pos] * precond[pos] * x[pos+m_slice];
+			}
+
+			x[pos] = temp * precond[pos];
+		}
+	}
+}
+
+
+
+/**
+ * Refreshes the bfloat16 copies of the MIC(0) factor read by lowPrecisionSolve after the 
+ * factor changed.
+ *
+ */
+void FluidSolver::updateLowPrecision()
+{
+	if (!m_lowPrecisionDirty || m_preconditioner != MIC0)
+		return;
+
+	m_precondLow.resize(m_numPoints);
+	m_couplingLowX.resize(m_numPoints);
+	m_couplingLowY.resize(m_numPoints);
+	m_couplingLowZ.resize(m_numPoints);
+	for (int pos=0; pos<m_numPoints; ++pos) {
+		float precond = grid->isSolid(pos)? 0.0f: m_precond[pos];
+		m_precondLow[pos] = toBFloat16(precond);
+		m_couplingLowX[pos] = toBFloat16(m_APlusX[pos] * precond);
+		m_couplingLowY[pos] = toBFloat16(m_APlusY[pos] * precond);
+		m_couplingLowZ[pos] = toBFloat16(m_APlusZ[pos] * precond);
+	}
+	m_lowPrecisionDirty = false;
+}
+
+
+/**
+ * lowerSweepRows on the bfloat16 factor. Solid cells have a zero pivot and zero
+ * couplings, so they come out as 0 without testing the grid.
+ *
+ * @param b the right hand side
+ * @param d the diagonal index y+z
+ * @param yBegin first row
+ * @param yEnd one past the last row
+ *
+ */
+void FluidSolver::lowerSweepRowsLow(const float* b, int d, int yBegin, int yEnd)
+{
+	const bfloat16* couplingX = &m_couplingLowX[0];
+	const bfloat16* couplingY = &m_couplingLowY[0];
+	const bfloat16* couplingZ = &m_couplingLowZ[0];
+	const bfloat16* precond = &m_precondLow[0];
+	float* q = &m_tempQ[0];
+
+	for (int y=yBegin; y<yEnd; ++y) {
+		int z = d - y;
+		int pos = y * m_gridX + z * m_slice;
+		for (int x=0; x<m_gridX; ++x, ++pos) {
+			float temp = b[pos];
+			if (x > 0) {
+				temp -= fromBFloat16(couplingX[pos-1]) * q[pos-1];
+			}
+			if (y > 0) {
+				temp -= fromBFloat16(couplingY[pos-m_gridX]) * q[pos-m_gridX];
+			}
+			if (z > 0) {
+				temp -= fromBFloat16(couplingZ[pos-m_slice]) * q[pos-m_slice];
+			}
+
+			q[pos] = temp * fromBFloat16(precond[pos]);
+		}
+	}
+}
+
+
+/**
+ * upperSweepRows on the bfloat16 factor.
+ *
+ * @param x the solution
+ * @param d the diagonal index y+z
+ * @param yBegin first row
+ * @param yEnd one past the last row
+ *
+ */
+void FluidSolver::upperSweepRowsLow(float* x, int d, int yBegin, int yEnd)
+{
+	const bfloat16* couplingX = &m_couplingLowX[0];
+	const bfloat16* couplingY = &m_couplingLowY[0];
+	const bfloat16* couplingZ = &m_couplingLowZ[0];
+	const bfloat16* precond = &m_precondLow[0];
+	const float* q = &m_tempQ[0];
+
+	for (int y=yBegin; y<yEnd; ++y) {
+		int z = d - y;
+		int pos = (m_gridX-1) + y * m_gridX + z * m_slice;
+		for (int i=m_gridX-1; i>=0; --i, --pos) {
+			float temp = q[pos];
+			if (i+1 < m_gridX) {
+				temp -= fromBFloat16(couplingX[pos]) * x[pos+1];
+			}
+			if (y+1 < m_gridY) {
+				temp -= fromBFloat16(couplingY[pos]) * x[pos+m_gridX];
+			}
+			if (z+1 < m_gridZ) {
+				temp -= fromBFloat16(couplingZ[pos]) * x[pos+m_slice];
+			}
+
+			x[pos] = temp * fromBFloat16(precond[pos]);
+		}
 	}
 }
 
@@ -116,6 +116,15 @@ int main(int argc, char **argv)
 	std::string grid_inputfile;			// grid input filename
 	double cg_tol = 1e-5;			 	// conjugate gradient tolerance
 	int cg_max_iter = 100;				// conjugate gradient max iterations
+	double cg_rtol = 0.0;				// fraction of the divergence left (0 = off)
+	std::string solver;				// linear solver (see FluidSolver::getSolverNames, empty = automatic)
+	std::string stencil = "arrays";			// pressure matrix storage (arrays or flags)
+	std::string advection = "semi-lagrangian";	// advection scheme (semi-lagrangian or maccormack)
+	std::string interpolation = "catmull-rom";	// density interpolation (lerp or catmull-rom)
+	std::string integration = "runge-kutta2";	// back-trace integrator (euler, runge-kutta2 or runge-kutta4)
+	std::string preconditioner = "MIC";		// pressure preconditioner (MIC, MG, FFT, BJ or IP)
+	int threads = 0;				// worker threads (0 = one per core)
+	double activity = -1.0;				// quiescent magnitude for active tiles (< 0 = off)
 	int max_step = 1000;				// max number of fluidsolver step
     
     float dt_save = 0;
@@ -145,6 +154,7 @@ int main(int argc, char **argv)
 	 */
 	try {
 		int opt;
+		std::string solverHelp = fdl::FluidSolver::getSolverNames() + " (default: FastPoisson without solids, PCG otherwise)";
 		po::options_description desc("Allowed options");
 		desc.add_options()
 			("help,h", "produce help message")
@@ -152,10 +162,16 @@ int main(int argc, char **argv)
 			("output-format,O", po::value<std::string>(), "output format")
 			("output-name,N", po::value<std::string>(&output_prefix), "output file name PREFIX")
 			("grid,G", po::value< std::vector<int> >(&grid_dims)->multitoken(), "[ X Y Z ]")
-			("solver,L", po::value< std::vector<std::string> >(), "[ PCG | CG | Jacobi | ocl_cg | ocl_jacobi ]")
+			("solver,L", po::value<std::string>(&solver), solverHelp.c_str())
 			("solver-tol", po::value<double>(&cg_tol), "linear solver convergence tolerance")
-			("integration,A", po::value< std::vector<std::string> >(), "[ euler | verlet | runge-kutta2 | runge-kutta4 ]")
-			("interp", po::value< std::vector<std::string> >(), "[ lerp | hat | gaussian | catmull-rom ]")
+			("solver-rtol", po::value<double>(&cg_rtol), "linear solver tolerance relative to the divergence (0 = off)")
+			("stencil", po::value<std::string>(&stencil), "[ arrays | flags ]")
+			("advection", po::value<std::string>(&advection), "[ semi-lagrangian | maccormack ]")
+			("preconditioner,P", po::value<std::string>(&preconditioner), "[ MIC | MG | FFT | BJ | IP ]")
+			("threads,j", po::value<int>(&threads), "number of worker threads (0 = one per core)")
+			("activity-threshold", po::value<double>(&activity), "skip tiles with nothing above this magnitude (< 0 = off)")
+			("integration,A", po::value<std::string>(&integration), "[ euler | runge-kutta2 | runge-kutta4 ]")
+			("interp", po::value<std::string>(&interpolation), "[ lerp | catmull-rom ]")
 			("timestep,T", po::value<double>(), "timestep update.")
 			("cell-width,D", po::value<double>(), "Width of a single cell.")
 			("vorticity", po::value<int>(&opt)->default_value(0), "Apply vortex computations.")
@@ -203,6 +219,18 @@ int main(int argc, char **argv)
 			xml_output_prefix = scene->GetXmlOutputPrefix();
 			cg_tol = scene->GetCGTol();
 			cg_max_iter = scene->GetCGMaxIter();
+			if (!vm.count("solver"))
+				solver = scene->GetSolverType(solver);
+			if (!vm.count("preconditioner"))
+				preconditioner = scene->GetPreconditioner(preconditioner);
+			if (!vm.count("stencil"))
+				stencil = scene->GetStencil(stencil);
+			if (!vm.count("advection"))
+				advection = scene->GetAdvection(advection);
+			if (!vm.count("interp"))
+				interpolation = scene->GetInterpolation(interpolation);
+			if (!vm.count("integration"))
+				integration = scene->GetIntegration(integration);
 			max_step = scene->GetMaxStep();
 
 			if(png_out || df3_out) {
@@ -296,8 +324,63 @@ int main(int argc, char **argv)
 	 * Fluidsolver construction
 	 */
 	fdl::FluidSolver* fs = new fdl::FluidSolver(macGrid);
+	if (threads > 0) fs->setNumberOfThreads(threads);
 	fs->setCGTolerance((float)cg_tol);
 	fs->setCGMaxIter(cg_max_iter);
+	fs->setRelativeTolerance((float)cg_rtol);
+	if (!solver.empty() && !fs->setSolver(solver)) {
+		std::cerr << "Unknown solver " << solver << ", expected one of " << fdl::FluidSolver::getSolverNames() << std::endl;
+		return 1;
+	}
+	if (stencil == "arrays")
+		fs->setStencil(fdl::COEFFICIENT_ARRAYS);
+	else if (stencil == "flags")
+		fs->setStencil(fdl::FACE_FLAGS);
+	else {
+		std::cerr << "Unknown stencil " << stencil << ", expected one of [ arrays | flags ]" << std::endl;
+		return 1;
+	}
+	if (advection == "semi-lagrangian")
+		fs->setAdvection(fdl::SEMI_LAGRANGIAN);
+	else if (advection == "maccormack")
+		fs->setAdvection(fdl::MACCORMACK);
+	else {
+		std::cerr << "Unknown advection " << advection << ", expected one of [ semi-lagrangian | maccormack ]" << std::endl;
+		return 1;
+	}
+	if (interpolation == "lerp")
+		fs->setInterpolation(fdl::LINEAR);
+	else if (interpolation == "catmull-rom")
+		fs->setInterpolation(fdl::CATMULLROM);
+	else {
+		std::cerr << "Unknown interpolation " << interpolation << ", expected one of [ lerp | catmull-rom ]" << std::endl;
+		return 1;
+	}
+	if (integration == "euler")
+		fs->setIntegration(fdl::EULER);
+	else if (integration == "runge-kutta2")
+		fs->setIntegration(fdl::RK2);
+	else if (integration == "runge-kutta4")
+		fs->setIntegration(fdl::RK4);
+	else {
+		std::cerr << "Unknown integration " << integration << ", expected one of [ euler | runge-kutta2 | runge-kutta4 ]" << std::endl;
+		return 1;
+	}
+	fs->setActivityThreshold((float)activity);
+	if (preconditioner == "MG")
+		fs->setPreconditioner(fdl::MULTIGRID);
+	else if (preconditioner == "FFT")
+		fs->setPreconditioner(fdl::FAST_POISSON);
+	else if (preconditioner == "BJ")
+		fs->setPreconditioner(fdl::BLOCK_JACOBI);
+	else if (preconditioner == "IP")
+		fs->setPreconditioner(fdl::INCOMPLETE_POISSON);
+	else if (preconditioner == "MIC")
+		fs->setPreconditioner(fdl::MIC0);
+	else {
+		std::cerr << "Unknown preconditioner " << preconditioner << ", expected one of [ MIC | MG | FFT | BJ | IP ]" << std::endl;
+		return 1;
+	}
 
 	//source and gravity parameters:
 	if(fs->checkSource(source_size, source_pos)) {
@@ -335,6 +418,13 @@ int main(int argc, char **argv)
 	scene->PutGridInputfile(grid_inputfile);
 	scene->PutCGTol(cg_tol);
 	scene->PutCGMaxIter(cg_max_iter);
+	if (!solver.empty())
+		scene->PutSolverType(solver);
+	scene->PutPreconditioner(preconditioner);
+	scene->PutStencil(stencil);
+	scene->PutAdvection(advection);
+	scene->PutInterpolation(interpolation);
+	scene->PutIntegration(integration);
 	scene->PutMaxStep(max_step);
 	scene->PutSourcePos(source_pos);
 	scene->PutSourceSize(source_size);
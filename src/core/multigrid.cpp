@@ -0,0 +1,377 @@
+#include <algorithm>
+
+#include "core/multigrid.h"
+#include "logger/logger.h"
+
+namespace fdl {
+
+/**
+ * Constructor.
+ *
+ */
+Multigrid::Multigrid() : m_smoothingSteps(2), m_coarseSweeps(32)
+{
+}
+
+/**
+ * Destructor.
+ *
+ */
+Multigrid::~Multigrid()
+{
+}
+
+
+/**
+ * Builds the level hierarchy from the finest 7-point matrix. Cells with a zero
+ * diagonal (solids or cells without fluid neighbors) are left out of every sweep.
+ *
+ * @param diag the diagonal of the finest matrix
+ * @param plusX the coupling of each cell to its +x neighbor
+ * @param plusY the coupling of each cell to its +y neighbor
+ * @param plusZ the coupling of each cell to its +z neighbor
+ * @param nx grid size in x
+ * @param ny grid size in y
+ * @param nz grid size in z
+ *
+ */
+void Multigrid::build(const Vector& diag, const Vector& plusX, const Vector& plusY, const Vector& plusZ,
+	int nx, int ny, int nz)
+{
+	m_levels.clear();
+	m_levels.reserve(16);
+
+	m_levels.push_back(Level());
+	Level& finest = m_levels.back();
+	finest.nx = nx;
+	finest.ny = ny;
+	finest.nz = nz;
+	finest.slice = nx * ny;
+	finest.numPoints = nx * ny * nz;
+	finest.diag = diag;
+	finest.plusX = plusX;
+	finest.plusY = plusY;
+	finest.plusZ = plusZ;
+	finest.x.resize(finest.numPoints);
+	finest.b.resize(finest.numPoints);
+	finest.r.resize(finest.numPoints);
+
+	while (m_levels.size() < 16 && m_levels.back().numPoints > 64) {
+		m_levels.push_back(Level());
+		coarsen(m_levels[m_levels.size()-2], m_levels.back());
+	}
+
+	INFO() << "    Multigrid hierarchy with " << m_levels.size() << " levels, coarsest "
+		<< m_levels.back().nx << "x" << m_levels.back().ny << "x" << m_levels.back().nz;
+}
+
+
+/**
+ * Multiplies every level by factor. The coarse operators are linear in the fine one,
+ * so this gives the hierarchy of the rescaled matrix without coarsening again.
+ *
+ * @param factor the ratio of the new matrix to the one the hierarchy was built from
+ *
+ */
+void Multigrid::rescale(float factor)
+{
+	for (size_t l=0; l<m_levels.size(); ++l) {
+		m_levels[l].diag *= factor;
+		m_levels[l].plusX *= factor;
+		m_levels[l].plusY *= factor;
+		m_levels[l].plusZ *= factor;
+	}
+}
+
+
+/**
+ * Applies one V-cycle to b starting from a zero guess, x ~= A^-1 b.
+ *
+ * @param b the right hand side
+ * @param x the result of the cycle
+ *
+ */
+void Multigrid::vcycle(const Vector& b, Vector& x)
+{
+	Level& finest = m_levels[0];
+	std::copy(b.begin(), b.end(), finest.b.begin());
+	std::fill(finest.x.begin(), finest.x.end(), 0.0f);
+
+	cycle(0);
+
+	std::copy(finest.x.begin(), finest.x.end(), x.begin());
+}
+
+
+/**
+ * Produces the next coarser level. Each coarse face sums the four fine faces it
+ * covers; halving that sum keeps the coarse operator consistent with the
+ * trilinear transfers (R = P^T) for a grid spacing twice as large.
+ *
+ * @param fine the level to coarsen
+ * @param coarse the level to fill
+ *
+ */
+void Multigrid::coarsen(const Level& fine, Level& coarse)
+{
+	coarse.nx = (fine.nx + 1) / 2;
+	coarse.ny = (fine.ny + 1) / 2;
+	coarse.nz = (fine.nz + 1) / 2;
+	coarse.slice = coarse.nx * coarse.ny;
+	coarse.numPoints = coarse.slice * coarse.nz;
+
+	coarse.diag.resize(coarse.numPoints);
+	coarse.plusX.resize(coarse.numPoints);
+	coarse.plusY.resize(coarse.numPoints);
+	coarse.plusZ.resize(coarse.numPoints);
+	coarse.x.resize(coarse.numPoints);
+	coarse.b.resize(coarse.numPoints);
+	coarse.r.resize(coarse.numPoints);
+	std::fill(coarse.diag.begin(), coarse.diag.end(), 0.0f);
+	std::fill(coarse.plusX.begin(), coarse.plusX.end(), 0.0f);
+	std::fill(coarse.plusY.begin(), coarse.plusY.end(), 0.0f);
+	std::fill(coarse.plusZ.begin(), coarse.plusZ.end(), 0.0f);
+
+	for (int z=0; z<fine.nz; ++z) {
+		for (int y=0; y<fine.ny; ++y) {
+			for (int x=0; x<fine.nx; ++x) {
+				int pos = x + y * fine.nx + z * fine.slice;
+				int cpos = x/2 + (y/2) * coarse.nx + (z/2) * coarse.slice;
+
+				/* Only the faces between two aggregates survive */
+				if ((x & 1) && x+1 < fine.nx)
+					coarse.plusX[cpos] += 0.5f * fine.plusX[pos];
+				if ((y & 1) && y+1 < fine.ny)
+					coarse.plusY[cpos] += 0.5f * fine.plusY[pos];
+				if ((z & 1) && z+1 < fine.nz)
+					coarse.plusZ[cpos] += 0.5f * fine.plusZ[pos];
+			}
+		}
+	}
+
+	/* Zero row sums, as in the finest matrix */
+	for (int z=0, pos=0; z<coarse.nz; ++z) {
+		for (int y=0; y<coarse.ny; ++y) {
+			for (int x=0; x<coarse.nx; ++x, ++pos) {
+				float d = coarse.plusX[pos] + coarse.plusY[pos] + coarse.plusZ[pos];
+				if (x > 0) d += coarse.plusX[pos-1];
+				if (y > 0) d += coarse.plusY[pos-coarse.nx];
+				if (z > 0) d += coarse.plusZ[pos-coarse.slice];
+				coarse.diag[pos] = -d;
+			}
+		}
+	}
+}
+
+
+/**
+ * Recursive V-cycle on level l, solving for l.x given l.b. The post-smoother visits
+ * the colors in reverse order so that the cycle stays symmetric.
+ *
+ * @param l the level index
+ *
+ */
+void Multigrid::cycle(int l)
+{
+	Level& level = m_levels[l];
+
+	if (l == (int) m_levels.size()-1) {
+		for (int i=0; i<m_coarseSweeps; ++i) {
+			smooth(level, 0);
+			smooth(level, 1);
+			smooth(level, 1);
+			smooth(level, 0);
+		}
+		return;
+	}
+
+	for (int i=0; i<m_smoothingSteps; ++i) {
+		smooth(level, 0);
+		smooth(level, 1);
+	}
+
+	Level& coarse = m_levels[l+1];
+	residual(level);
+	restrictResidual(level, coarse);
+	std::fill(coarse.x.begin(), coarse.x.end(), 0.0f);
+	cycle(l+1);
+	prolongate(coarse, level);
+
+	for (int i=0; i<m_smoothingSteps; ++i) {
+		smooth(level, 1);
+		smooth(level, 0);
+	}
+}
+
+
+/**
+ * One Gauss-Seidel half sweep over the cells with (x+y+z)%2 == color.
+ *
+ * @param l the level to smooth
+ * @param color the parity of the cells to update
+ *
+ */
+void Multigrid::smooth(Level& l, int color)
+{
+	const float* diag = &l.diag[0];
+	const float* plusX = &l.plusX[0];
+	const float* plusY = &l.plusY[0];
+	const float* plusZ = &l.plusZ[0];
+	const float* b = &l.b[0];
+	float* x = &l.x[0];
+
+	for (int z=0; z<l.nz; ++z) {
+		for (int y=0; y<l.ny; ++y) {
+			int start = (y + z + color) & 1;
+			int pos = start + y * l.nx + z * l.slice;
+			for (int i=start; i<l.nx; i+=2, pos+=2) {
+				if (diag[pos] == 0.0f)
+					continue;
+
+				float sum = b[pos];
+				if (i > 0)        sum -= plusX[pos-1] * x[pos-1];
+				if (i+1 < l.nx)   sum -= plusX[pos] * x[pos+1];
+				if (y > 0)        sum -= plusY[pos-l.nx] * x[pos-l.nx];
+				if (y+1 < l.ny)   sum -= plusY[pos] * x[pos+l.nx];
+				if (z > 0)        sum -= plusZ[pos-l.slice] * x[pos-l.slice];
+				if (z+1 < l.nz)   sum -= plusZ[pos] * x[pos+l.slice];
+				x[pos] = sum / diag[pos];
+			}
+		}
+	}
+}
+
+
+/**
+ * Computes r = b - Ax on a level.
+ *
+ * @param l the level
+ *
+ */
+void Multigrid::residual(Level& l)
+{
+	const float* diag = &l.diag[0];
+	const float* plusX = &l.plusX[0];
+	const float* plusY = &l.plusY[0];
+	const float* plusZ = &l.plusZ[0];
+	const float* b = &l.b[0];
+	const float* x = &l.x[0];
+	float* r = &l.r[0];
+
+	for (int z=0, pos=0; z<l.nz; ++z) {
+		for (int y=0; y<l.ny; ++y) {
+			for (int i=0; i<l.nx; ++i, ++pos) {
+				if (diag[pos] == 0.0f) {
+					r[pos] = 0.0f;
+					continue;
+				}
+
+				float sum = b[pos] - diag[pos] * x[pos];
+				if (i > 0)        sum -= plusX[pos-1] * x[pos-1];
+				if (i+1 < l.nx)   sum -= plusX[pos] * x[pos+1];
+				if (y > 0)        sum -= plusY[pos-l.nx] * x[pos-l.nx];
+				if (y+1 < l.ny)   sum -= plusY[pos] * x[pos+l.nx];
+				if (z > 0)        sum -= plusZ[pos-l.slice] * x[pos-l.slice];
+				if (z+1 < l.nz)   sum -= plusZ[pos] * x[pos+l.slice];
+				r[pos] = sum;
+			}
+		}
+	}
+}
+
+
+/**
+ * Cell-centered trilinear weights from a fine cell to the 2x2x2 nearest coarse cells.
+ * Weights that would land outside the grid or on an inactive coarse cell are folded
+ * back onto the parent, which keeps constants exact next to walls and solids.
+ */
+static inline void transferStencil(int x, int y, int z, int cnx, int cny, int cnz, const float* cdiag,
+	int* index, float* weight)
+{
+	int X = x/2, Y = y/2, Z = z/2;
+	int nX = X + ((x & 1)? 1: -1);
+	int nY = Y + ((y & 1)? 1: -1);
+	int nZ = Z + ((z & 1)? 1: -1);
+	int cslice = cnx * cny;
+	int parent = X + Y * cnx + Z * cslice;
+
+	for (int n=0; n<8; ++n) {
+		int cx = (n & 1)? nX: X;
+		int cy = (n & 2)? nY: Y;
+		int cz = (n & 4)? nZ: Z;
+		float w = ((n & 1)? 0.25f: 0.75f) * ((n & 2)? 0.25f: 0.75f) * ((n & 4)? 0.25f: 0.75f);
+		int cpos = cx + cy * cnx + cz * cslice;
+
+		if (cx < 0 || cy < 0 || cz < 0 || cx >= cnx || cy >= cny || cz >= cnz || cdiag[cpos] == 0.0f)
+			cpos = parent;
+
+		index[n] = cpos;
+		weight[n] = w;
+	}
+}
+
+
+/**
+ * Restriction, the transpose of prolongate.
+ *
+ * @param fine the level holding the residual
+ * @param coarse the level whose right hand side is filled
+ *
+ */
+void Multigrid::restrictResidual(const Level& fine, Level& coarse)
+{
+	std::fill(coarse.b.begin(), coarse.b.end(), 0.0f);
+
+	const float* fdiag = &fine.diag[0];
+	const float* cdiag = &coarse.diag[0];
+	const float* r = &fine.r[0];
+	float* b = &coarse.b[0];
+	int index[8];
+	float weight[8];
+
+	for (int z=0, pos=0; z<fine.nz; ++z) {
+		for (int y=0; y<fine.ny; ++y) {
+			for (int x=0; x<fine.nx; ++x, ++pos) {
+				if (fdiag[pos] == 0.0f)
+					continue;
+				transferStencil(x, y, z, coarse.nx, coarse.ny, coarse.nz, cdiag, index, weight);
+				for (int n=0; n<8; ++n)
+					b[index[n]] += weight[n] * r[pos];
+			}
+		}
+	}
+}
+
+
+/**
+ * Trilinear prolongation of the coarse correction, added to the fine solution.
+ *
+ * @param coarse the level holding the correction
+ * @param fine the level to correct
+ *
+ */
+void Multigrid::prolongate(const Level& coarse, Level& fine)
+{
+	const float* fdiag = &fine.diag[0];
+	const float* cdiag = &coarse.diag[0];
+	const float* e = &coarse.x[0];
+	float* x = &fine.x[0];
+	int index[8];
+	float weight[8];
+
+	for (int z=0, pos=0; z<fine.nz; ++z) {
+		for (int y=0; y<fine.ny; ++y) {
+			for (int i=0; i<fine.nx; ++i, ++pos) {
+				if (fdiag[pos] == 0.0f)
+					continue;
+				transferStencil(i, y, z, coarse.nx, coarse.ny, coarse.nz, cdiag, index, weight);
+				float sum = 0.0f;
+				for (int n=0; n<8; ++n)
+					sum += weight[n] * e[index[n]];
+				x[pos] += sum;
+			}
+		}
+	}
+}
+
+}	// namespace fdl
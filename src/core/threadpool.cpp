@@ -0,0 +1,120 @@
+#include <algorithm>
+
+#include "core/threadpool.h"
+#include "logger/logger.h"
+
+namespace fdl {
+
+/**
+ * Constructor. Starts threads-1 workers, the calling thread being the last one.
+ *
+ * @param threads number of threads, zero or less for one per hardware thread
+ *
+ */
+ThreadPool::ThreadPool(int threads) : m_task(NULL), m_begin(0), m_end(0), m_chunks(0),
+	m_pending(0), m_generation(0), m_quit(false)
+{
+	if (threads <= 0)
+		threads = (int) boost::thread::hardware_concurrency();
+	m_numThreads = std::max(threads, 1);
+
+	for (int i=1; i<m_numThreads; ++i)
+		m_threads.create_thread(boost::bind(&ThreadPool::worker, this, i));
+
+	INFO() << "ThreadPool: started " << m_numThreads << " threads";
+}
+
+/**
+ * Destructor. Wakes the workers up and joins them.
+ *
+ */
+ThreadPool::~ThreadPool()
+{
+	{
+		boost::mutex::scoped_lock lock(m_mutex);
+		m_quit = true;
+	}
+	m_start.notify_all();
+	m_threads.join_all();
+}
+
+
+/**
+ * Splits [begin, end) into one contiguous chunk per thread and runs task on each,
+ * returning once every chunk is done. Ranges with fewer than two grains are run
+ * on the calling thread.
+ *
+ * @param begin first index
+ * @param end one past the last index
+ * @param task the function called with each sub-range
+ * @param grain the minimum number of indices per chunk
+ *
+ */
+void ThreadPool::parallelFor(int begin, int end, const Task& task, int grain)
+{
+	int n = end - begin;
+	if (n <= 0)
+		return;
+
+	int chunks = std::min(m_numThreads, (n + grain - 1) / std::max(grain, 1));
+	if (chunks <= 1) {
+		task(begin, end);
+		return;
+	}
+
+	{
+		boost::mutex::scoped_lock lock(m_mutex);
+		m_task = &task;
+		m_begin = begin;
+		m_end = end;
+		m_chunks = chunks;
+		m_pending = chunks - 1;
+		++m_generation;
+	}
+	m_start.notify_all();
+
+	task(begin, begin + n / chunks);
+
+	boost::mutex::scoped_lock lock(m_mutex);
+	while (m_pending > 0)
+		m_done.wait(lock);
+	m_task = NULL;
+}
+
+
+/**
+ * Worker loop, runs chunk id of every loop until the pool is destroyed.
+ *
+ * @param id the chunk index handled by this thread
+ *
+ */
+void ThreadPool::worker(int id)
+{
+	unsigned seen = 0;
+	boost::mutex::scoped_lock lock(m_mutex);
+
+	while (true) {
+		while (m_generation == seen && !m_quit)
+			m_start.wait(lock);
+		if (m_quit)
+			return;
+		seen = m_generation;
+
+		if (id >= m_chunks)
+			continue;
+
+		const Task* task = m_task;
+		long n = m_end - m_begin;
+		int first = m_begin + (int) (n * id / m_chunks);
+		int last = m_begin + (int) (n * (id + 1) / m_chunks);
+
+		lock.unlock();
+		(*task)(first, last);
+		lock.lock();
+
+		if (--m_pending == 0)
+			m_done.notify_one();
+	}
+}
+
+}	// namespace fdl
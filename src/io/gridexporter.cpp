@@ -152,7 +152,7 @@ Grid* GridExporter::load(std::string filenameGrid)
 	std::ifstream file;
 	file.open(filenameGrid.c_str());
 
-	if (file == NULL) {
+	if (!file.is_open()) {
 		ERROR() << " Couldn't read file " << filenameGrid << "!";
 		return grid;
 	}
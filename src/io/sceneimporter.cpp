@@ -9,7 +9,7 @@
 		<grid x="50" y="50" z="50" />
 		<output-format>PNG</output-format>
 		<output-name>density_export_</output-name>
-		<solver tolerance="0.00001" maxIterations="100" />
+		<solver type="PCG" tolerance="0.00001" maxIterations="100" preconditioner="MIC" />
 	</settings>
 	<source>
 		<pos x="1.0" y="0.0" z="0.5" />